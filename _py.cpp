@@ -5,11 +5,16 @@
 // This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
 //
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <uuid/uuid.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -63,6 +68,12 @@ _py_SystemExit::_py_SystemExit(int code)
 {
 }
 
+_py_SystemExit::_py_SystemExit(int code, const char * msg)
+    : _py_ExceptionBase(msg)
+    , m_Code(code)
+{
+}
+
 const char * _py_SystemExit::what() const throw()
 {
     return m_Msg != NULL ? m_Msg : "System exit";
@@ -107,226 +118,605 @@ const char * _py_OSError::what() const throw()
     return m_Msg != NULL ? m_Msg : "OS error";
 }
 
+// _py_ValueError
+
+_py_ValueError::_py_ValueError(void)
+    : _py_ExceptionBase()
+{
+}
+
+_py_ValueError::_py_ValueError(const char * msg)
+    : _py_ExceptionBase(msg)
+{
+}
+
+const char * _py_ValueError::what() const throw()
+{
+    return m_Msg != NULL ? m_Msg : "Value error";
+}
+
 //
-// PY_STRING
+// Statistics
+//
+// Counters of each thread are linked into py_stats_threads, at thread exit
+// they are added to py_stats_retired.  Counters of thread that could not be
+// allocated go to shared py_stats_lost.
 //
 
-typedef struct py_string_info
+typedef struct py_stats_block
 {
-    int     bytes_num;                  // Number of allocated bytes for buffer for storing string - sizeof(PY_STRING_INFO), can be > strlen(PY_STRING::m_Buffer)
-    int     ref_cnt;                    // Reference counter for string
-} PY_STRING_INFO;
+    PY_STATS                stats;
+    struct py_stats_block * prev;
+    struct py_stats_block * next;
+} PY_STATS_BLOCK;
 
-PY_STRING::PY_STRING(void)
-    : m_Buffer(NULL)
+__thread PY_STATS *         py_stats_current = NULL;
+
+static PY_STATS_BLOCK *     py_stats_threads = NULL;
+static PY_STATS             py_stats_retired;
+static PY_STATS             py_stats_lost;
+static pthread_mutex_t      py_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t        py_stats_key;
+static pthread_once_t       py_stats_once = PTHREAD_ONCE_INIT;
+
+static void py_stats_add(PY_STATS & sum, const PY_STATS & stats)
 {
+    sum.allocs += stats.allocs;
+    sum.alloc_bytes += stats.alloc_bytes;
+    sum.forks += stats.forks;
+    sum.cfs_reads += stats.cfs_reads;
+    sum.cfs_writes += stats.cfs_writes;
+    sum.cfs_mkdirs += stats.cfs_mkdirs;
+    sum.cfs_rmdirs += stats.cfs_rmdirs;
+    sum.cfs_stats += stats.cfs_stats;
+    sum.cfs_listdirs += stats.cfs_listdirs;
 }
 
-PY_STRING::PY_STRING(const PY_STRING & other)
-    : m_Buffer(NULL)
+static void py_stats_exit(void * arg)
 {
-    char *              other_str = (char *) other;
-    PY_STRING_INFO *    info;
+    PY_STATS_BLOCK * block = (PY_STATS_BLOCK *) arg;
 
-    if (other_str == NULL)
-        return;
+    // Later destructors of exiting thread register new block if they allocate
+    py_stats_current = NULL;
 
-    // Increment external ref_cnt
-    info = (PY_STRING_INFO *) (other_str - sizeof(PY_STRING_INFO));
-    info->ref_cnt ++;
+    pthread_mutex_lock(&py_stats_mutex);
+    py_stats_add(py_stats_retired, block->stats);
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        py_stats_threads = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    pthread_mutex_unlock(&py_stats_mutex);
 
-    m_Buffer = other_str;
+    free(block);
 }
 
-PY_STRING::PY_STRING(const char * str)
-    : m_Buffer(NULL)
+static void py_stats_init(void)
 {
-    if ((str == NULL) || (*str == '\0'))
-        return;
+    pthread_key_create(&py_stats_key, py_stats_exit);
+}
 
-    int                 bytes_num_req = strlen(str) + 1;
-    PY_STRING_INFO *    info;
+PY_STATS * _py_stats_new(void)
+{
+    PY_STATS_BLOCK * block;
 
-    m_Buffer = (char *) malloc(sizeof(PY_STRING_INFO) + bytes_num_req);
-    if (m_Buffer == NULL)
-        throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
-    info = (PY_STRING_INFO *) m_Buffer;
-    m_Buffer += sizeof(PY_STRING_INFO);
+    pthread_once(&py_stats_once, py_stats_init);
 
-    info->bytes_num = bytes_num_req;
-    info->ref_cnt = 1;
-    memmove(m_Buffer, str, bytes_num_req);
+    // malloc() as _py_malloc() counts into this block
+    block = (PY_STATS_BLOCK *) calloc(1, sizeof(PY_STATS_BLOCK));
+    if (block == NULL)
+        return &py_stats_lost;
+
+    pthread_mutex_lock(&py_stats_mutex);
+    block->next = py_stats_threads;
+    if (py_stats_threads != NULL)
+        py_stats_threads->prev = block;
+    py_stats_threads = block;
+    pthread_mutex_unlock(&py_stats_mutex);
+
+    pthread_setspecific(py_stats_key, block);
+    py_stats_current = &block->stats;
+    return py_stats_current;
 }
 
-PY_STRING::~PY_STRING(void)
+void _py_stats(PY_STATS & stats)
 {
-    if (m_Buffer == NULL)
-        return;
+    PY_STATS_BLOCK * block;
 
-    PY_STRING_INFO * info = (PY_STRING_INFO *) (m_Buffer - sizeof(PY_STRING_INFO));
+    memset(&stats, 0, sizeof(stats));
 
-    info->ref_cnt --;
-    if (info->ref_cnt == 0)
-        free(info);
+    pthread_mutex_lock(&py_stats_mutex);
+    py_stats_add(stats, py_stats_retired);
+    py_stats_add(stats, py_stats_lost);
+    for (block = py_stats_threads; block != NULL; block = block->next)
+        py_stats_add(stats, block->stats);
+    pthread_mutex_unlock(&py_stats_mutex);
 }
 
-PY_STRING & PY_STRING::operator=(const PY_STRING & rs)
+//
+// Memory allocation
+//
+// Every block is preceded by PY_ARENA_HDR naming its arena chunk, NULL for
+// blocks from malloc().  Chunk is freed when its arena scope has ended and
+// all its blocks were freed, so blocks can safely outlive the scope.
+//
+
+typedef struct py_arena_chunk
 {
-    if (this == &rs)
-        return *this;
+    struct py_arena_chunk * next;
+    size_t                  bytes_num;          // Usable bytes after chunk header
+    size_t                  bytes_used;
+    int                     ref_cnt;            // Live blocks + 1 for arena scope, updated atomically
+} PY_ARENA_CHUNK;
+
+typedef union
+{
+    PY_ARENA_CHUNK *    chunk;
+    double              align[2];               // Keeps blocks 16 bytes aligned
+} PY_ARENA_HDR;
 
-    char *              rs_str = (char *) rs;
-    PY_STRING_INFO *    info = NULL;
+#define PY_ARENA_ALIGN(n)               (((n) + sizeof(PY_ARENA_HDR) - 1) & ~(sizeof(PY_ARENA_HDR) - 1))
+#define PY_ARENA_CACHED_CHUNKS_MAX      4
+
+static __thread PY_ARENA *          py_arena_current = NULL;
+static __thread PY_ARENA_CHUNK *    py_arena_cached = NULL;        // Chunks kept for next arena scope
+static __thread int                 py_arena_cached_num = 0;
+
+static PY_ARENA_CHUNK * py_arena_chunk_new(size_t bytes_num)
+{
+    PY_ARENA_CHUNK * chunk;
 
-    // Decrement internal ref_cnt
-    if (m_Buffer != NULL)
+    if ((py_arena_cached != NULL) && (py_arena_cached->bytes_num >= bytes_num))
     {
-        info = (PY_STRING_INFO *) (m_Buffer - sizeof(PY_STRING_INFO));
-        info->ref_cnt --;
-        if (info->ref_cnt == 0)
-            free(info);
-        m_Buffer = NULL;
+        chunk = py_arena_cached;
+        py_arena_cached = chunk->next;
+        py_arena_cached_num --;
     }
+    else
+    {
+        chunk = (PY_ARENA_CHUNK *) malloc(PY_ARENA_ALIGN(sizeof(PY_ARENA_CHUNK)) + bytes_num);
+        if (chunk == NULL)
+            throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
+        chunk->bytes_num = bytes_num;
+    }
+    chunk->next = NULL;
+    chunk->bytes_used = 0;
+    chunk->ref_cnt = 1;
+    return chunk;
+}
 
-    // Increment external ref_cnt
-    if (rs_str != NULL)
+// Drops one reference, chunk without references is cached or freed
+static void py_arena_chunk_put(PY_ARENA_CHUNK * chunk, bool cache)
+{
+    if (__sync_sub_and_fetch(&chunk->ref_cnt, 1) != 0)
+        return;
+
+    if (cache && (py_arena_cached_num < PY_ARENA_CACHED_CHUNKS_MAX))
     {
-        info = (PY_STRING_INFO *) (rs_str - sizeof(PY_STRING_INFO));
-        info->ref_cnt ++;
+        chunk->next = py_arena_cached;
+        py_arena_cached = chunk;
+        py_arena_cached_num ++;
+        return;
     }
+    free(chunk);
+}
 
-    m_Buffer = rs_str;
+PY_ARENA::PY_ARENA(void)
+    : m_Chunks(NULL)
+    , m_ChunkBytes(PY_ARENA_CHUNK_BYTES)
+    , m_Prev(py_arena_current)
+{
+    py_arena_current = this;
+}
 
-    return *this;
+PY_ARENA::PY_ARENA(size_t chunk_bytes)
+    : m_Chunks(NULL)
+    , m_ChunkBytes(chunk_bytes)
+    , m_Prev(py_arena_current)
+{
+    py_arena_current = this;
 }
 
-PY_STRING & PY_STRING::operator=(const char * rs)
+PY_ARENA::~PY_ARENA(void)
 {
-    PY_STRING_INFO *    info;
-    int                 bytes_num_req = 0;
+    PY_ARENA_CHUNK * chunk;
 
-    if (m_Buffer == rs)
-        return *this;
+    py_arena_current = m_Prev;
 
-    if ((rs != NULL) && (*rs != '\0'))
-        bytes_num_req = strlen(rs) + 1;
+    while (m_Chunks != NULL)
+    {
+        chunk = m_Chunks;
+        m_Chunks = chunk->next;
+        py_arena_chunk_put(chunk, true);
+    }
+}
+
+PY_ARENA_SUSPEND::PY_ARENA_SUSPEND(void)
+    : m_Arena(py_arena_current)
+{
+    py_arena_current = NULL;
+}
 
-    // Decrement internal ref_cnt
-    if (m_Buffer != NULL)
+PY_ARENA_SUSPEND::~PY_ARENA_SUSPEND(void)
+{
+    py_arena_current = m_Arena;
+}
+
+void * PY_ARENA::alloc(size_t bytes_num)
+{
+    PY_ARENA_CHUNK *    chunk = m_Chunks;
+    PY_ARENA_HDR *      hdr;
+
+    bytes_num = PY_ARENA_ALIGN(bytes_num + sizeof(PY_ARENA_HDR));
+
+    // Big blocks would waste chunks
+    if (bytes_num > m_ChunkBytes / 4)
+        return NULL;
+
+    if ((chunk == NULL) || (chunk->bytes_used + bytes_num > chunk->bytes_num))
     {
-        info = (PY_STRING_INFO *) (m_Buffer - sizeof(PY_STRING_INFO));
-        info->ref_cnt --;
-        // Test if m_Buffer can be used
-        if (info->ref_cnt != 0)
-            m_Buffer = NULL;
+        chunk = py_arena_chunk_new(m_ChunkBytes);
+        chunk->next = m_Chunks;
+        m_Chunks = chunk;
     }
 
-    // Free not needed or not usable m_Buffer
-    if (m_Buffer != NULL)
-        if ((bytes_num_req == 0) || (info->bytes_num < bytes_num_req))
-        {
-            free(info);
-            m_Buffer = NULL;
-        }
+    hdr = (PY_ARENA_HDR *) ((char *)chunk + PY_ARENA_ALIGN(sizeof(PY_ARENA_CHUNK)) + chunk->bytes_used);
+    hdr->chunk = chunk;
+    chunk->bytes_used += bytes_num;
+    __sync_add_and_fetch(&chunk->ref_cnt, 1);
 
-    if (bytes_num_req == 0)
-        return *this;
+    return hdr + 1;
+}
 
-    if (m_Buffer == NULL)
+void * _py_malloc(size_t size)
+{
+    PY_ARENA_HDR *  hdr;
+    PY_STATS *      stats = _py_stats_thread();
+    void *          ptr;
+
+    stats->allocs ++;
+    stats->alloc_bytes += size;
+
+    if (py_arena_current != NULL)
     {
-        m_Buffer = (char *) malloc(sizeof(PY_STRING_INFO) + bytes_num_req);
-        if (m_Buffer == NULL)
-            throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
-        info = (PY_STRING_INFO *) m_Buffer;
-        info->bytes_num = bytes_num_req;
-        m_Buffer += sizeof(PY_STRING_INFO);
+        ptr = py_arena_current->alloc(size);
+        if (ptr != NULL)
+            return ptr;
     }
 
-    memmove(m_Buffer, rs, bytes_num_req);
+    hdr = (PY_ARENA_HDR *) malloc(sizeof(PY_ARENA_HDR) + size);
+    if (hdr == NULL)
+        throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
+    hdr->chunk = NULL;
+
+    return hdr + 1;
+}
+
+void _py_free(void * ptr)
+{
+    PY_ARENA_HDR * hdr;
 
+    if (ptr == NULL)
+        return;
+
+    hdr = (PY_ARENA_HDR *) ptr - 1;
+    if (hdr->chunk == NULL)
+        free(hdr);
+    else
+        py_arena_chunk_put(hdr->chunk, false);
+}
+
+//
+// PY_STRING
+//
+// Strings up to PY_STRING_INLINE_BYTES - 1 characters are stored inside of
+// the instance, longer ones in a reference counted heap buffer.  Both kinds
+// of buffer are preceded by PY_STRING_INFO, empty string has no buffer.
+//
+
+// Strings can be shared between worker threads (e.g. static tcm_root)
+#define PY_STRING_REF_INC(info)         __sync_add_and_fetch(&(info)->ref_cnt, 1)
+#define PY_STRING_REF_DEC(info)         __sync_sub_and_fetch(&(info)->ref_cnt, 1)
+
+#define PY_STRING_HEAP_BYTES_MIN        32
+
+// Allocates heap buffer with ref_cnt 1, returns pointer after PY_STRING_INFO
+static char * py_string_alloc(int bytes_num)
+{
+    PY_STRING::PY_STRING_INFO * info;
+
+    info = (PY_STRING::PY_STRING_INFO *) _py_malloc(sizeof(PY_STRING::PY_STRING_INFO) + bytes_num);
+    info->bytes_num = bytes_num;
     info->ref_cnt = 1;
+    info->length = 0;
+    return (char *)(info + 1);
+}
 
-    return *this;
+// Returns bytes_num with room for appending, like vector capacity
+static int py_string_grow(int bytes_num)
+{
+    int bytes_num_grown = PY_STRING_HEAP_BYTES_MIN;
+
+    while (bytes_num_grown < bytes_num)
+        bytes_num_grown *= 2;
+    return bytes_num_grown;
 }
 
-PY_STRING & PY_STRING::operator+=(const PY_STRING & rs)
+PY_STRING::PY_STRING_INFO * PY_STRING::info(void) const
 {
-    return this->operator+=((char *)rs);
+    return (PY_STRING_INFO *) (m_Buffer - sizeof(PY_STRING_INFO));
 }
 
-PY_STRING & PY_STRING::operator+=(const char * rs)
+bool PY_STRING::is_inline(void) const
 {
-    PY_STRING_INFO *    info;
-    char *              str = NULL;
-    bool                str_free = false;
-    int                 bytes_num_req;
+    return m_Buffer == m_Inline.buffer;
+}
 
-    if ((rs == NULL) || (*rs == '\0'))
-        return *this;
+// Buffer can be modified only if it is not shared
+bool PY_STRING::is_exclusive(void) const
+{
+    return is_inline() || (info()->ref_cnt == 1);
+}
+
+void PY_STRING::release(void)
+{
+    if ((m_Buffer != NULL) && !is_inline())
+        if (PY_STRING_REF_DEC(info()) == 0)
+            _py_free(info());
+    m_Buffer = NULL;
+}
 
-    bytes_num_req = strlen(rs) + 1;
-    if (m_Buffer != NULL)
-        bytes_num_req += strlen(m_Buffer);
+void PY_STRING::init_inline(void)
+{
+    m_Inline.info.bytes_num = PY_STRING_INLINE_BYTES;
+    m_Inline.info.ref_cnt = 1;
+    m_Inline.info.length = 0;
+}
 
-    // Decrement internal ref_cnt
-    if (m_Buffer != NULL)
+void PY_STRING::share(const PY_STRING & other)
+{
+    if (other.m_Buffer == NULL)
+        return;
+
+    if (other.is_inline())
     {
-        info = (PY_STRING_INFO *) (m_Buffer - sizeof(PY_STRING_INFO));
-        info->ref_cnt --;
-        // Test if m_Buffer can be used
-        if (info->ref_cnt != 0)
-        {
-            str = m_Buffer;
-            m_Buffer = NULL;
-        }
+        memcpy(m_Inline.buffer, other.m_Buffer, other.m_Inline.info.length + 1);
+        m_Inline.info.length = other.m_Inline.info.length;
+        m_Buffer = m_Inline.buffer;
+        return;
     }
 
-    // Test if m_Buffer has enough size
-    if (m_Buffer != NULL)
-        if (info->bytes_num < bytes_num_req)
-        {
-            str = m_Buffer;
-            str_free = true;
-            m_Buffer = NULL;
-        }
+    PY_STRING_REF_INC(other.info());
+    m_Buffer = other.m_Buffer;
+}
 
-    if (m_Buffer == NULL)
+// str can point into own buffer
+void PY_STRING::assign(const char * str, int length)
+{
+    char * buffer;
+
+    if (length <= 0)
     {
-        m_Buffer = (char *) malloc(sizeof(PY_STRING_INFO) + bytes_num_req);
-        if (m_Buffer == NULL)
-            throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
-        info = (PY_STRING_INFO *) m_Buffer;
-        info->bytes_num = bytes_num_req;
-        m_Buffer += sizeof(PY_STRING_INFO);
-        *m_Buffer = '\0';
+        release();
+        return;
+    }
+
+    if ((m_Buffer != NULL) && is_exclusive() && (info()->bytes_num > length))
+        buffer = m_Buffer;
+    else
+    if (length < PY_STRING_INLINE_BYTES)
+        buffer = m_Inline.buffer;
+    else
+        buffer = py_string_alloc(length + 1);
+
+    memmove(buffer, str, length);
+    buffer[length] = '\0';
+
+    if (buffer != m_Buffer)
+    {
+        release();
+        m_Buffer = buffer;
+    }
+    info()->length = length;
+}
+
+// str can point into own buffer
+void PY_STRING::append(const char * str, int length)
+{
+    char *  buffer;
+    int     length_old = len();
+
+    if (length <= 0)
+        return;
+
+    if ((m_Buffer != NULL) && is_exclusive() && (info()->bytes_num > length_old + length))
+        buffer = m_Buffer;
+    else
+    if ((length_old + length < PY_STRING_INLINE_BYTES) && !is_inline())
+        buffer = m_Inline.buffer;
+    else
+        buffer = py_string_alloc(py_string_grow(length_old + length + 1));
+
+    if (buffer != m_Buffer)
+    {
+        if (length_old > 0)
+            memcpy(buffer, m_Buffer, length_old);
+        memcpy(buffer + length_old, str, length);
+        release();
+        m_Buffer = buffer;
     }
+    else
+        memmove(buffer + length_old, str, length);
+
+    buffer[length_old + length] = '\0';
+    info()->length = length_old + length;
+}
+
+PY_STRING::PY_STRING(void)
+    : m_Buffer(NULL)
+{
+    init_inline();
+}
+
+PY_STRING::PY_STRING(const PY_STRING & other)
+    : m_Buffer(NULL)
+{
+    init_inline();
+    share(other);
+}
+
+PY_STRING::PY_STRING(const char * str)
+    : m_Buffer(NULL)
+{
+    init_inline();
+    if (str != NULL)
+        assign(str, strlen(str));
+}
 
+PY_STRING::PY_STRING(const char * str, int length)
+    : m_Buffer(NULL)
+{
+    init_inline();
     if (str != NULL)
+        assign(str, length);
+}
+
+#if __cplusplus >= 201103L
+PY_STRING::PY_STRING(PY_STRING && other)
+    : m_Buffer(NULL)
+{
+    init_inline();
+    if ((other.m_Buffer == NULL) || other.is_inline())
     {
-        strcpy(m_Buffer, str);
-        if (str_free)
-            free(str - sizeof(PY_STRING_INFO));
+        share(other);
+        return;
     }
-    strcat(m_Buffer, rs);
+    m_Buffer = other.m_Buffer;
+    other.m_Buffer = NULL;
+}
 
-    info->ref_cnt = 1;
+PY_STRING & PY_STRING::operator=(PY_STRING && rs)
+{
+    if (this == &rs)
+        return *this;
+
+    release();
+    if ((rs.m_Buffer == NULL) || rs.is_inline())
+    {
+        share(rs);
+        return *this;
+    }
+    m_Buffer = rs.m_Buffer;
+    rs.m_Buffer = NULL;
+
+    return *this;
+}
+#endif
+
+PY_STRING::~PY_STRING(void)
+{
+    release();
+}
+
+PY_STRING & PY_STRING::operator=(const PY_STRING & rs)
+{
+    if ((this == &rs) || ((m_Buffer == rs.m_Buffer) && (m_Buffer != NULL)))
+        return *this;
+
+    release();
+    share(rs);
+
+    return *this;
+}
+
+PY_STRING & PY_STRING::operator=(const char * rs)
+{
+    if (rs == NULL)
+        release();
+    else
+        assign(rs, strlen(rs));
 
     return *this;
 }
 
-const PY_STRING PY_STRING::operator+(const PY_STRING & other) const
+PY_STRING & PY_STRING::operator+=(const PY_STRING & rs)
 {
-    return PY_STRING(*this) += other;
+    append(rs.m_Buffer, rs.len());
+    return *this;
 }
 
-const PY_STRING PY_STRING::operator+(const char * other) const
+PY_STRING & PY_STRING::operator+=(const char * rs)
 {
-    return PY_STRING(*this) += other;
+    if (rs != NULL)
+        append(rs, strlen(rs));
+    return *this;
 }
 
+// Allocates result once, with room for further appending
+PY_STRING PY_STRING::concat(const char * other, int length) const
+{
+    PY_STRING   s;
+    int         length_old = len();
+
+    if (length_old + length == 0)
+        return s;
+
+    if (length_old + length < PY_STRING_INLINE_BYTES)
+        s.m_Buffer = s.m_Inline.buffer;
+    else
+        s.m_Buffer = py_string_alloc(py_string_grow(length_old + length + 1));
+
+    if (length_old > 0)
+        memcpy(s.m_Buffer, m_Buffer, length_old);
+    if (length > 0)
+        memcpy(s.m_Buffer + length_old, other, length);
+    s.m_Buffer[length_old + length] = '\0';
+    s.info()->length = length_old + length;
+
+    return s;
+}
+
+#if __cplusplus >= 201103L
+PY_STRING PY_STRING::operator+(const PY_STRING & other) const &
+{
+    return concat(other.m_Buffer, other.len());
+}
+
+PY_STRING PY_STRING::operator+(const char * other) const &
+{
+    return concat(other, other == NULL ? 0 : strlen(other));
+}
+
+// Temporary of a + b + c chain is extended in place
+PY_STRING PY_STRING::operator+(const PY_STRING & other) &&
+{
+    *this += other;
+    return static_cast<PY_STRING &&>(*this);
+}
+
+PY_STRING PY_STRING::operator+(const char * other) &&
+{
+    *this += other;
+    return static_cast<PY_STRING &&>(*this);
+}
+#else
+PY_STRING PY_STRING::operator+(const PY_STRING & other) const
+{
+    return concat(other.m_Buffer, other.len());
+}
+
+PY_STRING PY_STRING::operator+(const char * other) const
+{
+    return concat(other, other == NULL ? 0 : strlen(other));
+}
+#endif
+
 bool PY_STRING::operator==(const PY_STRING & other) const
 {
-    return this->operator==((char *)other);
+    if (len() != other.len())
+        return false;
+    return (m_Buffer == other.m_Buffer) || (0 == memcmp(m_Buffer, other.m_Buffer, len()));
 }
 
 bool PY_STRING::operator==(const char * other) const
@@ -352,27 +742,44 @@ bool PY_STRING::operator!=(const char * other) const
     return !(*this == other);
 }
 
+bool PY_STRING::operator<(const PY_STRING & other) const
+{
+    return (0 > strcmp(m_Buffer != NULL ? m_Buffer : "", other.m_Buffer != NULL ? other.m_Buffer : ""));
+}
+
 PY_STRING::operator char *() const
 {
     return m_Buffer;
 }
 
+int PY_STRING::len(void) const
+{
+    return m_Buffer == NULL ? 0 : info()->length;
+}
+
 PY_STRING PY_STRING::format(const char * str, ...)
 {
     PY_STRING   s;
     va_list     list;
     int         bytes_num_req;
-    char *      buffer = NULL;
+    char        buffer_local[256];
+    char *      buffer;
 
     if (str == NULL)
         return s;
 
+    // Most strings fit into local buffer, format only once for them
     va_start(list, str);
-    bytes_num_req = vsnprintf(buffer, 0, str, list);
+    bytes_num_req = vsnprintf(buffer_local, sizeof(buffer_local), str, list);
     va_end(list);
 
-    if (bytes_num_req == 0)
+    if (bytes_num_req <= 0)
+        return s;
+    if (bytes_num_req < (int)sizeof(buffer_local))
+    {
+        s.assign(buffer_local, bytes_num_req);
         return s;
+    }
     bytes_num_req ++;
 
     buffer = (char *) malloc(bytes_num_req);
@@ -383,7 +790,7 @@ PY_STRING PY_STRING::format(const char * str, ...)
     vsnprintf(buffer, bytes_num_req, str, list);
     va_end(list);
 
-    s = buffer;
+    s.assign(buffer, bytes_num_req - 1);
     free(buffer);
 
     return s;
@@ -392,47 +799,32 @@ PY_STRING PY_STRING::format(const char * str, ...)
 PY_STRING PY_STRING::join(LIST_PY_STRING & list)
 {
     PY_STRING           s;
-    char *              delimiter;
-    int                 delimiter_length;
-    int                 bytes_num_req;
+    int                 delimiter_length = len();
+    int                 length = 0;
     LIST_PY_STRING_IT   it;
-    char *              buffer;
 
-    delimiter = m_Buffer;
-    delimiter_length = delimiter == NULL ? 0 : strlen(delimiter);
-
-    bytes_num_req = 0;
     for (it = list.begin();
          it != list.end();
          it ++)
-        bytes_num_req += strlen(*it) + delimiter_length;
-    if (bytes_num_req > 0)
-        bytes_num_req -= delimiter_length;      // Delimiter after last string is not needed
-    if (bytes_num_req > 0)
-        bytes_num_req ++;                       // Add for '\0'
+        length += (*it).len() + delimiter_length;
+    if (length > 0)
+        length -= delimiter_length;             // Delimiter after last string is not needed
+    if (length <= 0)
+        return s;
 
-    buffer = (char *) malloc(bytes_num_req);
-    if (buffer == NULL)
-        throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
+    // Allocate whole result at once
+    s.m_Buffer = length < PY_STRING_INLINE_BYTES ? s.m_Inline.buffer : py_string_alloc(length + 1);
+    s.m_Buffer[0] = '\0';
 
-    bytes_num_req = 0;
     for (it = list.begin();
          it != list.end();
          it ++)
     {
         if (it != list.begin())
-        {
-            if (delimiter_length > 0)
-                strcpy(buffer + bytes_num_req, delimiter);
-            bytes_num_req += delimiter_length;
-        }
-        strcpy(buffer + bytes_num_req, *it);
-        bytes_num_req += strlen(*it);
+            s.append(m_Buffer, delimiter_length);
+        s.append(*it, (*it).len());
     }
 
-    s = buffer;
-    free(buffer);
-
     return s;
 }
 
@@ -470,323 +862,822 @@ PY_STRING PY_STRING::lower(void)
 
 PY_STRING PY_STRING::rstrip(void)
 {
-    PY_STRING   s;
-    int         chars_num;
-    char *      str;
-    char *      str_new;
+    PY_STRING_VIEW view = PY_STRING_VIEW(*this).rstrip();
+
+    if (view.len() == len())
+        return *this;
+    return view.str();
+}
 
+VECTOR_PY_STRING PY_STRING::split(void)
+{
+    VECTOR_PY_STRING    v;
+    PY_STRING_TOKENIZER tokenizer(*this);
+    PY_STRING_VIEW      token;
+
+    while (tokenizer.next(token))
+        v.push_back(token.str());
+    return v;
+}
+
+VECTOR_PY_STRING PY_STRING::split(char delimiter)
+{
+    VECTOR_PY_STRING    v;
+    PY_STRING_TOKENIZER tokenizer(*this, delimiter);
+    PY_STRING_VIEW      token;
 
     if (m_Buffer == NULL)
-        return s;
+        return v;
 
-    chars_num = strlen(m_Buffer);
-    if (chars_num == 0)
-        return s;
+    while (tokenizer.next(token))
+        v.push_back(token.str());
+    return v;
+}
 
-    // Test if string will be changed
-    for (str = m_Buffer + chars_num - 1; (*str <= ' ') && (str != m_Buffer); str --);
-    if (str == m_Buffer + chars_num - 1)
-    {
-        s = *this;
-        return s;
-    }
+bool PY_STRING::starts_with(const char * str)
+{
+    return PY_STRING_VIEW(*this).starts_with(str);
+}
 
-    str_new = strdup(m_Buffer);
-    if (str_new == NULL)
-        throw _py_OSError();
+PY_STRING PY_STRING::string_after(const char * str)
+{
+    return PY_STRING_VIEW(*this).string_after(str).str();
+}
 
-    for (str = str_new + chars_num; (*str <= ' ') && (str != str_new); *str = '\0', str --);
+PY_STRING PY_STRING::strip(void)
+{
+    PY_STRING_VIEW view = PY_STRING_VIEW(*this).strip();
 
-    s = str_new;
-    free(str_new);
+    if (view.len() == len())
+        return *this;
+    return view.str();
+}
 
-    return s;
+char * PY_STRING::strstr(const char * str)
+{
+    return ::strstr(m_Buffer, str);
 }
 
-VECTOR_PY_STRING PY_STRING::split(void)
+//
+// PY_STRING_VIEW
+//
+
+#define PY_IS_SPACE(ch)                 ((unsigned char)(ch) <= ' ')
+
+PY_STRING_VIEW::PY_STRING_VIEW(void)
+    : m_Str(NULL)
+    , m_Length(0)
 {
-    VECTOR_PY_STRING    v;
-    char *              str_s;
-    char *              str_e;
-    int                 ch;
+}
 
-    if (m_Buffer == NULL)
-        return v;
+PY_STRING_VIEW::PY_STRING_VIEW(const char * str)
+    : m_Str(str)
+    , m_Length(str == NULL ? 0 : strlen(str))
+{
+}
+
+PY_STRING_VIEW::PY_STRING_VIEW(const char * str, int length)
+    : m_Str(str)
+    , m_Length(length)
+{
+}
+
+PY_STRING_VIEW::PY_STRING_VIEW(const PY_STRING & str)
+    : m_Str(str)
+    , m_Length(str.len())
+{
+}
+
+const char * PY_STRING_VIEW::data(void) const
+{
+    return m_Str;
+}
+
+int PY_STRING_VIEW::len(void) const
+{
+    return m_Length;
+}
+
+bool PY_STRING_VIEW::operator==(const PY_STRING_VIEW & other) const
+{
+    if (m_Length != other.m_Length)
+        return false;
+    return (m_Length == 0) || (0 == memcmp(m_Str, other.m_Str, m_Length));
+}
+
+bool PY_STRING_VIEW::operator==(const char * other) const
+{
+    return *this == PY_STRING_VIEW(other);
+}
+
+bool PY_STRING_VIEW::operator!=(const PY_STRING_VIEW & other) const
+{
+    return !(*this == other);
+}
+
+bool PY_STRING_VIEW::operator!=(const char * other) const
+{
+    return !(*this == PY_STRING_VIEW(other));
+}
+
+int PY_STRING_VIEW::find(const char * str) const
+{
+    int length = str == NULL ? 0 : strlen(str);
+    int idx;
+
+    if (length == 0)
+        return -1;
+    for (idx = 0; idx + length <= m_Length; idx ++)
+        if ((m_Str[idx] == *str) && (0 == memcmp(m_Str + idx, str, length)))
+            return idx;
+    return -1;
+}
+
+bool PY_STRING_VIEW::starts_with(const char * str) const
+{
+    int length = str == NULL ? 0 : strlen(str);
+
+    if (length == 0)
+        return false;
+    return (m_Length >= length) && (0 == memcmp(m_Str, str, length));
+}
+
+PY_STRING_VIEW PY_STRING_VIEW::string_after(const char * str) const
+{
+    int idx = find(str);
+
+    if (idx < 0)
+        return PY_STRING_VIEW();
+    idx += strlen(str);
+    return PY_STRING_VIEW(m_Str + idx, m_Length - idx);
+}
+
+PY_STRING_VIEW PY_STRING_VIEW::lstrip(void) const
+{
+    int idx;
+
+    for (idx = 0; (idx < m_Length) && PY_IS_SPACE(m_Str[idx]); idx ++);
+    return PY_STRING_VIEW(m_Str + idx, m_Length - idx);
+}
+
+PY_STRING_VIEW PY_STRING_VIEW::rstrip(void) const
+{
+    int length;
+
+    for (length = m_Length; (length > 0) && PY_IS_SPACE(m_Str[length - 1]); length --);
+    return PY_STRING_VIEW(m_Str, length);
+}
+
+PY_STRING_VIEW PY_STRING_VIEW::strip(void) const
+{
+    return lstrip().rstrip();
+}
+
+PY_STRING PY_STRING_VIEW::str(void) const
+{
+    return PY_STRING(m_Str, m_Length);
+}
+
+//
+// PY_STRING_TOKENIZER
+//
+
+PY_STRING_TOKENIZER::PY_STRING_TOKENIZER(const PY_STRING_VIEW & str)
+    : m_Str(str)
+    , m_Pos(0)
+    , m_Delimiter(-1)
+{
+}
+
+PY_STRING_TOKENIZER::PY_STRING_TOKENIZER(const PY_STRING_VIEW & str, char delimiter)
+    : m_Str(str)
+    , m_Pos(0)
+    , m_Delimiter((unsigned char)delimiter)
+{
+}
+
+bool PY_STRING_TOKENIZER::next(PY_STRING_VIEW & token)
+{
+    const char *    str = m_Str.data();
+    int             length = m_Str.len();
+    int             start;
 
-    str_s = m_Buffer;
-    while (1)
+    if (m_Pos > length)
+        return false;
+
+    // Whitespace separated tokens, empty tokens are skipped like in split()
+    if (m_Delimiter < 0)
     {
-        // Find start of string
-        for (; (*str_s <= ' ') && (*str_s != '\0'); str_s ++);
-        if (*str_s == '\0')
-            break;
-        // Find end of string
-        for (str_e = str_s + 1; (*str_e > ' ') && (*str_e != '\0'); str_e ++);
-        ch = -1;
-        if (*str_e != '\0')
+        for (; (m_Pos < length) && PY_IS_SPACE(str[m_Pos]); m_Pos ++);
+        if (m_Pos == length)
         {
-            ch = *str_e;
-            *str_e = '\0';
+            m_Pos = length + 1;
+            return false;
         }
-        v.push_back(PY_STRING(str_s));
-        if (ch != -1)
-            *str_e = ch;
-        str_s = str_e;
+        for (start = m_Pos; (m_Pos < length) && !PY_IS_SPACE(str[m_Pos]); m_Pos ++);
+        token = PY_STRING_VIEW(str + start, m_Pos - start);
+        return true;
     }
-    return v;
+
+    // Delimited tokens, last one ends at end of string
+    for (start = m_Pos; (m_Pos < length) && ((unsigned char)str[m_Pos] != m_Delimiter); m_Pos ++);
+    token = PY_STRING_VIEW(str + start, m_Pos - start);
+    m_Pos ++;
+    return true;
 }
 
-VECTOR_PY_STRING PY_STRING::split(char delimiter)
+//
+// PY_FILE
+//
+
+PY_FILE::PY_FILE(void)
+    : m_Fd(-1)
+    , m_Line(NULL)
+    , m_LineBegin(0)
+    , m_LineEnd(0)
 {
-    VECTOR_PY_STRING    v;
-    char *              str_s;
-    char *              str_e;
-    int                 ch;
+}
 
-    if (m_Buffer == NULL)
-        return v;
+PY_FILE::PY_FILE(const PY_FILE &)
+    : m_Fd(-1)
+    , m_Line(NULL)
+    , m_LineBegin(0)
+    , m_LineEnd(0)
+{
+    throw _py_IOError("PY_FILE copy constructor");
+}
+
+PY_FILE::~PY_FILE()
+{
+    close();
+}
+
+PY_FILE & PY_FILE::operator=(const PY_FILE &)
+{
+    throw _py_IOError("PY_FILE::operator=");
+}
+
+void PY_FILE::open(const char * filename)
+{
+    open(filename, "r");
+}
 
-    str_s = m_Buffer;
-    while (1)
+void PY_FILE::open(const char * filename, const char * mode)
+{
+    open(filename, mode, AT_FDCWD);
+}
+
+void PY_FILE::open(const char * filename, const char * mode, int dir_fd)
+{
+    int flags;
+
+    // Same flags as fopen() uses for mode
+    switch (mode[0])
     {
-        // Find end of string
-        for (str_e = str_s; (*str_e != delimiter) && (*str_e != '\0'); str_e ++);
-        ch = -1;
-        if (*str_e != '\0')
-        {
-            ch = *str_e;
-            *str_e = '\0';
-        }
-        v.push_back(PY_STRING(str_s));
-        if (ch != -1)
-            *str_e = ch;
+        case 'r':   flags = O_RDONLY;                       break;
+        case 'w':   flags = O_WRONLY | O_CREAT | O_TRUNC;   break;
+        case 'a':   flags = O_WRONLY | O_CREAT | O_APPEND;  break;
+        default:    throw _py_IOError(strerror(EINVAL));
+    }
+    if (::strchr(mode, '+') != NULL)
+        flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
 
-        if (*str_e == '\0')
-            break;
-        str_s = str_e + 1;
+    close();
+    m_Fd = openat(dir_fd, filename, flags | O_CLOEXEC, 0666);
+    if (m_Fd < 0)
+        throw _py_IOError(strerror(errno));
+}
+
+int PY_FILE::read(char * buffer, int size)
+{
+    int len;
+
+    if (m_Fd < 0)
+        throw _py_IOError(strerror(EBADF));
+
+    // Data buffered by readline() comes first
+    if (m_LineBegin < m_LineEnd)
+    {
+        len = m_LineEnd - m_LineBegin;
+        if (len > size)
+            len = size;
+        memcpy(buffer, m_Line + m_LineBegin, len);
+        m_LineBegin += len;
+        return len;
     }
-    return v;
+
+    do
+    {
+        len = ::read(m_Fd, buffer, size);
+    } while ((len < 0) && (errno == EINTR));
+    if (len < 0)
+        throw _py_IOError(strerror(errno));
+
+    return len;
 }
 
-bool PY_STRING::starts_with(const char * str)
+PY_STRING PY_FILE::read(void)
 {
-    if (m_Buffer == NULL)
-        return false;
-    if ((str == NULL) || (*str == '\0'))
-        return false;
-    return (0 > strcmp(str, m_Buffer));
+    char        buffer[PY_FILE_READ_BYTES];
+    PY_STRING   s;
+    int         len;
+
+    // configfs/sysfs return whole attribute by first read(), bigger files are read in parts
+    len = read(buffer, sizeof(buffer));
+    if (len < (int) sizeof(buffer))
+        return PY_STRING(buffer, len);
+
+    s = PY_STRING(buffer, len);
+    while ((len = read(buffer, sizeof(buffer))) > 0)
+        s += PY_STRING(buffer, len);
+
+    return s;
+}
+
+PY_STRING PY_FILE::readline(void)
+{
+    char *  eol;
+    int     len;
+
+    if (m_Fd < 0)
+        throw _py_IOError(strerror(EBADF));
+
+    if (m_Line == NULL)
+        m_Line = (char *) _py_malloc(PY_FILE_LINE_BYTES);
+
+    for (;;)
+    {
+        eol = (char *) memchr(m_Line + m_LineBegin, '\n', m_LineEnd - m_LineBegin);
+        if (eol != NULL)
+            break;
+        if (m_LineEnd - m_LineBegin == PY_FILE_LINE_BYTES)
+            break;
+
+        if (m_LineBegin > 0)
+        {
+            memmove(m_Line, m_Line + m_LineBegin, m_LineEnd - m_LineBegin);
+            m_LineEnd -= m_LineBegin;
+            m_LineBegin = 0;
+        }
+
+        do
+        {
+            len = ::read(m_Fd, m_Line + m_LineEnd, PY_FILE_LINE_BYTES - m_LineEnd);
+        } while ((len < 0) && (errno == EINTR));
+        if (len < 0)
+            throw _py_IOError(strerror(errno));
+        if (len == 0)
+            break;
+        m_LineEnd += len;
+    }
+
+    len = (eol != NULL) ? eol - (m_Line + m_LineBegin) + 1 : m_LineEnd - m_LineBegin;
+    if (len == 0)
+        return PY_STRING();
+
+    m_LineBegin += len;
+    return PY_STRING(m_Line + m_LineBegin - len, len);
 }
 
-PY_STRING PY_STRING::string_after(const char * str)
+LIST_PY_STRING PY_FILE::readlines(void)
 {
-    PY_STRING   s;
-    char *      str_s;
-
-    if (m_Buffer == NULL)
-        return s;
+    LIST_PY_STRING  ret;
+    PY_STRING       s;
 
-    str_s = ::strstr(m_Buffer, str);
-    if (str_s == NULL)
-        return s;
-    str_s += strlen(str);
+    while ((s = readline()) != NULL)
+        ret.push_back(s);
 
-    s = str_s;
-    return s;
+    return ret;
 }
 
-PY_STRING PY_STRING::strip(void)
+void PY_FILE::write(const char * str)
 {
-    PY_STRING           s;
-    int                 chars_num;
-    char *              str;
-    char *              str_new;
+    write(str, strlen(str));
+}
 
-    if (m_Buffer == NULL)
-        return s;
+void PY_FILE::write(const char * buffer, int size)
+{
+    int len;
 
-    chars_num = strlen(m_Buffer);
-    if (chars_num == 0)
-        return s;
+    if (m_Fd < 0)
+        throw _py_IOError(strerror(EBADF));
 
-    // Test if string will be changed
-    for (str = m_Buffer; (*str <= ' ') && (*str != '\0'); str++);
-    if (str == m_Buffer)
+    // configfs/sysfs take attribute value from single write()
+    while (size > 0)
     {
-        for (str = m_Buffer + chars_num - 1; (*str <= ' ') && (str != m_Buffer); str --);
-        if (str == m_Buffer + chars_num - 1)
+        len = ::write(m_Fd, buffer, size);
+        if (len < 0)
         {
-            s = *this;
-            return s;
+            if (errno == EINTR)
+                continue;
+            throw _py_IOError(strerror(errno));
         }
+        buffer += len;
+        size -= len;
     }
+}
 
-    str_new = strdup(m_Buffer);
-    if (str_new == NULL)
-        throw _py_OSError();
-
-    for (str = str_new; (*str <= ' ') && (*str != '\0'); str++);
-    if (str != str_new)
-    {
-        chars_num -= str - str_new;
-        memmove(str_new, str, chars_num + 1);
-    }
-    for (str = str_new + chars_num; (*str <= ' ') && (str != str_new); *str = '\0', str --);
+void PY_FILE::fsync(void)
+{
+    if (m_Fd < 0)
+        throw _py_IOError(strerror(EBADF));
+    if (0 != ::fsync(m_Fd))
+        throw _py_IOError(strerror(errno));
+}
 
-    s = str_new;
-    free(str_new);
+void PY_FILE::close(void)
+{
+    if (m_Fd >= 0)
+        ::close(m_Fd);
+    m_Fd = -1;
 
-    return s;
+    if (m_Line != NULL)
+        _py_free(m_Line);
+    m_Line = NULL;
+    m_LineBegin = 0;
+    m_LineEnd = 0;
 }
 
-char * PY_STRING::strstr(const char * str)
+bool PY_FILE::isopen(void)
 {
-    return ::strstr(m_Buffer, str);
+    return (m_Fd >= 0);
 }
 
 //
-// PY_FILE
+// PY_JSON
 //
 
-PY_FILE::PY_FILE(void)
-    : m_File(NULL)
+void PY_JSON::loads(const PY_STRING_VIEW & text)
 {
+    m_Nodes.clear();
+    m_Text = text;
+    m_Pos = 0;
+
+    parse_value(0);
+    skip_space();
+    if (m_Pos < m_Text.len())
+        error("Extra data");
 }
 
-PY_FILE::PY_FILE(const PY_FILE & other)
-    : m_File(NULL)
+int PY_JSON::type(int node) const
 {
-    throw _py_IOError("PY_FILE copy constructor");
+    return m_Nodes[node].type;
 }
 
-PY_FILE::~PY_FILE()
+const PY_STRING & PY_JSON::key(int node) const
 {
-    close();
+    return m_Nodes[node].key;
 }
 
-PY_FILE & PY_FILE::operator=(const PY_FILE & rs)
+const PY_STRING & PY_JSON::value(int node) const
 {
-    throw _py_IOError("PY_FILE::operator=");
+    return m_Nodes[node].value;
 }
 
-void PY_FILE::open(const char * filename)
+int PY_JSON::child(int node) const
 {
-    open(filename, "r");
+    return m_Nodes[node].child;
 }
 
-void PY_FILE::open(const char * filename, const char * mode)
+int PY_JSON::next(int node) const
 {
-    m_File = fopen(filename, mode);
-    if (m_File == NULL)
-        throw _py_IOError(strerror(errno));
+    return m_Nodes[node].next;
 }
 
-PY_STRING PY_FILE::read(void)
+int PY_JSON::get(int node, const char * key) const
 {
-    char *      buffer = NULL;
-    PY_STRING   s;
-    long        offset;
-    struct stat st;
-    int         can_read;
+    if ((node < 0) || (m_Nodes[node].type != PY_JSON_OBJECT))
+        return -1;
 
-    if (m_File == NULL)
-        goto FNC_EXIT_ERR;
+    for (node = m_Nodes[node].child; node >= 0; node = m_Nodes[node].next)
+        if (m_Nodes[node].key == key)
+            return node;
+    return -1;
+}
 
-    if (0 != fstat(fileno(m_File), &st))
-        goto FNC_EXIT_ERR;
-    offset = ftell(m_File);
-    if (offset < 0)
-        goto FNC_EXIT_ERR;
+void PY_JSON::error(const char * msg)
+{
+    throw _py_ValueError(PY_STRING().format("%s at offset %d", msg, m_Pos));
+}
 
-    can_read = st.st_size - offset;
-    if (can_read < 1)
-        goto FNC_EXIT_ERR;
-    if (can_read > 4 * 1024)
-        can_read = 4 * 1024;
+void PY_JSON::skip_space(void)
+{
+    const char * text = m_Text.data();
 
-    buffer = (char *) malloc(can_read + 1);
-    if (buffer == NULL)
-        goto FNC_EXIT_ERR;
+    while ((m_Pos < m_Text.len()) &&
+           ((text[m_Pos] == ' ') || (text[m_Pos] == '\t') || (text[m_Pos] == '\n') || (text[m_Pos] == '\r')))
+        m_Pos ++;
+}
 
-    can_read = fread(buffer, 1, can_read, m_File);
-    if (can_read <= 0)
-        goto FNC_EXIT_ERR;
-    *(buffer + can_read) = '\0';
+// Appends code point as UTF-8
+static void py_json_utf8(PY_STRING & str, unsigned int cp)
+{
+    char    buffer[4];
+    int     len;
 
-    s = buffer;
-    free(buffer);
+    if (cp < 0x80)
+    {
+        buffer[0] = cp;
+        len = 1;
+    }
+    else
+    if (cp < 0x800)
+    {
+        buffer[0] = 0xc0 | (cp >> 6);
+        buffer[1] = 0x80 | (cp & 0x3f);
+        len = 2;
+    }
+    else
+    if (cp < 0x10000)
+    {
+        buffer[0] = 0xe0 | (cp >> 12);
+        buffer[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buffer[2] = 0x80 | (cp & 0x3f);
+        len = 3;
+    }
+    else
+    {
+        buffer[0] = 0xf0 | (cp >> 18);
+        buffer[1] = 0x80 | ((cp >> 12) & 0x3f);
+        buffer[2] = 0x80 | ((cp >> 6) & 0x3f);
+        buffer[3] = 0x80 | (cp & 0x3f);
+        len = 4;
+    }
+    str += PY_STRING(buffer, len);
+}
 
-    return s;
+void PY_JSON::parse_string(PY_STRING & str)
+{
+    const char *    text = m_Text.data();
+    int             start;
+    unsigned int    cp;
+    unsigned int    cp_low;
 
-FNC_EXIT_ERR:
-    if (buffer != NULL)
-        free(buffer);
-    throw _py_IOError();
+    str = "";
+    m_Pos ++;                                   // Opening '"'
+    for (;;)
+    {
+        // Plain characters are copied in runs
+        for (start = m_Pos;
+             (m_Pos < m_Text.len()) && (text[m_Pos] != '"') && (text[m_Pos] != '\\') && ((unsigned char)text[m_Pos] >= 0x20);
+             m_Pos ++);
+        if (m_Pos > start)
+            str += PY_STRING(text + start, m_Pos - start);
+
+        if (m_Pos >= m_Text.len())
+            error("Unterminated string");
+        if (text[m_Pos] == '"')
+        {
+            m_Pos ++;
+            return;
+        }
+        if (text[m_Pos] != '\\')
+            error("Invalid control character in string");
+
+        if (++ m_Pos >= m_Text.len())
+            error("Unterminated string");
+        switch (text[m_Pos ++])
+        {
+            case '"':   str += "\"";    break;
+            case '\\':  str += "\\";    break;
+            case '/':   str += "/";     break;
+            case 'b':   str += "\b";    break;
+            case 'f':   str += "\f";    break;
+            case 'n':   str += "\n";    break;
+            case 'r':   str += "\r";    break;
+            case 't':   str += "\t";    break;
+            case 'u':
+                if ((m_Pos + 4 > m_Text.len()) || (1 != sscanf(PY_STRING(text + m_Pos, 4), "%4x", &cp)))
+                    error("Invalid \\uXXXX escape");
+                m_Pos += 4;
+
+                // Surrogate pair
+                if ((cp >= 0xd800) && (cp < 0xdc00) &&
+                    (m_Pos + 6 <= m_Text.len()) && (text[m_Pos] == '\\') && (text[m_Pos + 1] == 'u') &&
+                    (1 == sscanf(PY_STRING(text + m_Pos + 2, 4), "%4x", &cp_low)) && (cp_low >= 0xdc00) && (cp_low < 0xe000))
+                {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (cp_low - 0xdc00);
+                    m_Pos += 6;
+                }
+                if (cp == 0)
+                    error("NUL character in string");
+                py_json_utf8(str, cp);
+                break;
+            default:
+                m_Pos --;
+                error("Invalid escape");
+        }
+    }
 }
 
-PY_STRING PY_FILE::readline(void)
+void PY_JSON::parse_literal(const char * literal, int type, int node)
 {
-    char *      line = NULL;
-    PY_STRING   s;
+    int len = strlen(literal);
 
-    if (m_File == NULL)
-        goto FNC_EXIT_ERR;
+    if ((m_Pos + len > m_Text.len()) || (0 != memcmp(m_Text.data() + m_Pos, literal, len)))
+        error("Expecting value");
+    m_Pos += len;
 
-    line = (char *)malloc(4 * 1024 + 1);
-    if (line == NULL)
-        goto FNC_EXIT_ERR;
+    m_Nodes[node].type = type;
+    m_Nodes[node].value = literal;
+}
+
+// Parses value into new node, returns its index
+int PY_JSON::parse_value(int depth)
+{
+    const char *    text = m_Text.data();
+    int             node = m_Nodes.size();
+    int             item;
+    int             last = -1;
+    int             start;
+    PY_STRING       key;
+    char            close;
 
-    if (NULL == fgets(line, 4 * 1024 + 1, m_File))
+    if (depth > PY_JSON_DEPTH_MAX)
+        error("Nesting too deep");
+
+    m_Nodes.push_back(PY_JSON_NODE());
+    m_Nodes[node].type = PY_JSON_NULL;
+    m_Nodes[node].child = -1;
+    m_Nodes[node].next = -1;
+
+    skip_space();
+    if (m_Pos >= m_Text.len())
+        error("Expecting value");
+
+    switch (text[m_Pos])
     {
-        if (0 != feof(m_File))
-            goto FNC_EXIT_ERR;
+        case '{':
+        case '[':
+            m_Nodes[node].type = text[m_Pos] == '{' ? PY_JSON_OBJECT : PY_JSON_ARRAY;
+            close = text[m_Pos] == '{' ? '}' : ']';
+            m_Pos ++;
+            skip_space();
+            if ((m_Pos < m_Text.len()) && (text[m_Pos] == close))
+            {
+                m_Pos ++;
+                break;
+            }
+            for (;;)
+            {
+                if (close == '}')
+                {
+                    skip_space();
+                    if ((m_Pos >= m_Text.len()) || (text[m_Pos] != '"'))
+                        error("Expecting property name enclosed in double quotes");
+                    parse_string(key);
+                    skip_space();
+                    if ((m_Pos >= m_Text.len()) || (text[m_Pos] != ':'))
+                        error("Expecting ':' delimiter");
+                    m_Pos ++;
+                }
+
+                // m_Nodes can be reallocated by parse_value(), no references are kept
+                item = parse_value(depth + 1);
+                m_Nodes[item].key = key;
+                if (last < 0)
+                    m_Nodes[node].child = item;
+                else
+                    m_Nodes[last].next = item;
+                last = item;
+
+                skip_space();
+                if (m_Pos >= m_Text.len())
+                    error("Expecting ',' delimiter");
+                if (text[m_Pos] == close)
+                {
+                    m_Pos ++;
+                    break;
+                }
+                if (text[m_Pos] != ',')
+                    error("Expecting ',' delimiter");
+                m_Pos ++;
+            }
+            break;
+        case '"':
+            m_Nodes[node].type = PY_JSON_STRING;
+            parse_string(key);
+            m_Nodes[node].value = key;
+            break;
+        case 't':
+            parse_literal("true", PY_JSON_BOOL, node);
+            break;
+        case 'f':
+            parse_literal("false", PY_JSON_BOOL, node);
+            break;
+        case 'n':
+            parse_literal("null", PY_JSON_NULL, node);
+            break;
+        default:
+            // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+            start = m_Pos;
+            if (text[m_Pos] == '-')
+                m_Pos ++;
+            if ((m_Pos >= m_Text.len()) || !isdigit((unsigned char)text[m_Pos]))
+                error("Expecting value");
+            if (text[m_Pos] == '0')
+                m_Pos ++;
+            else
+                for (; (m_Pos < m_Text.len()) && isdigit((unsigned char)text[m_Pos]); m_Pos ++);
+            if ((m_Pos < m_Text.len()) && (text[m_Pos] == '.'))
+            {
+                if ((++ m_Pos >= m_Text.len()) || !isdigit((unsigned char)text[m_Pos]))
+                    error("Invalid number");
+                for (; (m_Pos < m_Text.len()) && isdigit((unsigned char)text[m_Pos]); m_Pos ++);
+            }
+            if ((m_Pos < m_Text.len()) && ((text[m_Pos] == 'e') || (text[m_Pos] == 'E')))
+            {
+                m_Pos ++;
+                if ((m_Pos < m_Text.len()) && ((text[m_Pos] == '+') || (text[m_Pos] == '-')))
+                    m_Pos ++;
+                if ((m_Pos >= m_Text.len()) || !isdigit((unsigned char)text[m_Pos]))
+                    error("Invalid number");
+                for (; (m_Pos < m_Text.len()) && isdigit((unsigned char)text[m_Pos]); m_Pos ++);
+            }
+            m_Nodes[node].type = PY_JSON_NUMBER;
+            m_Nodes[node].value = PY_STRING(text + start, m_Pos - start);
+            break;
     }
-    else
-        s = line;
-    free(line);
-
-    return s;
 
-FNC_EXIT_ERR:
-    if (line != NULL)
-        free(line);
-    throw _py_IOError();
+    return node;
 }
 
-LIST_PY_STRING PY_FILE::readlines(void)
-{
-    LIST_PY_STRING  ret;
-    PY_STRING       s;
+//
+// PY_MMAP
+//
 
-    while ((s = readline()) != NULL)
-        ret.push_back(s);
+PY_MMAP::PY_MMAP(void)
+    : m_Data(NULL)
+    , m_Length(0)
+{
+}
 
-    return ret;
+PY_MMAP::~PY_MMAP()
+{
+    close();
 }
 
-void PY_FILE::write(const char * str)
+void PY_MMAP::open(const char * filename)
 {
-    if (m_File == NULL)
-        goto FNC_EXIT_ERR;
+    struct stat st;
+    int         fd;
+    int         err;
+
+    close();
 
-    if (0 > fprintf(m_File, "%s", str))
+    fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw _py_IOError(strerror(errno));
+
+    if (0 != fstat(fd, &st))
+        goto FNC_EXIT_ERR;
+    if ((st.st_size < 0) || (st.st_size > 0x7fffffff))
+    {
+        errno = EFBIG;
         goto FNC_EXIT_ERR;
+    }
 
+    // mmap() refuses zero length
+    if (st.st_size > 0)
+    {
+        m_Data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m_Data == MAP_FAILED)
+        {
+            m_Data = NULL;
+            goto FNC_EXIT_ERR;
+        }
+        m_Length = st.st_size;
+    }
+    ::close(fd);
     return;
 
 FNC_EXIT_ERR:
-    throw _py_IOError();
+    err = errno;
+    ::close(fd);
+    throw _py_IOError(strerror(err));
 }
 
-void PY_FILE::close(void)
+void PY_MMAP::close(void)
 {
-    if (m_File != NULL)
-        fclose(m_File);
-    m_File = NULL;
+    if (m_Data != NULL)
+        munmap(m_Data, m_Length);
+    m_Data = NULL;
+    m_Length = 0;
 }
 
-bool PY_FILE::isopen(void)
+const char * PY_MMAP::data(void) const
 {
-    return (m_File != NULL);
+    return (const char *) m_Data;
+}
+
+int PY_MMAP::len(void) const
+{
+    return m_Length;
+}
+
+PY_STRING_VIEW PY_MMAP::view(void) const
+{
+    return PY_STRING_VIEW((const char *) m_Data, m_Length);
 }
 
 //
@@ -803,15 +1694,34 @@ void _py_sys_exit(int code)
     throw _py_SystemExit(code);
 }
 
+void _py_sys_exit(int code, const char * msg)
+{
+    throw _py_SystemExit(code, msg);
+}
+
 LIST_PY_STRING _py_os_listdir(const char * dirname)
+{
+    return _py_os_listdir(dirname, AT_FDCWD);
+}
+
+LIST_PY_STRING _py_os_listdir(const char * dirname, int dir_fd)
 {
     DIR *           dir;
     struct dirent * dir_ent;
     LIST_PY_STRING  list;
+    int             fd;
 
-    dir = opendir(dirname);
-    if (dir == NULL)
+    fd = openat(dir_fd, dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
         throw _py_OSError(strerror(errno));
+    dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        int err = errno;
+
+        close(fd);
+        throw _py_OSError(strerror(err));
+    }
 
     while (NULL != (dir_ent = readdir(dir)))
     {
@@ -828,18 +1738,35 @@ LIST_PY_STRING _py_os_listdir(const char * dirname)
 
 void _py_os_mkdir(const char * dirname)
 {
-    if (0 != mkdir(dirname, 0777))
+    _py_os_mkdir(dirname, AT_FDCWD);
+}
+
+void _py_os_mkdir(const char * dirname, int dir_fd)
+{
+    if (0 != mkdirat(dir_fd, dirname, 0777))
+        throw _py_OSError(strerror(errno));
+}
+
+void _py_os_rename(const char * src, const char * dst)
+{
+    if (0 != rename(src, dst))
         throw _py_OSError(strerror(errno));
 }
 
 void _py_os_rmdir(const char * dirname)
 {
-    if (0 != rmdir(dirname))
+    _py_os_rmdir(dirname, AT_FDCWD);
+}
+
+void _py_os_rmdir(const char * dirname, int dir_fd)
+{
+    if (0 != unlinkat(dir_fd, dirname, AT_REMOVEDIR))
         throw _py_OSError(strerror(errno));
 }
 
 int _py_os_system(const char * cmd)
 {
+    _py_stats_thread()->forks ++;
     return system(cmd);
 }
 
@@ -860,53 +1787,97 @@ int _py_os_major(const char * devname)
     return major(st.st_rdev);
 }
 
-void _py_os_makedirs(const char * pathname)
+// Creates all path components relative to directory fds, mode is used for last component
+static void _py_os_makedirs_at(const char * pathname, int mode, bool set_mode)
 {
-    int     ret = -1;
-    char *  buffer = NULL;
+    char *  buffer;
+    char *  name;
+    char *  next;
+    int     dirfd;
+    int     fd;
+    int     err = 0;
+    bool    last;
+    bool    created;
 
-    buffer = (char *) malloc(16 + strlen(pathname));
+    if ((pathname == NULL) || (*pathname == '\0'))
+        throw _py_OSError(strerror(ENOENT));
+
+    buffer = strdup(pathname);
     if (buffer == NULL)
+        throw _py_OSError(STR_ERR_CAN_NOT_ALLOCATE_MEMORY);
+
+    dirfd = open(*buffer == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+    {
+        err = errno;
         goto FNC_EXIT;
+    }
+
+    for (name = buffer; ; name = next)
+    {
+        // Find start and end of path component
+        for (; *name == '/'; name ++);
+        if (*name == '\0')
+            break;
+        for (next = name; (*next != '/') && (*next != '\0'); next ++);
+        if (*next != '\0')
+            *next++ = '\0';
+        for (; *next == '/'; next ++);
+        last = (*next == '\0');
+
+        // Directory can be created concurrently, EEXIST is checked by openat() below
+        created = (0 == mkdirat(dirfd, name, last ? mode : 0777));
+        if (!created && (errno != EEXIST))
+        {
+            err = errno;
+            break;
+        }
 
-    sprintf(buffer, "mkdir -p %s", pathname);
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            err = errno;
+            break;
+        }
+        close(dirfd);
+        dirfd = fd;
 
-    if (0 == system(buffer))
-        ret = 0;
+        // Like mkdir -m, mode of created directory is not masked by umask
+        if (last && created && set_mode && (0 != fchmod(dirfd, mode)))
+        {
+            err = errno;
+            break;
+        }
+    }
 
 FNC_EXIT:
-    if (buffer != NULL)
-        free(buffer);
-    if (ret != 0)
-        throw _py_OSError();
+    if (dirfd >= 0)
+        close(dirfd);
+    free(buffer);
+    if (err != 0)
+        throw _py_OSError(strerror(err));
 }
 
-void _py_os_makedirs(const char * pathname, int mode)
+void _py_os_makedirs(const char * pathname)
 {
-    int     ret = -1;
-    char *  buffer = NULL;
-
-    buffer = (char *) malloc(24 + strlen(pathname));
-    if (buffer == NULL)
-        goto FNC_EXIT;
-
-    sprintf(buffer, "mkdir -m %04o -p %s", mode, pathname);
-
-    if (0 == system(buffer))
-        ret = 0;
+    _py_os_makedirs_at(pathname, 0777, false);
+}
 
-FNC_EXIT:
-    if (buffer != NULL)
-        free(buffer);
-    if (ret != 0)
-        throw _py_OSError();
+void _py_os_makedirs(const char * pathname, int mode)
+{
+    _py_os_makedirs_at(pathname, mode, true);
 }
 
 bool _py_os_path_isdir(char * pathname)
+{
+    return _py_os_path_isdir(pathname, AT_FDCWD);
+}
+
+bool _py_os_path_isdir(const char * pathname, int dir_fd)
 {
     struct stat st;
 
-    if (0 != stat(pathname, &st))
+    if (0 != fstatat(dir_fd, pathname, &st, 0))
         return false;
     if (S_ISDIR(st.st_mode))
         return true;
@@ -914,10 +1885,15 @@ bool _py_os_path_isdir(char * pathname)
 }
 
 bool _py_os_path_isfile(char * pathname)
+{
+    return _py_os_path_isfile(pathname, AT_FDCWD);
+}
+
+bool _py_os_path_isfile(const char * pathname, int dir_fd)
 {
     struct stat st;
 
-    if (0 != stat(pathname, &st))
+    if (0 != fstatat(dir_fd, pathname, &st, 0))
         return false;
     if (S_ISREG(st.st_mode))
         return true;
@@ -935,15 +1911,113 @@ bool _py_os_path_islink(char * pathname)
     return false;
 }
 
+double _py_time_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// UUID
+//
+// Random bytes of PY_UUID_BATCH UUIDs come from one getrandom() call, kept
+// per thread.  /dev/urandom is read where getrandom() does not exist.
+// Child of fork() drops bytes inherited from parent, UUIDs are not repeated.
+//
+
+#define PY_UUID_BYTES   16
+#define PY_UUID_BATCH   16                      // 256 bytes, getrandom() returns them whole
+
+static __thread unsigned char   py_uuid_random[PY_UUID_BATCH * PY_UUID_BYTES];
+static __thread int             py_uuid_next = PY_UUID_BATCH;
+
+static pthread_once_t           py_uuid_once = PTHREAD_ONCE_INIT;
+
+static const char py_hex_digits[] = "0123456789abcdef";
+
+static void py_uuid_atfork_child(void)
+{
+    py_uuid_next = PY_UUID_BATCH;
+}
+
+static void py_uuid_init(void)
+{
+    pthread_atfork(NULL, NULL, py_uuid_atfork_child);
+}
+
+static void py_uuid_fill(unsigned char * buffer, int size)
+{
+    int fd;
+    int len;
+
+    pthread_once(&py_uuid_once, py_uuid_init);
+
+#ifdef SYS_getrandom
+    while (size > 0)
+    {
+        len = syscall(SYS_getrandom, buffer, size, 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOSYS)
+                break;
+            throw _py_OSError(strerror(errno));
+        }
+        buffer += len;
+        size -= len;
+    }
+    if (size == 0)
+        return;
+#endif
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw _py_OSError(strerror(errno));
+    while (size > 0)
+    {
+        len = read(fd, buffer, size);
+        if ((len < 0) && (errno == EINTR))
+            continue;
+        if (len <= 0)
+        {
+            int err = len < 0 ? errno : EIO;
+
+            close(fd);
+            throw _py_OSError(strerror(err));
+        }
+        buffer += len;
+        size -= len;
+    }
+    close(fd);
+}
+
 PY_STRING _py_uuid_uuid4(void)
 {
-    PY_STRING   s;
-    char        buffer[48];
-    uuid_t      uuid;
+    char            buffer[48];
+    unsigned char * uuid;
+    char *          str = buffer;
 
-    uuid_generate(uuid);
-    uuid_unparse_lower(uuid, buffer);
-    s = buffer;
+    if (py_uuid_next == PY_UUID_BATCH)
+    {
+        py_uuid_fill(py_uuid_random, sizeof(py_uuid_random));
+        py_uuid_next = 0;
+    }
+    uuid = py_uuid_random + PY_UUID_BYTES * py_uuid_next ++;
 
-    return s;
+    // Version 4, variant RFC 4122
+    uuid[6] = (uuid[6] & 0x0f) | 0x40;
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;
+
+    for (int idx = 0; idx < PY_UUID_BYTES; idx ++)
+    {
+        if ((idx == 4) || (idx == 6) || (idx == 8) || (idx == 10))
+            *str++ = '-';
+        *str++ = py_hex_digits[uuid[idx] >> 4];
+        *str++ = py_hex_digits[uuid[idx] & 0x0f];
+    }
+
+    return PY_STRING(buffer, str - buffer);
 }
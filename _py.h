@@ -12,6 +12,8 @@
 #include <map>
 #include <vector>
 #include <exception>
+#include <new>
+#include <stddef.h>
 #include <stdio.h>
 
 //
@@ -41,6 +43,7 @@ class _py_SystemExit: public _py_ExceptionBase
 public:
     _py_SystemExit(void);
     _py_SystemExit(int code);
+    _py_SystemExit(int code, const char * msg);
 
     const char *    what() const throw();
     int             code(void) const throw();
@@ -67,31 +70,171 @@ public:
     const char * what() const throw();
 };
 
+class _py_ValueError: public _py_ExceptionBase
+{
+public:
+    _py_ValueError(void);
+    _py_ValueError(const char * msg);
+
+    const char * what() const throw();
+};
+
+//
+// Memory allocation
+//
+
+void *  _py_malloc  (size_t size);                                          // throws _py_OSError, uses current PY_ARENA if any
+void    _py_free    (void * ptr);                                           // For blocks from _py_malloc()
+
+//
+// Statistics
+//
+// Counters of the calling thread are updated without locking, _py_stats()
+// sums those of all threads, finished threads included.  Sum is exact once
+// the counted work has ended.  Allocations and forks are counted by _py,
+// configfs calls by tcm_cfs.
+//
+
+typedef struct
+{
+    unsigned long long  allocs;                                             // _py_malloc() blocks, PY_STRING, PY_FILE and containers
+    unsigned long long  alloc_bytes;
+    unsigned long long  forks;                                              // _py_os_system()
+    unsigned long long  cfs_reads;
+    unsigned long long  cfs_writes;
+    unsigned long long  cfs_mkdirs;
+    unsigned long long  cfs_rmdirs;
+    unsigned long long  cfs_stats;                                          // isdir/isfile tests
+    unsigned long long  cfs_listdirs;
+} PY_STATS;
+
+extern __thread PY_STATS * py_stats_current;
+
+PY_STATS *  _py_stats_new   (void);                                         // Registers counters of calling thread
+void        _py_stats       (PY_STATS & stats);                             // Sum of all threads
+
+inline PY_STATS * _py_stats_thread(void)
+{
+    return py_stats_current != NULL ? py_stats_current : _py_stats_new();
+}
+
+//
+// PY_ARENA
+//
+// Bump allocator for PY_STRING buffers and container nodes.  While instance
+// is alive, _py_malloc() of the creating thread allocates from its chunks.
+// Chunks are released in one go at the end of the scope; chunk still used by
+// escaped blocks is freed with its last block.
+//
+
+class PY_ARENA
+{
+public:
+    enum { PY_ARENA_CHUNK_BYTES = 16 * 1024 };
+
+    PY_ARENA(void);
+    PY_ARENA(size_t chunk_bytes);
+    ~PY_ARENA(void);
+
+    void *  alloc(size_t bytes_num);                                        // Returns NULL for too big blocks
+
+protected:
+    PY_ARENA(const PY_ARENA & other);
+    PY_ARENA & operator=(const PY_ARENA & rs);
+
+    struct py_arena_chunk * m_Chunks;
+    size_t                  m_ChunkBytes;
+    PY_ARENA *              m_Prev;
+};
+
+//
+// PY_ARENA_SUSPEND
+//
+// Within its scope _py_malloc() of the calling thread uses malloc(), for
+// data kept beyond the current arena, e.g. caches.  One such block would
+// keep its whole arena chunk allocated.
+//
+
+class PY_ARENA_SUSPEND
+{
+public:
+    PY_ARENA_SUSPEND(void);
+    ~PY_ARENA_SUSPEND(void);
+
+protected:
+    PY_ARENA_SUSPEND(const PY_ARENA_SUSPEND & other);
+    PY_ARENA_SUSPEND & operator=(const PY_ARENA_SUSPEND & rs);
+
+    PY_ARENA *  m_Arena;
+};
+
+//
+// PY_ALLOCATOR
+//
+// STL allocator using _py_malloc()
+//
+
+template <class T>
+class PY_ALLOCATOR
+{
+public:
+    typedef T               value_type;
+    typedef T *             pointer;
+    typedef const T *       const_pointer;
+    typedef T &             reference;
+    typedef const T &       const_reference;
+    typedef size_t          size_type;
+    typedef ptrdiff_t       difference_type;
+
+    template <class U> struct rebind { typedef PY_ALLOCATOR<U> other; };
+
+    PY_ALLOCATOR(void) throw() {}
+    PY_ALLOCATOR(const PY_ALLOCATOR &) throw() {}
+    template <class U> PY_ALLOCATOR(const PY_ALLOCATOR<U> &) throw() {}
+
+    pointer         address(reference x) const                  { return &x; }
+    const_pointer   address(const_reference x) const            { return &x; }
+    pointer         allocate(size_type n, const void * = 0)     { return (pointer) _py_malloc(n * sizeof(T)); }
+    void            deallocate(pointer p, size_type)            { _py_free(p); }
+    size_type       max_size(void) const throw()                { return ((size_type) -1) / sizeof(T); }
+#if __cplusplus < 201103L
+    void            construct(pointer p, const T & val)         { new ((void *) p) T(val); }
+    void            destroy(pointer p)                          { p->~T(); }
+#endif
+};
+
+template <class T, class U>
+inline bool operator==(const PY_ALLOCATOR<T> &, const PY_ALLOCATOR<U> &) { return true; }
+
+template <class T, class U>
+inline bool operator!=(const PY_ALLOCATOR<T> &, const PY_ALLOCATOR<U> &) { return false; }
+
 //
 // LIST_PY_STRING
 // LIST_LIST_PY_STRING
 //
 
-typedef std::list<PY_STRING>            LIST_PY_STRING;
-typedef LIST_PY_STRING::iterator        LIST_PY_STRING_IT;
+typedef std::list<PY_STRING, PY_ALLOCATOR<PY_STRING> >              LIST_PY_STRING;
+typedef LIST_PY_STRING::iterator                                    LIST_PY_STRING_IT;
 
-typedef std::list<LIST_PY_STRING>       LIST_LIST_PY_STRING;
-typedef LIST_LIST_PY_STRING::iterator   LIST_LIST_PY_STRING_IT;
+typedef std::list<LIST_PY_STRING, PY_ALLOCATOR<LIST_PY_STRING> >    LIST_LIST_PY_STRING;
+typedef LIST_LIST_PY_STRING::iterator                               LIST_LIST_PY_STRING_IT;
 
 
 //
 // MAP_PY_STRING
 //
 
-typedef std::map<PY_STRING, PY_STRING>  MAP_PY_STRING;
-typedef MAP_PY_STRING::iterator         MAP_PY_STRING_IT;
+typedef std::map<PY_STRING, PY_STRING, std::less<PY_STRING>,
+                 PY_ALLOCATOR<std::pair<const PY_STRING, PY_STRING> > >     MAP_PY_STRING;
+typedef MAP_PY_STRING::iterator                                             MAP_PY_STRING_IT;
 
 //
 // VECTOR_PY_STRING
 //
 
-typedef std::vector<PY_STRING>          VECTOR_PY_STRING;
-typedef VECTOR_PY_STRING::iterator      VECTOR_PY_STRING_IT;
+typedef std::vector<PY_STRING, PY_ALLOCATOR<PY_STRING> >            VECTOR_PY_STRING;
+typedef VECTOR_PY_STRING::iterator                                  VECTOR_PY_STRING_IT;
 
 //
 // PY_STRING
@@ -100,20 +243,43 @@ typedef VECTOR_PY_STRING::iterator      VECTOR_PY_STRING_IT;
 class PY_STRING
 {
 public:
+    typedef struct py_string_info
+    {
+        int     bytes_num;              // Number of allocated bytes for buffer for storing string - sizeof(PY_STRING_INFO), can be > length + 1
+        int     ref_cnt;                // Reference counter for string, updated atomically, always 1 for inline buffer
+        int     length;                 // Cached strlen(PY_STRING::m_Buffer)
+    } PY_STRING_INFO;
+
+    enum { PY_STRING_INLINE_BYTES = 20 };
+
     PY_STRING(void);
     PY_STRING(const PY_STRING & other);
     PY_STRING(const char * other);
+    PY_STRING(const char * other, int length);
+#if __cplusplus >= 201103L
+    PY_STRING(PY_STRING && other);
+#endif
 
     ~PY_STRING(void);
 
     PY_STRING & operator=(const PY_STRING & rs);
     PY_STRING & operator=(const char * rs);
+#if __cplusplus >= 201103L
+    PY_STRING & operator=(PY_STRING && rs);
+#endif
 
     PY_STRING & operator+=(const PY_STRING & rs);
     PY_STRING & operator+=(const char * rs);
 
-    const PY_STRING operator+(const PY_STRING & other) const;
-    const PY_STRING operator+(const char * other) const;
+#if __cplusplus >= 201103L
+    PY_STRING operator+(const PY_STRING & other) const &;
+    PY_STRING operator+(const char * other) const &;
+    PY_STRING operator+(const PY_STRING & other) &&;                        // Appends to temporary in place
+    PY_STRING operator+(const char * other) &&;                             // Appends to temporary in place
+#else
+    PY_STRING operator+(const PY_STRING & other) const;
+    PY_STRING operator+(const char * other) const;
+#endif
 
     bool operator==(const PY_STRING & other) const;
     bool operator==(const char * other) const;
@@ -121,8 +287,11 @@ public:
     bool operator!=(const PY_STRING & other) const;
     bool operator!=(const char * other) const;
 
+    bool operator<(const PY_STRING & other) const;                         // Compares content, for std::map keys
+
     operator char *() const;
 
+    int                 len(void) const;                        // Cached length of string
     PY_STRING           format(const char * str, ...);          // Returns new instance of string
     PY_STRING           join(LIST_PY_STRING & list);            // Joins strings into new instance, string stored in instance is delimiter
     PY_STRING           lower(void);                            // Returns new instance of string
@@ -135,16 +304,95 @@ public:
     char *              strstr(const char * str);
 
 protected:
-    char *  m_Buffer;
+    PY_STRING_INFO *    info(void) const;
+    bool                is_inline(void) const;
+    bool                is_exclusive(void) const;
+    void                init_inline(void);
+    void                release(void);
+    void                share(const PY_STRING & other);
+    void                assign(const char * str, int length);
+    void                append(const char * str, int length);
+    PY_STRING           concat(const char * other, int length) const;
+
+    char *  m_Buffer;                   // Points to m_Inline.buffer, to heap buffer or is NULL for empty string
+    struct
+    {
+        PY_STRING_INFO  info;           // Directly precedes buffer, as for heap buffers
+        char            buffer[PY_STRING_INLINE_BYTES];
+    } m_Inline;
+};
+
+//
+// PY_STRING_VIEW
+//
+// Non-owning view into string buffer, buffer must outlive the view.
+// Only views which are stored are materialised with str().
+//
+
+class PY_STRING_VIEW
+{
+public:
+    PY_STRING_VIEW(void);
+    PY_STRING_VIEW(const char * str);
+    PY_STRING_VIEW(const char * str, int length);
+    PY_STRING_VIEW(const PY_STRING & str);
+
+    bool operator==(const PY_STRING_VIEW & other) const;
+    bool operator==(const char * other) const;
+
+    bool operator!=(const PY_STRING_VIEW & other) const;
+    bool operator!=(const char * other) const;
+
+    const char *        data(void) const;                       // Not terminated by '\0'
+    int                 len(void) const;
+    int                 find(const char * str) const;           // Returns index or -1
+    PY_STRING_VIEW      lstrip(void) const;
+    PY_STRING_VIEW      rstrip(void) const;
+    bool                starts_with(const char * str) const;
+    PY_STRING_VIEW      string_after(const char * str) const;
+    PY_STRING_VIEW      strip(void) const;
+    PY_STRING           str(void) const;                        // Returns new instance of string
+
+protected:
+    const char *    m_Str;
+    int             m_Length;
+};
+
+//
+// PY_STRING_TOKENIZER
+//
+// Lazy split() yielding views into the original buffer, buffer is not modified.
+//
+
+class PY_STRING_TOKENIZER
+{
+public:
+    PY_STRING_TOKENIZER(const PY_STRING_VIEW & str);                        // Splits by whitespace
+    PY_STRING_TOKENIZER(const PY_STRING_VIEW & str, char delimiter);
+
+    bool    next(PY_STRING_VIEW & token);                                   // Returns false after last token
+
+protected:
+    PY_STRING_VIEW  m_Str;
+    int             m_Pos;
+    int             m_Delimiter;                                            // -1 for whitespace
 };
 
 //
 // PY_FILE
 //
+// Unbuffered file on raw fd, suited to configfs/sysfs attributes: read()
+// and write() are one syscall for attribute sized data.  Only readline()
+// buffers, up to PY_FILE_LINE_BYTES.
+//
 
 class PY_FILE
 {
 public:
+    enum { PY_FILE_READ_BYTES = 4 * 1024 };                                 // PAGE_SIZE, attribute size limit of configfs/sysfs
+    enum { PY_FILE_LINE_BYTES = 4 * 1024 };                                 // Longer lines are returned in parts
+
+
     PY_FILE(void);
     PY_FILE(const PY_FILE & other);
 
@@ -154,15 +402,101 @@ public:
 
     void            open(const char * filename);
     void            open(const char * filename, const char * mode);
-    PY_STRING       read(void);                                             // Reads max. 4 * 1024 bytes
-    PY_STRING       readline(void);
+    void            open(const char * filename, const char * mode, int dir_fd);     // filename is relative to dir_fd
+    PY_STRING       read(void);                                             // Reads rest of file, short read is taken as end of file
+    int             read(char * buffer, int size);                          // Single read(), returns bytes read
+    PY_STRING       readline(void);                                         // Returns empty string at end of file
     LIST_PY_STRING  readlines(void);
     void            write(const char * str);
+    void            write(const char * buffer, int size);
+    void            fsync(void);                                            // Flushes file to storage
     void            close(void);
     bool            isopen(void);
 
 protected:
-    FILE *  m_File;
+    int     m_Fd;
+    char *  m_Line;                                                         // readline() buffer
+    int     m_LineBegin;
+    int     m_LineEnd;
+};
+
+//
+// PY_JSON
+//
+// Parsed JSON document.  Values are nodes addressed by index, root is 0.
+// Items of array and members of object are linked by child() / next().
+//
+
+class PY_JSON
+{
+public:
+    enum
+    {
+        PY_JSON_NULL,
+        PY_JSON_BOOL,
+        PY_JSON_NUMBER,
+        PY_JSON_STRING,
+        PY_JSON_ARRAY,
+        PY_JSON_OBJECT
+    };
+
+    enum { PY_JSON_DEPTH_MAX = 64 };
+
+    void                loads   (const PY_STRING_VIEW & text);              // throws _py_ValueError
+
+    int                 type    (int node) const;
+    const PY_STRING &   key     (int node) const;                           // Name of object member
+    const PY_STRING &   value   (int node) const;                           // String, text of number, "true", "false" or "null"
+    int                 child   (int node) const;                           // First item or member, -1 if empty
+    int                 next    (int node) const;                           // Next item or member, -1 for last
+    int                 get     (int node, const char * key) const;         // Member of object, -1 if not found
+
+protected:
+    typedef struct
+    {
+        int         type;
+        PY_STRING   key;
+        PY_STRING   value;
+        int         child;
+        int         next;
+    } PY_JSON_NODE;
+
+    int     parse_value     (int depth);
+    void    parse_string    (PY_STRING & str);
+    void    parse_literal   (const char * literal, int type, int node);
+    void    skip_space      (void);
+    void    error           (const char * msg);
+
+    std::vector<PY_JSON_NODE>   m_Nodes;
+    PY_STRING_VIEW              m_Text;
+    int                         m_Pos;
+};
+
+//
+// PY_MMAP
+//
+// Read only mapping of whole file
+//
+
+class PY_MMAP
+{
+public:
+    PY_MMAP(void);
+    ~PY_MMAP();
+
+    void            open(const char * filename);                            // throws _py_IOError
+    void            close(void);
+
+    const char *    data(void) const;                                       // NULL for empty file
+    int             len(void) const;
+    PY_STRING_VIEW  view(void) const;
+
+protected:
+    PY_MMAP(const PY_MMAP & other);
+    PY_MMAP & operator=(const PY_MMAP & rs);
+
+    void *  m_Data;
+    int     m_Length;
 };
 
 //
@@ -171,10 +505,15 @@ protected:
 
 void _py_sys_exit(void);                                                    // throws _py_SystemExit
 void _py_sys_exit(int code);                                                // throws _py_SystemExit
+void _py_sys_exit(int code, const char * msg);                              // throws _py_SystemExit, msg is for what()
 
 LIST_PY_STRING  _py_os_listdir  (const char * dirname);                     // throws _py_OSError
+LIST_PY_STRING  _py_os_listdir  (const char * dirname, int dir_fd);         // throws _py_OSError
 void            _py_os_mkdir    (const char * dirname);                     // throws _py_OSError
+void            _py_os_mkdir    (const char * dirname, int dir_fd);         // throws _py_OSError
+void            _py_os_rename   (const char * src, const char * dst);       // throws _py_OSError
 void            _py_os_rmdir    (const char * dirname);                     // throws _py_OSError
+void            _py_os_rmdir    (const char * dirname, int dir_fd);         // throws _py_OSError
 int             _py_os_system   (const char * cmd);
 void            _py_os_unlink   (const char * pathname);                    // throws _py_OSError
 int             _py_os_major    (const char * devname);
@@ -183,9 +522,13 @@ void            _py_os_makedirs (const char * pathname);                    // t
 void            _py_os_makedirs (const char * pathname, int mode);          // throws _py_OSError
 
 bool _py_os_path_isdir  (char * pathname);
+bool _py_os_path_isdir  (const char * pathname, int dir_fd);
 bool _py_os_path_isfile (char * pathname);
+bool _py_os_path_isfile (const char * pathname, int dir_fd);
 bool _py_os_path_islink (char * pathname);
 
+double      _py_time_monotonic(void);                                       // Seconds
+
 PY_STRING   _py_uuid_uuid4(void);
 
 #endif /* __PY_H_ */
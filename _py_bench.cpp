@@ -0,0 +1,396 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+// Microbenchmarks of _py layer:
+//
+//     _py_bench [options]
+//
+//     --filter <str>       runs benchmarks whose name contains str
+//     --reps <n>           measured repetitions, default 5
+//     --rep-ms <ms>        duration of one repetition, default 200
+//     --warmup-ms <ms>     warm-up, also sizes repetitions, default 100
+//     --dir <dir>          directory for input files, default new directory in /tmp
+//
+// Output is one tab separated line per benchmark after a '#' header:
+// name, iterations per repetition, median and minimum ns/op, allocations
+// and bytes per op.  Allocations are malloc() calls made by _py.cpp (the
+// binary is linked with --wrap=malloc), blocks taken from PY_ARENA are not
+// allocations.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <algorithm>
+#include <vector>
+
+#include "_py.h"
+
+static unsigned long long bench_allocs = 0;
+static unsigned long long bench_alloc_bytes = 0;
+
+extern "C" void * __real_malloc(size_t size);
+
+extern "C" void * __wrap_malloc(size_t size)
+{
+    bench_allocs ++;
+    bench_alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+typedef void (* BENCH_FNC)(void);
+
+typedef struct
+{
+    const char *    name;
+    BENCH_FNC       fnc;
+} BENCH;
+
+static PY_STRING        bench_dir;
+static volatile int     bench_sink;             // Results are consumed here
+
+// Inputs
+static LIST_PY_STRING   bench_components;
+static PY_STRING        bench_info;
+static PY_STRING        bench_metadata;         // 64 KB of APTPL registrations
+static PY_STRING        bench_padded;
+
+static void bench_err(const char * msg)
+{
+    fprintf(stderr, "%s" "\n", msg);
+    _py_sys_exit(1, msg);
+}
+
+static unsigned long long bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Benchmarks
+//
+
+static void bench_string_concat(void)
+{
+    PY_STRING root = "/sys/kernel/config/target/core";
+    PY_STRING s;
+
+    s = root + "/" + "iblock_12" + "/" + "dev_3" + "/attrib/" + "emulate_write_cache";
+    bench_sink += s.len();
+}
+
+static void bench_string_split_path(void)
+{
+    PY_STRING           s = "/sys/kernel/config/target/core/iblock_12/dev_3/alua/default_tg_pt_gp";
+    VECTOR_PY_STRING    items;
+
+    items = s.split('/');
+    bench_sink += items.size();
+}
+
+static void bench_string_split_info(void)
+{
+    VECTOR_PY_STRING items;
+
+    items = bench_info.split();
+    bench_sink += items.size();
+}
+
+static void bench_string_strip_attr(void)
+{
+    PY_STRING s = "T10 VPD Unit Serial Number: 6c2b4ea1-1e6d-4a62-9d0d-6f4c2d7a1b33\n";
+
+    bench_sink += s.strip().len();
+}
+
+static void bench_string_strip_64k(void)
+{
+    bench_sink += bench_padded.strip().len();
+}
+
+static void bench_string_format(void)
+{
+    PY_STRING s;
+
+    s = PY_STRING().format("%s/%s/alua/%s/%s", "/sys/kernel/config/target/core", "iblock_12/dev_3", "gp_1", "alua_access_state");
+    bench_sink += s.len();
+}
+
+static void bench_string_join(void)
+{
+    PY_STRING s;
+
+    s = PY_STRING("/").join(bench_components);
+    bench_sink += s.len();
+}
+
+static void bench_file_read(const char * name)
+{
+    PY_FILE     f;
+    PY_STRING   s;
+
+    f.open(bench_dir + name);
+    s = f.read();
+    f.close();
+    bench_sink += s.len();
+}
+
+static void bench_file_read_attr(void)
+{
+    bench_file_read("/attr");
+}
+
+static void bench_file_read_1k(void)
+{
+    bench_file_read("/md_1k");
+}
+
+static void bench_file_read_4k(void)
+{
+    bench_file_read("/md_4k");
+}
+
+static void bench_file_read_16k(void)
+{
+    bench_file_read("/md_16k");
+}
+
+static void bench_file_read_64k(void)
+{
+    bench_file_read("/md_64k");
+}
+
+static void bench_file_readline_64k(void)
+{
+    PY_FILE     f;
+    PY_STRING   s;
+    int         lines = 0;
+
+    f.open(bench_dir + "/md_64k");
+    while ((s = f.readline()) != NULL)
+        lines ++;
+    f.close();
+    bench_sink += lines;
+}
+
+static void bench_file_readlines_64k(void)
+{
+    PY_FILE         f;
+    LIST_PY_STRING  lines;
+
+    f.open(bench_dir + "/md_64k");
+    lines = f.readlines();
+    f.close();
+    bench_sink += lines.size();
+}
+
+static void bench_os_listdir_1k(void)
+{
+    LIST_PY_STRING names;
+
+    names = _py_os_listdir(bench_dir + "/dir_1k");
+    bench_sink += names.size();
+}
+
+static void bench_uuid_uuid4(void)
+{
+    bench_sink += _py_uuid_uuid4().len();
+}
+
+static const BENCH benches[] =
+{
+    { "string_concat",          bench_string_concat },
+    { "string_split_path",      bench_string_split_path },
+    { "string_split_info",      bench_string_split_info },
+    { "string_strip_attr",      bench_string_strip_attr },
+    { "string_strip_64k",       bench_string_strip_64k },
+    { "string_format",          bench_string_format },
+    { "string_join",            bench_string_join },
+    { "file_read_attr",         bench_file_read_attr },
+    { "file_read_1k",           bench_file_read_1k },
+    { "file_read_4k",           bench_file_read_4k },
+    { "file_read_16k",          bench_file_read_16k },
+    { "file_read_64k",          bench_file_read_64k },
+    { "file_readline_64k",      bench_file_readline_64k },
+    { "file_readlines_64k",     bench_file_readlines_64k },
+    { "os_listdir_1k",          bench_os_listdir_1k },
+    { "uuid_uuid4",             bench_uuid_uuid4 },
+    { NULL,                     NULL }
+};
+
+//
+// Inputs
+//
+
+static void bench_put(const PY_STRING & filename, const PY_STRING & content)
+{
+    PY_FILE f;
+
+    f.open(filename, "w");
+    f.write(content, content.len());
+    f.close();
+}
+
+static void bench_inputs(void)
+{
+    const int   sizes[] = { 1, 4, 16, 64 };
+    PY_STRING   reg;
+    int         idx;
+
+    bench_components.push_back("sys");
+    bench_components.push_back("kernel");
+    bench_components.push_back("config");
+    bench_components.push_back("target");
+    bench_components.push_back("core");
+    bench_components.push_back("iblock_12");
+    bench_components.push_back("dev_3");
+    bench_components.push_back("alua");
+    bench_components.push_back("default_tg_pt_gp");
+    bench_components.push_back("alua_access_state");
+
+    bench_info = "Status: ACTIVATED  Max Queue Depth: 128  SectorSize: 512  HwMaxSectors: 1024\n"
+                 "        iBlock device: sdb  UDEV PATH: /dev/disk/by-id/wwn-0x5000c500a1b2c3d4\n"
+                 "        readonly: 0  major: 8 minor: 16\n";
+
+    for (idx = 0; bench_metadata.len() < 64 * 1024; idx ++)
+    {
+        reg = PY_STRING().format("PR_REG_START: %d\ninitiator_fabric=iSCSI\n"
+                                 "initiator_node=iqn.2015-01.com.example:host%d\n"
+                                 "sa_res_key=%d\nres_holder=0\nres_type=00\nres_scope=00\n"
+                                 "target_fabric=iSCSI\ntarget_node=iqn.2015-01.com.example:target\n"
+                                 "tpgt=1\nport_rtpi=1\nmapped_lun=0\norig_lun=0\nPR_REG_END: %d\n",
+                                 idx, idx, idx + 1, idx);
+        bench_metadata += reg;
+    }
+    bench_padded = PY_STRING("\n  ") + bench_metadata + "  \n";
+
+    bench_put(bench_dir + "/attr", "512\n");
+    for (idx = 0; idx < (int)(sizeof(sizes) / sizeof(sizes[0])); idx ++)
+        bench_put(bench_dir + PY_STRING().format("/md_%dk", sizes[idx]), PY_STRING(bench_metadata, sizes[idx] * 1024));
+
+    _py_os_mkdir(bench_dir + "/dir_1k");
+    for (idx = 0; idx < 1000; idx ++)
+        bench_put(bench_dir + PY_STRING().format("/dir_1k/dev_%d", idx), "");
+}
+
+static int bench_rm(const char * path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+//
+// Runner
+//
+
+static void bench_run(const BENCH * bench, int reps, int rep_ms, int warmup_ms)
+{
+    std::vector<double>     ns_per_op;
+    unsigned long long      start;
+    unsigned long long      elapsed;
+    unsigned long long      allocs;
+    unsigned long long      alloc_bytes;
+    long                    iters = 0;
+    long                    iters_per_rep;
+
+    // Warm-up runs until warmup_ms have passed, its rate sizes repetitions
+    start = bench_ns();
+    do
+    {
+        bench->fnc();
+        iters ++;
+        elapsed = bench_ns() - start;
+    } while (elapsed < (unsigned long long) warmup_ms * 1000000ULL);
+
+    iters_per_rep = (long) ((double) iters * rep_ms / (elapsed / 1e6));
+    if (iters_per_rep < 1)
+        iters_per_rep = 1;
+
+    allocs = bench_allocs;
+    alloc_bytes = bench_alloc_bytes;
+    for (int rep = 0; rep < reps; rep ++)
+    {
+        start = bench_ns();
+        for (long idx = 0; idx < iters_per_rep; idx ++)
+            bench->fnc();
+        ns_per_op.push_back((double) (bench_ns() - start) / iters_per_rep);
+    }
+    allocs = bench_allocs - allocs;
+    alloc_bytes = bench_alloc_bytes - alloc_bytes;
+
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    printf("%s\t%ld\t%.1f\t%.1f\t%.2f\t%.1f\n",
+           bench->name, iters_per_rep, ns_per_op[ns_per_op.size() / 2], ns_per_op[0],
+           (double) allocs / ((double) iters_per_rep * reps), (double) alloc_bytes / ((double) iters_per_rep * reps));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    char            dir_template[] = "/tmp/_py_bench.XXXXXX";
+    const char *    filter = NULL;
+    bool            dir_made = false;
+    int             reps = 5;
+    int             rep_ms = 200;
+    int             warmup_ms = 100;
+    int             status = 0;
+
+    try
+    {
+        for (int idx = 1; idx < argc; idx ++)
+        {
+            if ((0 == strcmp(argv[idx], "--filter")) && (idx + 1 < argc))
+                filter = argv[++ idx];
+            else if ((0 == strcmp(argv[idx], "--reps")) && (idx + 1 < argc))
+                reps = atoi(argv[++ idx]);
+            else if ((0 == strcmp(argv[idx], "--rep-ms")) && (idx + 1 < argc))
+                rep_ms = atoi(argv[++ idx]);
+            else if ((0 == strcmp(argv[idx], "--warmup-ms")) && (idx + 1 < argc))
+                warmup_ms = atoi(argv[++ idx]);
+            else if ((0 == strcmp(argv[idx], "--dir")) && (idx + 1 < argc))
+                bench_dir = argv[++ idx];
+            else
+                bench_err(PY_STRING("Unknown option: ") + argv[idx]);
+        }
+        if ((reps < 1) || (rep_ms < 1) || (warmup_ms < 1))
+            bench_err("Invalid repetitions");
+
+        if (bench_dir.len() == 0)
+        {
+            if (NULL == mkdtemp(dir_template))
+                bench_err(PY_STRING("Can not create input directory: ") + strerror(errno));
+            bench_dir = dir_template;
+            dir_made = true;
+        }
+        bench_inputs();
+
+        printf("#name\titers\tns_per_op\tns_per_op_min\tallocs_per_op\tbytes_per_op\n");
+        for (const BENCH * bench = benches; bench->name != NULL; bench ++)
+            if ((filter == NULL) || (NULL != strstr(bench->name, filter)))
+                bench_run(bench, reps, rep_ms, warmup_ms);
+    }
+    catch (_py_SystemExit const & e)
+    {
+        status = e.code();
+    }
+    catch (std::exception const & e)
+    {
+        printf("Exception: %s\n", e.what());
+        status = 1;
+    }
+
+    if (dir_made)
+        nftw(dir_template, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+
+    return status;
+}
@@ -0,0 +1,416 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+// Restore benchmark over emulated configfs:
+//
+//     tcm_bench [options]
+//
+//     --sizes <n,...>      numbers of HBAs, default 10,100,1000,10000
+//     --devs <M>           iblock devices per HBA, default 1
+//     --alua <K>           ALUA groups per device, default 2
+//     --aptpl <R>          APTPL registrations, device i gets i % (R + 1), default 8
+//     --jobs <N>           HBAs restored in parallel, default 1
+//     --latency <usecs>    emulated latency of mkdir, rmdir and write, default 0
+//     --root <dir>         work directory, default new directory in /tmp
+//     --reference <cmd>    command run once per operation with tcm_node.py
+//                          options, default ./tcm_node on the same roots
+//     --reference-max <n>  largest size run with reference, default 100
+//
+// Each device is established, gets its unit serial with APTPL metadata and
+// its ALUA groups with metadata, through tcm_createvirtdev(),
+// tcm_set_wwn_unit_serial_with_md() and tcm_add_alua_tgptgp_with_md().
+// The reference runs the same operations one process each, as a restore
+// script of tcm_node.py does.  tcm_node.py itself has fixed configfs paths,
+// so it can be the reference only through a wrapper that maps them.
+//
+// Every size runs in a forked child, so peak RSS and syscall counts (read
+// and write class, from /proc/self/io) belong to that size only.  Peak RSS
+// of reference is that of its largest command process.  Latencies p50/p99
+// are of succeeded commands, cmds counts them, failed counts devices.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_ops.h"
+#include "tcm_pool.h"
+
+typedef struct
+{
+    int         hbas;
+    int         devs;
+    int         cmds;
+    int         failed;
+    double      secs;
+    double      p50_usecs;
+    double      p99_usecs;
+    long long   syscalls;
+    long        rss_kb;
+} TCM_BENCH_RESULT;
+
+static VECTOR_PY_STRING bench_sizes;
+static int              bench_devs = 1;
+static int              bench_alua = 2;
+static int              bench_aptpl = 8;
+static int              bench_jobs = 1;
+static int              bench_latency_usecs = 0;
+static PY_STRING        bench_root;
+static PY_STRING        bench_reference;
+static int              bench_reference_max = 100;
+
+// Context of one run
+typedef struct
+{
+    bool                                reference;
+    PY_STRING                           prefix;     // Reference command with options
+    int                                 hbas;
+    std::vector<std::vector<double> >   latencies;  // Seconds of each succeeded command, per HBA
+    std::vector<int>                    failed;     // Per HBA
+} TCM_BENCH_RUN;
+
+static void bench_err(const char * msg)
+{
+    fprintf(stderr, "%s" "\n", msg);
+    _py_sys_exit(1, msg);
+}
+
+static PY_STRING bench_serial(int hba_idx, int dev_idx)
+{
+    return PY_STRING().format("bench-%d-%d", hba_idx, dev_idx);
+}
+
+static void bench_put(const PY_STRING & filename, const PY_STRING & content)
+{
+    PY_FILE f;
+
+    f.open(filename, "w");
+    f.write(content);
+    f.close();
+}
+
+// Writes APTPL and ALUA metadata of all devices under var root
+static void bench_metadata(int hbas)
+{
+    PY_STRING   serial;
+    PY_STRING   aptpl;
+    int         regs_num;
+
+    _py_os_makedirs(tcm_var_path("pr"));
+    for (int hba_idx = 0; hba_idx < hbas; hba_idx ++)
+    {
+        for (int dev_idx = 0; dev_idx < bench_devs; dev_idx ++)
+        {
+            serial = bench_serial(hba_idx, dev_idx);
+
+            regs_num = (hba_idx * bench_devs + dev_idx) % (bench_aptpl + 1);
+            if (regs_num > 0)
+            {
+                aptpl = PY_STRING();
+                for (int reg_idx = 0; reg_idx < regs_num; reg_idx ++)
+                    aptpl += PY_STRING().format("PR_REG_START: %d\ninitiator_fabric=iSCSI\n"
+                                                "initiator_node=iqn.2015-01.com.example:host%d\n"
+                                                "sa_res_key=%d\nres_holder=0\nres_type=00\nres_scope=00\n"
+                                                "target_fabric=iSCSI\ntarget_node=iqn.2015-01.com.example:target\n"
+                                                "tpgt=1\nport_rtpi=1\nmapped_lun=%d\norig_lun=%d\nPR_REG_END: %d\n",
+                                                reg_idx, reg_idx, reg_idx + 1, dev_idx, dev_idx, reg_idx);
+                bench_put(tcm_var_path("pr/aptpl_") + serial, aptpl);
+            }
+
+            _py_os_makedirs(tcm_var_path("alua/tpgs_") + serial);
+            for (int gp_idx = 0; gp_idx < bench_alua; gp_idx ++)
+                bench_put(tcm_var_path("alua/tpgs_") + serial + PY_STRING().format("/gp_%d", gp_idx),
+                          PY_STRING().format("tg_pt_gp_id=%d\nalua_access_state=0x00\nalua_access_status=0x00\n", gp_idx + 1));
+        }
+    }
+}
+
+// Runs one operation, returns false if it failed
+static bool bench_cmd(TCM_BENCH_RUN & run, int hba_idx, int op, const PY_STRING & dev_path, const PY_STRING & arg1, const PY_STRING & arg2)
+{
+    const char *    ops[] = {"--establishdev", "--setunitserialwithmd", "--addaluatpgwithmd"};
+    double          start = _py_time_monotonic();
+    bool            ok = true;
+
+    if (run.reference)
+        ok = 0 == _py_os_system(run.prefix + " " + ops[op] + " " + dev_path + " " + arg1 + " " + arg2 + " >/dev/null 2>&1");
+    else
+    {
+        try
+        {
+            // Per command as in tcm_node, whole run in one arena would pin its chunks
+            PY_ARENA arena;
+
+            if (op == 0)
+                tcm_createvirtdev(dev_path, arg1, true);
+            else if (op == 1)
+                tcm_set_wwn_unit_serial_with_md(dev_path, arg1);
+            else
+                tcm_add_alua_tgptgp_with_md(dev_path, arg1, arg2);
+        }
+        catch (std::exception const & e)
+        {
+            ok = false;
+        }
+    }
+
+    if (ok)
+        run.latencies[hba_idx].push_back(_py_time_monotonic() - start);
+    return ok;
+}
+
+static void bench_hba(void * ctx, int hba_idx)
+{
+    TCM_BENCH_RUN & run = *(TCM_BENCH_RUN *) ctx;
+    PY_STRING       dev_path;
+
+    for (int dev_idx = 0; dev_idx < bench_devs; dev_idx ++)
+    {
+        dev_path = PY_STRING().format("iblock_%d/dev_%d", hba_idx, dev_idx);
+
+        // Later operations of failed device would fail too
+        if (!bench_cmd(run, hba_idx, 0, dev_path, "/dev/null", "") ||
+            !bench_cmd(run, hba_idx, 1, dev_path, bench_serial(hba_idx, dev_idx), ""))
+        {
+            run.failed[hba_idx] ++;
+            continue;
+        }
+        for (int gp_idx = 0; gp_idx < bench_alua; gp_idx ++)
+        {
+            if (!bench_cmd(run, hba_idx, 2, dev_path, PY_STRING().format("gp_%d", gp_idx), PY_STRING().format("%d", gp_idx + 1)))
+            {
+                run.failed[hba_idx] ++;
+                break;
+            }
+        }
+    }
+}
+
+// Read and write class syscalls of this process
+static long long bench_syscalls(void)
+{
+    PY_FILE             f;
+    LIST_PY_STRING      lines;
+    LIST_PY_STRING_IT   it;
+    long long           syscalls = 0;
+
+    try
+    {
+        f.open("/proc/self/io");
+        lines = f.readlines();
+        f.close();
+    }
+    catch (_py_IOError const & e)
+    {
+        return -1;
+    }
+
+    for (it = lines.begin(); it != lines.end(); it ++)
+        if (it->starts_with("syscr:") || it->starts_with("syscw:"))
+            syscalls += atoll(it->string_after(":"));
+    return syscalls;
+}
+
+static int bench_rm(const char * path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+// Runs size in this process, called in forked child
+static void bench_child(bool reference, int hbas, TCM_BENCH_RESULT & result)
+{
+    TCM_BENCH_RUN       run;
+    PY_STRING           dir = bench_root + PY_STRING().format("/%s_%d", reference ? "reference" : "library", hbas);
+    std::vector<double> latencies;
+    struct rusage       usage;
+    long long           syscalls;
+    double              start;
+
+    tcm_set_var_root(dir + "/var");
+    tcm_cfs_set_root(dir + "/target");
+    tcm_cfs_set_emulate(true, bench_latency_usecs);
+    bench_metadata(hbas);
+
+    run.reference = reference;
+    run.prefix = bench_reference;
+    if (run.prefix.len() == 0)
+        run.prefix = PY_STRING().format("./tcm_node --root %s/target --var-root %s/var --emulate %d",
+                                        (char *)dir, (char *)dir, bench_latency_usecs);
+    run.hbas = hbas;
+    run.latencies.resize(hbas);
+    run.failed.resize(hbas);
+
+    syscalls = bench_syscalls();
+    start = _py_time_monotonic();
+    tcm_pool_run(bench_jobs, hbas, bench_hba, &run);
+    result.secs = _py_time_monotonic() - start;
+    result.syscalls = bench_syscalls() - syscalls;
+
+    memset(&usage, 0, sizeof(usage));
+    getrusage(reference ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage);
+    result.rss_kb = usage.ru_maxrss;
+
+    for (int idx = 0; idx < hbas; idx ++)
+    {
+        latencies.insert(latencies.end(), run.latencies[idx].begin(), run.latencies[idx].end());
+        result.failed += run.failed[idx];
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.hbas = hbas;
+    result.devs = hbas * bench_devs;
+    result.cmds = latencies.size();
+    if (latencies.size() > 0)
+    {
+        result.p50_usecs = latencies[latencies.size() / 2] * 1e6;
+        result.p99_usecs = latencies[(latencies.size() * 99) / 100] * 1e6;
+    }
+
+    tcm_cfs_flush();
+    nftw(dir, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void bench_size(bool reference, int hbas)
+{
+    TCM_BENCH_RESULT    result;
+    pid_t               pid;
+    int                 fds[2];
+    int                 status;
+
+    memset(&result, 0, sizeof(result));
+    if (0 != pipe(fds))
+        bench_err(PY_STRING("Can not create pipe: ") + strerror(errno));
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+        bench_err(PY_STRING("Can not fork: ") + strerror(errno));
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        try
+        {
+            bench_child(reference, hbas, result);
+        }
+        catch (std::exception const & e)
+        {
+            fprintf(stderr, "%s_%d: %s\n", reference ? "reference" : "library", hbas, e.what());
+            result.failed = -1;
+        }
+        if (sizeof(result) != write(fds[1], &result, sizeof(result)))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (sizeof(result) != read(fds[0], &result, sizeof(result)))
+        result.failed = -1;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    if (result.failed < 0)
+    {
+        printf("%-10s %6d  failed\n", reference ? "reference" : "library", hbas);
+        return;
+    }
+    printf("%-10s %6d %7d %8d %9.3f %10.1f %9.1f %9.1f %10lld %8ld %7d\n",
+           reference ? "reference" : "library", result.hbas, result.devs, result.cmds, result.secs,
+           result.secs > 0 ? result.devs / result.secs : 0, result.p50_usecs, result.p99_usecs,
+           result.syscalls, result.rss_kb, result.failed);
+}
+
+static int bench_arg(int argc, char ** argv, int & idx)
+{
+    if (idx + 1 >= argc)
+        bench_err(PY_STRING("Missing value of ") + argv[idx]);
+    return atoi(argv[++ idx]);
+}
+
+int main(int argc, char *argv[])
+{
+    char        root_template[] = "/tmp/tcm_bench.XXXXXX";
+    bool        root_made = false;
+    int         status = 0;
+
+    try
+    {
+        PY_ARENA arena;
+
+        bench_sizes = PY_STRING("10,100,1000,10000").split(',');
+        for (int idx = 1; idx < argc; idx ++)
+        {
+            if ((0 == strcmp(argv[idx], "--sizes")) && (idx + 1 < argc))
+                bench_sizes = PY_STRING(argv[++ idx]).split(',');
+            else if (0 == strcmp(argv[idx], "--devs"))
+                bench_devs = bench_arg(argc, argv, idx);
+            else if (0 == strcmp(argv[idx], "--alua"))
+                bench_alua = bench_arg(argc, argv, idx);
+            else if (0 == strcmp(argv[idx], "--aptpl"))
+                bench_aptpl = bench_arg(argc, argv, idx);
+            else if (0 == strcmp(argv[idx], "--jobs"))
+                bench_jobs = bench_arg(argc, argv, idx);
+            else if (0 == strcmp(argv[idx], "--latency"))
+                bench_latency_usecs = bench_arg(argc, argv, idx);
+            else if ((0 == strcmp(argv[idx], "--root")) && (idx + 1 < argc))
+                bench_root = argv[++ idx];
+            else if ((0 == strcmp(argv[idx], "--reference")) && (idx + 1 < argc))
+                bench_reference = argv[++ idx];
+            else if (0 == strcmp(argv[idx], "--reference-max"))
+                bench_reference_max = bench_arg(argc, argv, idx);
+            else
+                bench_err(PY_STRING("Unknown option: ") + argv[idx]);
+        }
+        if ((bench_devs < 1) || (bench_alua < 0) || (bench_aptpl < 0) || (bench_jobs < 1))
+            bench_err("Invalid workload");
+
+        if (bench_root.len() == 0)
+        {
+            if (NULL == mkdtemp(root_template))
+                bench_err(PY_STRING("Can not create work directory: ") + strerror(errno));
+            bench_root = root_template;
+            root_made = true;
+        }
+
+        printf("devs/HBA %d, ALUA groups %d, APTPL registrations 0-%d, jobs %d, latency %d us\n",
+               bench_devs, bench_alua, bench_aptpl, bench_jobs, bench_latency_usecs);
+        printf("%-10s %6s %7s %8s %9s %10s %9s %9s %10s %8s %7s\n",
+               "mode", "hbas", "devs", "cmds", "secs", "devs/s", "p50_us", "p99_us", "syscalls", "rss_kb", "failed");
+
+        for (unsigned int idx = 0; idx < bench_sizes.size(); idx ++)
+        {
+            int hbas = atoi(bench_sizes[idx]);
+
+            if (hbas < 1)
+                bench_err(PY_STRING("Invalid size: ") + bench_sizes[idx]);
+            bench_size(false, hbas);
+            if (hbas <= bench_reference_max)
+                bench_size(true, hbas);
+        }
+    }
+    catch (_py_SystemExit const & e)
+    {
+        status = e.code();
+    }
+    catch (std::exception const & e)
+    {
+        printf("Exception: %s\n", e.what());
+        status = 1;
+    }
+
+    if (root_made)
+        rmdir(root_template);
+
+    return status;
+}
@@ -0,0 +1,367 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tcm_cfs.h"
+#include "tcm_emu.h"
+#include "tcm_trace.h"
+
+typedef std::map<PY_STRING, int>    MAP_TCM_CFS_FD;
+typedef MAP_TCM_CFS_FD::iterator    MAP_TCM_CFS_FD_IT;
+
+static PY_STRING        tcm_target_root = "/sys/kernel/config/target";
+static PY_STRING        tcm_root = "/sys/kernel/config/target/core";
+static MAP_TCM_CFS_FD   tcm_cfs_fds;                    // Key is path relative to tcm_root, "" for tcm_root
+static MAP_PY_STRING    tcm_cfs_attrs;                  // Cached attribute values, key as for tcm_cfs_fds
+static pthread_mutex_t  tcm_cfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TCM_CFS_DEPTH_MAX   0x7fffffff
+
+void tcm_cfs_set_root(const char * target_root)
+{
+    tcm_cfs_flush();
+    tcm_target_root = target_root;
+    tcm_root = tcm_target_root + "/core";
+    if (tcm_emu_enabled())
+        tcm_emu_init(tcm_target_root);
+}
+
+void tcm_cfs_set_emulate(bool emulate, int latency_usecs)
+{
+    tcm_cfs_flush();
+    tcm_emu_set(emulate, latency_usecs);
+    if (emulate)
+        tcm_emu_init(tcm_target_root);
+}
+
+bool tcm_cfs_emulated(void)
+{
+    return tcm_emu_enabled();
+}
+
+const PY_STRING & tcm_cfs_root(void)
+{
+    return tcm_root;
+}
+
+PY_STRING tcm_cfs_target_path(const char * name)
+{
+    return tcm_target_root + "/" + name;
+}
+
+// Gets path relative to tcm_root without trailing '/', limited to max_depth components, returns false for paths outside tcm_root
+static bool tcm_cfs_key(const char * path, int max_depth, PY_STRING & key)
+{
+    int             root_len = strlen(tcm_root);
+    const char *    end;
+    int             depth;
+
+    if ((0 != strncmp(path, tcm_root, root_len)) || (path[root_len] != '/'))
+        return false;
+
+    for (path += root_len; *path == '/'; path ++);
+    for (end = path, depth = 0; (*end != '\0') && (depth < max_depth); depth ++)
+    {
+        for (; (*end != '\0') && (*end != '/'); end ++);
+        if ((depth + 1 < max_depth) && (*end == '/'))
+            end ++;
+    }
+    for (; (end > path) && (end[-1] == '/'); end --);
+
+    key = PY_STRING(path, end - path);
+    return true;
+}
+
+// Returns cached fd for directory, opens it relative to parent_fd if needed
+static int tcm_cfs_handle(const char * key, int key_len, int parent_fd, const char * name)
+{
+    PY_ARENA_SUSPEND    suspend;            // Key and map node outlive arena of caller
+    PY_STRING           k;
+    MAP_TCM_CFS_FD_IT   it;
+    int                 fd;
+
+    k = PY_STRING().format("%.*s", key_len, key);
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    it = tcm_cfs_fds.find(k);
+    if (it != tcm_cfs_fds.end())
+        fd = it->second;
+    else
+    {
+        fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+            tcm_cfs_fds[k] = fd;
+    }
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+
+    return fd;
+}
+
+int tcm_cfs_dirfd(const char * path, const char ** name)
+{
+    int             root_len = strlen(tcm_root);
+    const char *    key;
+    const char *    rel;
+    const char *    sep;
+    char            comp[256];
+    int             fd;
+    int             sub_fd;
+    int             depth;
+
+    *name = path;
+    if (0 != strncmp(path, tcm_root, root_len))
+        return AT_FDCWD;
+    if ((path[root_len] != '/') && (path[root_len] != '\0'))
+        return AT_FDCWD;
+
+    fd = tcm_cfs_handle("", 0, AT_FDCWD, tcm_root);
+    if (fd < 0)
+        return AT_FDCWD;
+
+    for (key = path + root_len; *key == '/'; key ++);
+
+    // Descend through cached HBA and device handles
+    rel = key;
+    for (depth = 0; depth < 2; depth ++)
+    {
+        sep = strchr(rel, '/');
+        if ((sep == NULL) || (sep - rel >= (int)sizeof(comp)))
+            break;
+        memcpy(comp, rel, sep - rel);
+        comp[sep - rel] = '\0';
+
+        sub_fd = tcm_cfs_handle(key, sep - key, fd, comp);
+        if (sub_fd < 0)
+            break;
+        fd = sub_fd;
+        for (rel = sep; *rel == '/'; rel ++);
+    }
+
+    *name = *rel == '\0' ? "." : rel;
+    return fd;
+}
+
+void tcm_cfs_flush(void)
+{
+    MAP_TCM_CFS_FD_IT it;
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    for (it = tcm_cfs_fds.begin(); it != tcm_cfs_fds.end(); it ++)
+        close(it->second);
+    tcm_cfs_fds.clear();
+    tcm_cfs_attrs.clear();
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+}
+
+// Tests if map key is key or lies below it
+static bool tcm_cfs_key_below(const PY_STRING & map_key, const PY_STRING & key)
+{
+    int key_len = key.len();
+
+    if (0 != strncmp(map_key, key, key_len))
+        return false;
+    return (key_len == 0) || (map_key[key_len] == '\0') || (map_key[key_len] == '/');
+}
+
+// Drops cached attributes of key and of everything below it, called with tcm_cfs_mutex locked
+static void tcm_cfs_drop_attrs(const PY_STRING & key)
+{
+    MAP_PY_STRING_IT it;
+
+    for (it = tcm_cfs_attrs.lower_bound(key); (it != tcm_cfs_attrs.end()) && tcm_cfs_key_below(it->first, key); )
+        tcm_cfs_attrs.erase(it ++);
+}
+
+// Closes handles of removed directory and of everything below it
+static void tcm_cfs_forget(const char * path)
+{
+    PY_STRING           key;
+    MAP_TCM_CFS_FD_IT   it;
+
+    if (!tcm_cfs_key(path, TCM_CFS_DEPTH_MAX, key) || (key.len() == 0))
+        return;
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    for (it = tcm_cfs_fds.lower_bound(key); (it != tcm_cfs_fds.end()) && tcm_cfs_key_below(it->first, key); )
+    {
+        close(it->second);
+        tcm_cfs_fds.erase(it ++);
+    }
+    tcm_cfs_drop_attrs(key);
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+}
+
+bool tcm_cfs_attr_get(const char * path, PY_STRING & value)
+{
+    PY_STRING           key;
+    MAP_PY_STRING_IT    it;
+    bool                found = false;
+
+    if (!tcm_cfs_key(path, TCM_CFS_DEPTH_MAX, key))
+        return false;
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    it = tcm_cfs_attrs.find(key);
+    if (it != tcm_cfs_attrs.end())
+    {
+        value = it->second;
+        found = true;
+    }
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+
+    return found;
+}
+
+void tcm_cfs_attr_put(const char * path, const PY_STRING & value)
+{
+    PY_ARENA_SUSPEND    suspend;            // Cached entry outlives arena of caller
+    PY_STRING           key;
+    PY_STRING           value_copy;
+
+    if (!tcm_cfs_key(path, TCM_CFS_DEPTH_MAX, key))
+        return;
+
+    // Shared buffer of value can come from arena, copy is on heap
+    if (value.len() > 0)
+        value_copy = PY_STRING(value, value.len());
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    tcm_cfs_attrs[key] = value_copy;
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+}
+
+void tcm_cfs_attr_invalidate(const char * path)
+{
+    PY_STRING key;
+
+    // Write to any attribute can change others of same device, e.g. enable changes info
+    if (!tcm_cfs_key(path, 2, key))
+        return;
+
+    pthread_mutex_lock(&tcm_cfs_mutex);
+    tcm_cfs_drop_attrs(key);
+    pthread_mutex_unlock(&tcm_cfs_mutex);
+}
+
+bool tcm_cfs_isdir(const char * path)
+{
+    TCM_TRACE_SPAN  span("cfs_stat", path);
+    const char *    name;
+    int             fd = tcm_cfs_dirfd(path, &name);
+
+    _py_stats_thread()->cfs_stats ++;
+    return _py_os_path_isdir(name, fd);
+}
+
+bool tcm_cfs_isfile(const char * path)
+{
+    TCM_TRACE_SPAN  span("cfs_stat", path);
+    const char *    name;
+    int             fd = tcm_cfs_dirfd(path, &name);
+
+    _py_stats_thread()->cfs_stats ++;
+    return _py_os_path_isfile(name, fd);
+}
+
+LIST_PY_STRING tcm_cfs_listdir(const char * path)
+{
+    TCM_TRACE_SPAN  span("cfs_listdir", path);
+    const char *    name;
+    int             fd = tcm_cfs_dirfd(path, &name);
+
+    _py_stats_thread()->cfs_listdirs ++;
+    return _py_os_listdir(name, fd);
+}
+
+void tcm_cfs_mkdir(const char * path)
+{
+    TCM_TRACE_SPAN  span("cfs_mkdir", path);
+    PY_STRING       key;
+    const char *    name;
+    int             fd = tcm_cfs_dirfd(path, &name);
+
+    _py_stats_thread()->cfs_mkdirs ++;
+    _py_os_mkdir(name, fd);
+    if (tcm_emu_enabled() && tcm_cfs_key(path, TCM_CFS_DEPTH_MAX, key))
+        tcm_emu_mkdir(fd, name, key);
+}
+
+void tcm_cfs_rmdir(const char * path)
+{
+    TCM_TRACE_SPAN  span("cfs_rmdir", path);
+    PY_STRING       dir_path;
+    PY_STRING       key;
+    const char *    name;
+    int             fd;
+    int             len;
+    int             err;
+
+    _py_stats_thread()->cfs_rmdirs ++;
+
+    // Without trailing '/' name is resolved relative to parent directory
+    for (len = strlen(path); (len > 1) && (path[len - 1] == '/'); len --);
+    dir_path = PY_STRING().format("%.*s", len, path);
+
+    // Handles of directory must not be used after rmdir, it can be recreated
+    tcm_cfs_forget(dir_path);
+    fd = tcm_cfs_dirfd(dir_path, &name);
+
+    if (tcm_emu_enabled() && tcm_cfs_key(dir_path, TCM_CFS_DEPTH_MAX, key))
+    {
+        err = tcm_emu_rmdir(fd, name, key);
+        if (err != 0)
+            throw _py_OSError(strerror(err));
+        return;
+    }
+
+    _py_os_rmdir(name, fd);
+}
+
+void tcm_cfs_open(PY_FILE & f, const char * path, const char * mode)
+{
+    TCM_TRACE_SPAN  span("cfs_open", path);
+    const char *    name;
+    int             fd = tcm_cfs_dirfd(path, &name);
+
+    if (mode[0] == 'r')
+        _py_stats_thread()->cfs_reads ++;
+    f.open(name, mode, fd);
+}
+
+int tcm_cfs_write(const char * path, const char * value, int len)
+{
+    TCM_TRACE_SPAN  span("cfs_write", path);
+    const char *    name;
+    int             dir_fd;
+    int             fd;
+    int             ret = 0;
+
+    _py_stats_thread()->cfs_writes ++;
+    tcm_cfs_attr_invalidate(path);
+    dir_fd = tcm_cfs_dirfd(path, &name);
+    if (tcm_emu_enabled() && (dir_fd != AT_FDCWD))
+        return tcm_emu_write(dir_fd, name, value, len);
+
+    // Attribute value must come in single write(), configfs files are neither created nor truncated
+    fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    errno = 0;
+    if (len != write(fd, value, len))
+        ret = errno != 0 ? errno : EIO;
+
+    if ((0 != close(fd)) && (ret == 0))
+        ret = errno;
+
+    return ret;
+}
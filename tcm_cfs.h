@@ -0,0 +1,49 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_CFS_H_
+#define _TCM_CFS_H_ 1
+
+#include "_py.h"
+
+//
+// ConfigFS handle cache
+//
+// Directory fds of tcm_root, HBAs and devices are kept open, so paths under
+// tcm_root are resolved relative to them with *at() calls instead of walking
+// the whole path.  Paths outside tcm_root are used as they are.
+//
+// Target root is /sys/kernel/config/target unless set otherwise, with
+// emulation it is a plain directory tree (see tcm_emu.h).
+//
+// Values of read-mostly attributes can be cached too.  Cached values of a
+// device are dropped by tcm_cfs_attr_invalidate() of any of its attributes
+// and by tcm_cfs_rmdir() of the device, all by tcm_cfs_flush().
+//
+
+void            tcm_cfs_set_root    (const char * target_root);                 // Flushes cache, throws _py_OSError if emulated tree can not be created
+void            tcm_cfs_set_emulate (bool emulate, int latency_usecs);          // throws _py_OSError if emulated tree can not be created
+bool            tcm_cfs_emulated    (void);
+const PY_STRING & tcm_cfs_root      (void);                                     // <target root>/core, tcm_root of tcm_node.py
+PY_STRING       tcm_cfs_target_path (const char * name);                        // <target root>/<name>
+
+int             tcm_cfs_dirfd   (const char * path, const char ** name);       // Returns fd for *at() call and name relative to it
+void            tcm_cfs_flush   (void);                                         // Closes all cached handles, drops cached values
+
+bool            tcm_cfs_isdir   (const char * path);
+bool            tcm_cfs_isfile  (const char * path);
+LIST_PY_STRING  tcm_cfs_listdir (const char * path);                            // throws _py_OSError
+void            tcm_cfs_mkdir   (const char * path);                            // throws _py_OSError
+void            tcm_cfs_rmdir   (const char * path);                            // throws _py_OSError
+void            tcm_cfs_open    (PY_FILE & f, const char * path, const char * mode);   // throws _py_IOError
+int             tcm_cfs_write   (const char * path, const char * value, int len);      // Single write() of attribute, drops cached values, returns 0 or errno
+
+bool            tcm_cfs_attr_get        (const char * path, PY_STRING & value);    // Returns false if value is not cached
+void            tcm_cfs_attr_put        (const char * path, const PY_STRING & value);
+void            tcm_cfs_attr_invalidate (const char * path);                       // Call before writing attribute
+
+#endif /* _TCM_CFS_H_ */
@@ -0,0 +1,347 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "_py.h"
+#include "tcm_emu.h"
+
+static bool tcm_emu_enable = false;
+static int  tcm_emu_latency_usecs = 0;
+
+// Files of new objects, "dir/" entries are default groups
+static const char * tcm_emu_hba_files[] =
+{
+    "hba_info",             "HBA Index: 0 plugin: emulated version: v5.0",
+    "hba_mode",             "0",
+    NULL
+};
+
+static const char * tcm_emu_dev_files[] =
+{
+    "alias",                                "",
+    "enable",                               "0",
+    "info",                                 "Status: DEACTIVATED  Max Queue Depth: 0  SectorSize: 512  HwMaxSectors: 1024",
+    "udev_path",                            "",
+    "alua/",                                NULL,
+    "alua/default_tg_pt_gp/",               NULL,
+    "alua/default_tg_pt_gp/alua_access_state",  "0",
+    "alua/default_tg_pt_gp/alua_access_status", "0",
+    "alua/default_tg_pt_gp/alua_access_type",   "3",
+    "alua/default_tg_pt_gp/alua_write_metadata","0",
+    "alua/default_tg_pt_gp/nonop_delay_msecs",  "100",
+    "alua/default_tg_pt_gp/preferred",      "0",
+    "alua/default_tg_pt_gp/tg_pt_gp_id",    "0",
+    "alua/default_tg_pt_gp/trans_delay_msecs",  "0",
+    "attrib/",                              NULL,
+    "attrib/block_size",                    "512",
+    "attrib/emulate_3pc",                   "1",
+    "attrib/emulate_caw",                   "1",
+    "attrib/emulate_dpo",                   "1",
+    "attrib/emulate_fua_read",              "1",
+    "attrib/emulate_fua_write",             "1",
+    "attrib/emulate_model_alias",           "1",
+    "attrib/emulate_tas",                   "1",
+    "attrib/emulate_tpu",                   "0",
+    "attrib/emulate_tpws",                  "0",
+    "attrib/emulate_ua_intlck_ctrl",        "0",
+    "attrib/emulate_write_cache",           "0",
+    "attrib/enforce_pr_isids",              "1",
+    "attrib/force_pr_aptpl",                "0",
+    "attrib/hw_block_size",                 "512",
+    "attrib/hw_max_sectors",                "1024",
+    "attrib/hw_queue_depth",                "128",
+    "attrib/is_nonrot",                     "0",
+    "attrib/max_unmap_block_desc_count",    "1",
+    "attrib/max_unmap_lba_count",           "8192",
+    "attrib/max_write_same_len",            "65535",
+    "attrib/optimal_sectors",               "1024",
+    "attrib/pi_prot_type",                  "0",
+    "attrib/queue_depth",                   "128",
+    "attrib/unmap_granularity",             "1",
+    "attrib/unmap_granularity_alignment",   "0",
+    "pr/",                                  NULL,
+    "pr/res_aptpl_active",                  "0",
+    "pr/res_aptpl_metadata",                "",
+    "wwn/",                                 NULL,
+    "wwn/vpd_unit_serial",                  "T10 VPD Unit Serial Number: ",
+    NULL
+};
+
+static const char * tcm_emu_tg_pt_gp_files[] =
+{
+    "alua_access_state",    "0",
+    "alua_access_status",   "0",
+    "alua_access_type",     "3",
+    "alua_write_metadata",  "0",
+    "nonop_delay_msecs",    "100",
+    "preferred",            "0",
+    "tg_pt_gp_id",          "",
+    "trans_delay_msecs",    "0",
+    NULL
+};
+
+static const char * tcm_emu_lu_gp_files[] =
+{
+    "lu_gp_id",             "",
+    NULL
+};
+
+void tcm_emu_set(bool emulate, int latency_usecs)
+{
+    tcm_emu_enable = emulate;
+    tcm_emu_latency_usecs = latency_usecs > 0 ? latency_usecs : 0;
+}
+
+bool tcm_emu_enabled(void)
+{
+    return tcm_emu_enable;
+}
+
+static void tcm_emu_latency(void)
+{
+    struct timespec ts;
+
+    if (tcm_emu_latency_usecs == 0)
+        return;
+
+    ts.tv_sec = tcm_emu_latency_usecs / 1000000;
+    ts.tv_nsec = (tcm_emu_latency_usecs % 1000000) * 1000;
+    while ((0 != nanosleep(&ts, &ts)) && (errno == EINTR));
+}
+
+// Writes whole file relative to dir_fd, creates it if needed
+static int tcm_emu_put(int dir_fd, const char * name, const char * value, int len, int flags)
+{
+    int fd;
+    int ret = 0;
+
+    fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC | flags, 0644);
+    if (fd < 0)
+        return errno;
+    if ((len > 0) && (len != write(fd, value, len)))
+        ret = errno != 0 ? errno : EIO;
+    if ((0 != close(fd)) && (ret == 0))
+        ret = errno;
+    return ret;
+}
+
+static void tcm_emu_create(int dir_fd, const char ** files)
+{
+    PY_STRING   value;
+    int         err;
+
+    for (; *files != NULL; files += 2)
+    {
+        if (files[1] == NULL)
+        {
+            _py_os_mkdir(files[0], dir_fd);
+            continue;
+        }
+        value = files[1][0] != '\0' ? PY_STRING(files[1]) + "\n" : PY_STRING();
+        err = tcm_emu_put(dir_fd, files[0], value, value.len(), O_CREAT | O_TRUNC);
+        if (err != 0)
+            throw _py_OSError(strerror(err));
+    }
+}
+
+// Splits key into at most 4 components, returns their number
+static int tcm_emu_split(const PY_STRING & key, PY_STRING_VIEW * comps)
+{
+    PY_STRING_TOKENIZER items(key, '/');
+    int                 num;
+
+    for (num = 0; (num < 4) && items.next(comps[num]); num ++);
+    return num;
+}
+
+void tcm_emu_init(const char * target_root)
+{
+    PY_STRING core_path = PY_STRING(target_root) + "/core";
+    PY_STRING lu_gp_path = core_path + "/alua/lu_gps/default_lu_gp";
+    PY_STRING version = "Target Engine Core ConfigFS Infrastructure v5.0 on Linux (emulated)\n";
+    int       err;
+
+    if (!_py_os_path_isdir(lu_gp_path))
+    {
+        _py_os_makedirs(lu_gp_path);
+        err = tcm_emu_put(AT_FDCWD, lu_gp_path + "/lu_gp_id", "0\n", 2, O_CREAT | O_TRUNC);
+        if (err != 0)
+            throw _py_OSError(strerror(err));
+    }
+
+    err = tcm_emu_put(AT_FDCWD, PY_STRING(target_root) + "/version", version, version.len(), O_CREAT | O_TRUNC);
+    if (err != 0)
+        throw _py_OSError(strerror(err));
+}
+
+void tcm_emu_mkdir(int dir_fd, const char * name, const PY_STRING & key)
+{
+    PY_STRING_VIEW  comps[4];
+    const char **   files = NULL;
+    int             num = tcm_emu_split(key, comps);
+    int             fd;
+
+    tcm_emu_latency();
+
+    if ((num == 1) && (comps[0] != "alua"))
+        files = tcm_emu_hba_files;
+    else if ((num == 2) && (comps[0] != "alua"))
+        files = tcm_emu_dev_files;
+    else if ((num == 4) && (comps[0] != "alua") && (comps[2] == "alua"))
+        files = tcm_emu_tg_pt_gp_files;
+    else if ((num == 3) && (comps[0] == "alua") && (comps[1] == "lu_gps"))
+        files = tcm_emu_lu_gp_files;
+    if (files == NULL)
+        return;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw _py_OSError(strerror(errno));
+    try
+    {
+        tcm_emu_create(fd, files);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+// Directories made by mkdir, as opposed to default groups made by the kernel
+static bool tcm_emu_user_dir(const PY_STRING & key)
+{
+    PY_STRING_VIEW  comps[4];
+    int             num = tcm_emu_split(key, comps);
+
+    if (comps[0] == "alua")
+        return num == 3;
+    if (num <= 2)
+        return true;
+    return (num == 4) && (comps[2] == "alua") && (comps[3] != "default_tg_pt_gp");
+}
+
+// Removes files and default groups below directory, with check_only tests that there are no user directories
+static int tcm_emu_clear(int dir_fd, const char * name, const PY_STRING & key, bool check_only)
+{
+    LIST_PY_STRING      names;
+    LIST_PY_STRING_IT   it;
+    PY_STRING           sub_key;
+    int                 fd;
+    int                 err = 0;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    try
+    {
+        names = _py_os_listdir(".", fd);
+    }
+    catch (_py_OSError const & e)
+    {
+        close(fd);
+        return EIO;
+    }
+
+    for (it = names.begin(); (it != names.end()) && (err == 0); it ++)
+    {
+        if (!_py_os_path_isdir(*it, fd))
+        {
+            if (!check_only && (0 != unlinkat(fd, *it, 0)))
+                err = errno;
+            continue;
+        }
+
+        sub_key = key + "/" + *it;
+        if (tcm_emu_user_dir(sub_key))
+            err = ENOTEMPTY;
+        else
+            err = tcm_emu_clear(fd, *it, sub_key, check_only);
+        if ((err == 0) && !check_only && (0 != unlinkat(fd, *it, AT_REMOVEDIR)))
+            err = errno;
+    }
+
+    close(fd);
+    return err;
+}
+
+int tcm_emu_rmdir(int dir_fd, const char * name, const PY_STRING & key)
+{
+    int err;
+
+    tcm_emu_latency();
+
+    // Nothing is removed while the object has user directories, as with configfs
+    err = tcm_emu_clear(dir_fd, name, key, true);
+    if (err == 0)
+        err = tcm_emu_clear(dir_fd, name, key, false);
+    if ((err == 0) && (0 != unlinkat(dir_fd, name, AT_REMOVEDIR)))
+        err = errno;
+    return err;
+}
+
+// Updates info of device enabled by write to enable in dir_fd
+static int tcm_emu_enable_dev(int dir_fd, const char * dev_dir)
+{
+    PY_FILE     f;
+    PY_STRING   udev_path;
+    PY_STRING   info;
+
+    try
+    {
+        f.open(PY_STRING(dev_dir) + "udev_path", "r", dir_fd);
+        udev_path = f.read().strip();
+        f.close();
+    }
+    catch (_py_IOError const & e)
+    {
+    }
+
+    info = PY_STRING().format("Status: ACTIVATED  Max Queue Depth: 128  SectorSize: 512  HwMaxSectors: 1024\n"
+                              "        iBlock device: emulated  UDEV PATH: %s\n", udev_path.len() > 0 ? (char *)udev_path : "");
+    return tcm_emu_put(dir_fd, PY_STRING(dev_dir) + "info", info, info.len(), O_TRUNC);
+}
+
+int tcm_emu_write(int dir_fd, const char * name, const char * value, int len)
+{
+    const char *    base = strrchr(name, '/');
+    PY_STRING       dir;
+    PY_STRING       s;
+    int             err;
+
+    tcm_emu_latency();
+
+    dir = base != NULL ? PY_STRING(name, base + 1 - name) : PY_STRING();
+    base = base != NULL ? base + 1 : name;
+
+    // Control options are consumed by the kernel, there is nothing to read back
+    if (0 == strcmp(base, "control"))
+        return _py_os_path_isfile(dir + "enable", dir_fd) ? 0 : ENOENT;
+
+    if (0 == strcmp(base, "vpd_unit_serial"))
+    {
+        s = PY_STRING("T10 VPD Unit Serial Number: ") + PY_STRING(value, len).strip() + "\n";
+        return tcm_emu_put(dir_fd, name, s, s.len(), O_TRUNC);
+    }
+
+    // Each registration is added to those written before
+    if (0 == strcmp(base, "res_aptpl_metadata"))
+        return tcm_emu_put(dir_fd, name, value, len, O_APPEND);
+
+    err = tcm_emu_put(dir_fd, name, value, len, O_TRUNC);
+    if ((err == 0) && (0 == strcmp(base, "enable")) && (PY_STRING(value, len).strip() == "1"))
+        err = tcm_emu_enable_dev(dir_fd, dir);
+    return err;
+}
@@ -0,0 +1,34 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_EMU_H_
+#define _TCM_EMU_H_ 1
+
+#include "_py.h"
+
+//
+// ConfigFS emulator
+//
+// Plain directory tree at target root behaves like configfs of LIO as far
+// as tcm_node depends on it: mkdir of HBA, device or ALUA group creates its
+// attribute files and default groups, rmdir removes them, control writes
+// are accepted and writes of enable, vpd_unit_serial and res_aptpl_metadata
+// have the kernel's visible effect.  Attributes that do not exist can not be
+// written.  Optional latency is added to each mkdir, rmdir and write.
+//
+// Hooks are called by tcm_cfs with key of path relative to core directory.
+//
+
+void    tcm_emu_set     (bool emulate, int latency_usecs);
+bool    tcm_emu_enabled (void);
+void    tcm_emu_init    (const char * target_root);                                 // Creates core and version, throws _py_OSError
+
+void    tcm_emu_mkdir   (int dir_fd, const char * name, const PY_STRING & key);     // After mkdir, throws _py_OSError
+int     tcm_emu_rmdir   (int dir_fd, const char * name, const PY_STRING & key);     // Instead of rmdir, returns 0 or errno
+int     tcm_emu_write   (int dir_fd, const char * name, const char * value, int len);   // Instead of write, returns 0 or errno
+
+#endif /* _TCM_EMU_H_ */
@@ -5,61 +5,78 @@
 // This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
 //
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
 #include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_ops.h"
+#include "tcm_trace.h"
 
-static PY_STRING tcm_root = "/sys/kernel/config/target/core";
+// Writes value into configfs attribute, returns 0 or errno
+static int iblock_write(const char * filename, const char * value)
+{
+    return tcm_cfs_write(filename, value, strlen(value));
+}
 
 int iblock_createvirtdev(char * path, char * params)
 {
-    PY_STRING   cfs_path;
-    PY_STRING   udev_path;
-    PY_STRING   set_udev_path_op;
-    PY_STRING   control_opt;
-    PY_STRING   enable_opt;
-    int         major;
+    TCM_TRACE_SPAN  span("iblock_createvirtdev", path);
+    PY_STRING       cfs_path;
+    PY_STRING       udev_path;
+    PY_STRING       control_opt;
+    int             major;
+    int             err;
 
-    printf("%s" "\n", (char *)(PY_STRING("Calling iblock createvirtdev: path ") + path));
+    tcm_printf("%s" "\n", (char *)(PY_STRING("Calling iblock createvirtdev: path ") + path));
 
-    cfs_path = tcm_root + "/" + path + "/";
+    cfs_path = tcm_full_path(path) + "/";
 //    printf("%s" "\n", (char *)(PY_STRING("Calling iblock createvirtdev: params ") + params));
 
     udev_path = PY_STRING(params).strip();
     if (!udev_path.starts_with("/dev/"))
     {
-        printf("IBLOCK: Please reference a valid /dev/ block_device" "\n");
+        tcm_printf("IBLOCK: Please reference a valid /dev/ block_device" "\n");
         return -1;
     }
 
-    major = _py_os_major(udev_path);
+    {
+        TCM_TRACE_SPAN span("iblock_stat_major", udev_path);
+
+        major = _py_os_major(udev_path);
+    }
 
     if (major == 11)
     {
-        printf("Unable to export Linux/SCSI TYPE_CDROM from IBLOCK, please use pSCSI export" "\n");
+        tcm_printf("Unable to export Linux/SCSI TYPE_CDROM from IBLOCK, please use pSCSI export" "\n");
         return -1;
     }
     if (major == 22)
     {
-        printf("Unable to export IDE CDROM from IBLOCK" "\n");
+        tcm_printf("Unable to export IDE CDROM from IBLOCK" "\n");
         return -1;
     }
 
-    set_udev_path_op = PY_STRING("echo -n ") + udev_path + " > " + cfs_path + "udev_path";
-    if (0 != _py_os_system(set_udev_path_op))
+    err = iblock_write(cfs_path + "udev_path", udev_path);
+    if (err != 0)
     {
-        printf("%s" "\n", (char *)(PY_STRING("IBLOCK: Unable to set udev_path in ") + cfs_path + " for: " + udev_path));
+        tcm_printf("%s" "\n", (char *)(PY_STRING("IBLOCK: Unable to set udev_path in ") + cfs_path + " for: " + udev_path + ": " + strerror(err)));
         return -1;
     }
 
-    control_opt = PY_STRING("echo -n udev_path=") + udev_path + " > " + cfs_path + "control";
-    if (0 != _py_os_system(control_opt))
+    control_opt = PY_STRING("udev_path=") + udev_path;
+    err = iblock_write(cfs_path + "control", control_opt);
+    if (err != 0)
     {
-        printf("%s" "\n", (char *)(PY_STRING("IBLOCK: createvirtdev failed for control_opt with ") + control_opt));
+        tcm_printf("%s" "\n", (char *)(PY_STRING("IBLOCK: createvirtdev failed for control_opt with ") + control_opt + ": " + strerror(err)));
         return -1;
     }
-    enable_opt = PY_STRING("echo 1 > ") +  cfs_path + "enable";
-    if (0 != _py_os_system(enable_opt))
+    err = iblock_write(cfs_path + "enable", "1\n");
+    if (err != 0)
     {
-        printf("%s" "\n", (char *)(PY_STRING("IBLOCK: createvirtdev failed for enable_opt with ") + enable_opt));
+        tcm_printf("%s" "\n", (char *)(PY_STRING("IBLOCK: createvirtdev failed for enable_opt with 1: ") + strerror(err)));
         return -1;
     }
     return 0;
@@ -0,0 +1,290 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "_py.h"
+#include "tcm_kmod.h"
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE         4
+#endif
+
+#define TCM_KMOD_WAIT_STEP_USECS            (50 * 1000)
+
+// Returns module name for modules.dep path, e.g. "kernel/x/target_core_mod.ko.xz" -> "target_core_mod"
+static PY_STRING tcm_kmod_name(const PY_STRING_VIEW & path)
+{
+    PY_STRING       s;
+    PY_STRING_VIEW  name;
+    char *          str;
+    int             idx;
+
+    for (idx = path.len(); (idx > 0) && (path.data()[idx - 1] != '/'); idx --);
+    name = PY_STRING_VIEW(path.data() + idx, path.len() - idx);
+    idx = name.find(".ko");
+    s = PY_STRING(name.data(), idx < 0 ? name.len() : idx);
+    for (str = s; (str != NULL) && (*str != '\0'); str ++)
+        if (*str == '-')
+            *str = '_';
+    return s;
+}
+
+bool tcm_kmod_is_loaded(const char * name)
+{
+    return _py_os_path_isdir(PY_STRING("/sys/module/") + name);
+}
+
+// Returns decompressor for compressed module, NULL for unknown compression
+static const char * tcm_kmod_decompressor(const char * path)
+{
+    const char * ext = strrchr(path, '.');
+
+    if (ext == NULL)
+        return NULL;
+    if (0 == strcmp(ext, ".xz"))
+        return "xz";
+    if (0 == strcmp(ext, ".zst"))
+        return "zstd";
+    if (0 == strcmp(ext, ".gz"))
+        return "gzip";
+    return NULL;
+}
+
+// Fallback for kernels without in-kernel module decompression, returns 0 or errno
+static int tcm_kmod_insert_decompressed(int fd, const char * path)
+{
+    const char *    decompressor;
+    char *          buffer = NULL;
+    size_t          bytes_num = 0;
+    size_t          bytes_max = 0;
+    ssize_t         len;
+    int             pipe_fds[2];
+    int             status;
+    int             err = 0;
+    pid_t           pid;
+
+    decompressor = tcm_kmod_decompressor(path);
+    if (decompressor == NULL)
+        return EOPNOTSUPP;
+
+    if (0 != pipe(pipe_fds))
+        return errno;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        err = errno;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return err;
+    }
+    if (pid == 0)
+    {
+        dup2(fd, 0);
+        dup2(pipe_fds[1], 1);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execlp(decompressor, decompressor, "-dc", (char *)NULL);
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+
+    while (1)
+    {
+        if (bytes_num == bytes_max)
+        {
+            char * buffer_new;
+
+            bytes_max = bytes_max == 0 ? 256 * 1024 : 2 * bytes_max;
+            buffer_new = (char *) realloc(buffer, bytes_max);
+            if (buffer_new == NULL)
+            {
+                err = ENOMEM;
+                break;
+            }
+            buffer = buffer_new;
+        }
+        len = read(pipe_fds[0], buffer + bytes_num, bytes_max - bytes_num);
+        if ((len < 0) && (errno == EINTR))
+            continue;
+        if (len < 0)
+            err = errno;
+        if (len <= 0)
+            break;
+        bytes_num += len;
+    }
+    close(pipe_fds[0]);
+
+    if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+        if (err == 0)
+            err = ENOEXEC;
+
+    if ((err == 0) && (0 != syscall(SYS_init_module, buffer, bytes_num, "")) && (errno != EEXIST))
+        err = errno;
+
+    free(buffer);
+    return err;
+}
+
+static void tcm_kmod_insert(const char * path)
+{
+    int     fd;
+    int     flags = 0;
+    int     err = 0;
+
+    if (PY_STRING(path).strstr(".ko.") != NULL)
+        flags |= MODULE_INIT_COMPRESSED_FILE;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw _py_OSError((PY_STRING(path) + ": " + strerror(errno)));
+
+    if ((0 != syscall(SYS_finit_module, fd, "", flags)) && (errno != EEXIST))
+    {
+        err = errno;
+        // Kernels before 6.4 or without CONFIG_MODULE_DECOMPRESS reject the flag
+        if ((flags & MODULE_INIT_COMPRESSED_FILE) &&
+            ((err == EINVAL) || (err == EOPNOTSUPP) || (err == ENOSYS)))
+        {
+            lseek(fd, 0, SEEK_SET);
+            err = tcm_kmod_insert_decompressed(fd, path);
+        }
+    }
+    close(fd);
+
+    if (err == EOPNOTSUPP)
+        throw _py_OSError((PY_STRING(path) + ": kernel can not load compressed modules"));
+
+    if (err != 0)
+        throw _py_OSError((PY_STRING(path) + ": " + strerror(err)));
+}
+
+void tcm_kmod_load(const char * name)
+{
+    struct utsname      uts;
+    PY_STRING           modules_dir;
+    PY_STRING           line;
+    PY_STRING           module_name;
+    PY_STRING_VIEW      path;
+    PY_STRING_VIEW      dep_list;
+    VECTOR_PY_STRING    deps;
+    PY_FILE             f;
+    int                 idx;
+
+    if (tcm_kmod_is_loaded(name))
+        return;
+
+    if (0 != uname(&uts))
+        throw _py_OSError(strerror(errno));
+    modules_dir = PY_STRING("/lib/modules/") + uts.release + "/";
+
+    // Line format is "<module path>: <dependency path> ..."
+    try
+    {
+        f.open(modules_dir + "modules.dep");
+        while ((line = f.readline()) != NULL)
+        {
+            PY_STRING_TOKENIZER items(line, ':');
+
+            if (!items.next(path) || !items.next(dep_list))
+                continue;
+            if (tcm_kmod_name(path) != name)
+                continue;
+            module_name = path.str();
+            deps = dep_list.str().split();
+            break;
+        }
+        f.close();
+    }
+    catch (_py_IOError const & e)
+    {
+        throw _py_OSError((modules_dir + "modules.dep: " + e.what()));
+    }
+
+    if (module_name == NULL)
+        throw _py_OSError((PY_STRING("Module ") + name + " not found in " + modules_dir + "modules.dep"));
+
+    // Dependencies are listed from users to providers, so load them in reverse
+    for (idx = deps.size() - 1; idx >= 0; idx --)
+    {
+        if (tcm_kmod_is_loaded(tcm_kmod_name(deps[idx])))
+            continue;
+        tcm_kmod_insert(deps[idx][0] == '/' ? deps[idx] : modules_dir + deps[idx]);
+    }
+    tcm_kmod_insert(module_name[0] == '/' ? module_name : modules_dir + module_name);
+}
+
+int tcm_kmod_unload(const char * name, int wait_secs)
+{
+    long usecs = (long)wait_secs * 1000 * 1000;
+
+    while (0 != syscall(SYS_delete_module, name, O_NONBLOCK))
+    {
+        // Module is still in use, rmmod --wait style polling
+        if (((errno != EAGAIN) && (errno != EBUSY)) || (usecs <= 0))
+            return errno;
+        usleep(TCM_KMOD_WAIT_STEP_USECS);
+        usecs -= TCM_KMOD_WAIT_STEP_USECS;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    const char *    name;
+    int             wait_secs;
+    int             err;
+} TCM_KMOD_UNLOAD_ARG;
+
+static void * tcm_kmod_unload_thread(void * arg)
+{
+    TCM_KMOD_UNLOAD_ARG * unload_arg = (TCM_KMOD_UNLOAD_ARG *) arg;
+
+    unload_arg->err = tcm_kmod_unload(unload_arg->name, unload_arg->wait_secs);
+    return NULL;
+}
+
+void tcm_kmod_unload_parallel(const char ** names, int * errs, int wait_secs)
+{
+    int                             names_num;
+    int                             idx;
+    std::vector<pthread_t>          threads;
+    std::vector<bool>               started;
+    std::vector<TCM_KMOD_UNLOAD_ARG> args;
+
+    for (names_num = 0; names[names_num] != NULL; names_num ++);
+
+    threads.resize(names_num);
+    started.resize(names_num);
+    args.resize(names_num);
+
+    for (idx = 0; idx < names_num; idx ++)
+    {
+        args[idx].name = names[idx];
+        args[idx].wait_secs = wait_secs;
+        args[idx].err = 0;
+        started[idx] = (0 == pthread_create(&threads[idx], NULL, tcm_kmod_unload_thread, &args[idx]));
+        if (!started[idx])
+            tcm_kmod_unload_thread(&args[idx]);
+    }
+
+    for (idx = 0; idx < names_num; idx ++)
+    {
+        if (started[idx])
+            pthread_join(threads[idx], NULL);
+        errs[idx] = args[idx].err;
+    }
+}
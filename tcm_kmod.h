@@ -0,0 +1,16 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_KMOD_H_
+#define _TCM_KMOD_H_ 1
+
+bool    tcm_kmod_is_loaded      (const char * name);
+void    tcm_kmod_load           (const char * name);                            // throws _py_OSError
+int     tcm_kmod_unload         (const char * name, int wait_secs);             // Returns 0 or errno
+void    tcm_kmod_unload_parallel(const char ** names, int * errs, int wait_secs);   // names are terminated by NULL
+
+#endif /* _TCM_KMOD_H_ */
@@ -8,19 +8,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "_py.h"
-#include "tcm_modules.h"
+#include "tcm_pool.h"
+#include "tcm_trace.h"
+#include "tcmnode.h"
 
-static PY_STRING tcm_root = "/sys/kernel/config/target/core";
-
-//
-// Forward declarations
-//
-
-static PY_STRING    tcm_get_unit_serial     (char * dev_path);
-static void         __tcm_freevirtdev       (char * dev_path);
-static void         tcm_set_wwn_unit_serial (char * dev_path, char * unit_serial);
+static int tcm_modwait_secs = 0;                // Time to wait for module users on unload
+static int tcm_jobs = 1;                        // Number of worker threads, set by --jobs
+static PY_STRING tcm_trace_file;                // Trace written at exit, set by --trace
+static bool tcm_stats = false;                  // Print statistics at exit, set by --stats
 
 //
 // Functions
@@ -29,489 +33,964 @@ static void         tcm_set_wwn_unit_serial (char * dev_path, char * unit_serial
 static void tcm_err(char * msg)
 {
     fprintf(stderr, "%s" "\n", msg);
-    _py_sys_exit(1);
+    _py_sys_exit(1, msg);
 }
 
-static PY_STRING tcm_read(char * filename)
+// Raises error of failed libtcmnode call, messages of tcm_node errors were printed by verbose library
+static void tcm_check(int code)
 {
-    PY_STRING   s;
-    PY_FILE     f;
-
-    try
-    {
-        f.open(filename);
-        s = f.read();
-        f.close();
-    }
-    catch (_py_IOError const & e)
-    {
-        tcm_err(PY_STRING().format("%s %s\n%s", filename, e.what(), "Is kernel module loaded?"));
-    }
-    return s;
+    if (code == TCMNODE_OK)
+        return;
+    if (code == TCMNODE_ERR)
+        _py_sys_exit(code, tcmnode_last_error());
+    throw _py_OSError(tcmnode_last_error());
 }
 
-static void tcm_write(char * filename, char * value, bool newline = true)
+// Adds wall time of its scope to phase
+class TCM_PHASE
 {
-    PY_FILE f;
-
-    try
+public:
+    TCM_PHASE(double & secs, int & num)
+        : m_Secs(secs)
+        , m_Num(num)
+        , m_Start(_py_time_monotonic())
     {
-        f.open(filename, "w");
-        f.write(value);
-        if (newline)
-            f.write("\n");
-        f.close();
     }
-    catch (_py_IOError const & e)
+
+    ~TCM_PHASE(void)
     {
-        tcm_err(PY_STRING().format("%s %s\n%s", filename, e.what(), "Is kernel module loaded?"));
+        m_Secs += _py_time_monotonic() - m_Start;
+        m_Num ++;
     }
-}
-
-static PY_STRING tcm_full_path(char * arg)
-{
-    return tcm_root + "/" + arg;
-}
 
-static void tcm_check_dev_exists(char * dev_path)
-{
-    PY_STRING full_path;
+protected:
+    double &    m_Secs;
+    int &       m_Num;
+    double      m_Start;
+};
 
-    full_path = tcm_full_path(dev_path);
-    if (!_py_os_path_isdir(full_path))
-        tcm_err(PY_STRING("TCM/ConfigFS storage object does not exist: ") + full_path);
-}
+//
+// Parallel device establishment
+//
+// With --jobs N > 1, --establishdev commands are queued and grouped by HBA.
+// Devices of one HBA are established sequentially, groups run concurrently.
+// Queue is flushed before any other command and at the end of processing.
+//
 
-static void tcm_alua_check_metadata_dir(char * dev_path)
+typedef struct
 {
-    PY_STRING alua_path;
+    PY_STRING   dev_path;
+    PY_STRING   params;
+    PY_STRING   err;                            // First error of device, empty if established
+} TCM_ESTABLISH_JOB;
 
-    alua_path = PY_STRING("/var/target/alua/tpgs_") + tcm_get_unit_serial(dev_path) + "/";
-    if (_py_os_path_isdir(alua_path))
-        return;
+typedef std::vector<TCM_ESTABLISH_JOB>  TCM_ESTABLISH_GROUP;
 
-    _py_os_makedirs(alua_path);
-}
+static std::vector<TCM_ESTABLISH_GROUP> tcm_establish_groups;
+static MAP_PY_STRING                    tcm_establish_group_idx;
+static int                              tcm_establish_queued = 0;
+static int                              tcm_establish_failed = 0;
+static double                           tcm_establish_secs = 0;
+static int                              tcm_establish_flushes = 0;
 
-static void tcm_alua_process_metadata(char * dev_path, char * gp_name, char * gp_id)
+static void tcm_establish_queue(char * dev_path, char * plugin_params)
 {
-    PY_STRING alua_gp_path;    
-    PY_STRING alua_md_path;
+    TCM_ESTABLISH_JOB   job;
+    PY_STRING_VIEW      hba;
+    MAP_PY_STRING_IT    it;
 
-    alua_gp_path = tcm_full_path(dev_path) + "/alua/" + gp_name;
-    alua_md_path = PY_STRING("/var/target/alua/tpgs_") + tcm_get_unit_serial(dev_path) + "/" + gp_name;
+    job.dev_path = dev_path;
+    job.params = plugin_params;
+    tcm_establish_queued ++;
 
-    if (!_py_os_path_isfile(alua_md_path))
+    PY_STRING_TOKENIZER(dev_path, '/').next(hba);
+    it = tcm_establish_group_idx.find(hba.str());
+    if (it == tcm_establish_group_idx.end())
     {
-        tcm_write(alua_gp_path + "/alua_write_metadata", "1");
-        return;
+        tcm_establish_group_idx[hba.str()] = PY_STRING().format("%d", (int)tcm_establish_groups.size());
+        tcm_establish_groups.push_back(TCM_ESTABLISH_GROUP());
+        tcm_establish_groups.back().push_back(job);
     }
+    else
+        tcm_establish_groups[atoi(it->second)].push_back(job);
+}
 
-    LIST_PY_STRING      lines;
-    LIST_PY_STRING_IT   it;
-    VECTOR_PY_STRING    items;
-    MAP_PY_STRING       d;
-    MAP_PY_STRING_IT    d_it;
-    PY_STRING           s;
-    PY_FILE             p;
+static void tcm_establish_group(void *, int idx)
+{
+    TCM_ESTABLISH_GROUP & group = tcm_establish_groups[idx];
 
-    p.open(alua_md_path);
-    lines = p.readlines();
-    p.close();
-    for (it = lines.begin();
-         it != lines.end();
-         it ++)
+    for (unsigned int job_idx = 0; job_idx < group.size(); job_idx ++)
     {
-        items = (*it).split('=');
-        d[items[0].strip()] = items[1].strip();
-    }
-
-    d_it = d.find(PY_STRING("tg_pt_gp_id"));
-    if ((d_it != d.end()) && (d_it->second != PY_STRING(gp_id)))
-        throw _py_IOError(PY_STRING("").format("Passed tg_pt_gp_id: %s does not match extracted: %s", gp_id, (char *)d_it->second));
-
-    d_it = d.find(PY_STRING("alua_access_state"));
-    if (d_it != d.end())
-         tcm_write(alua_gp_path + "/alua_access_state", d_it->second);
-
-    d_it = d.find(PY_STRING("alua_access_status"));
-    if (d_it != d.end())
-        tcm_write(alua_gp_path + "/alua_access_status", d_it->second);
+        TCM_ESTABLISH_JOB & job = group[job_idx];
+        TCM_TRACE_SPAN      span("establish_dev", job.dev_path);
 
-    tcm_write(alua_gp_path + "/alua_write_metadata", "1");
+        if (TCMNODE_OK != tcmnode_establish_dev(job.dev_path, job.params))
+            job.err = tcmnode_last_error();
+    }
 }
 
-static void tcm_add_alua_tgptgp_with_md(char * dev_path, char * gp_name, char * gp_id)
+// Establishes queued devices, returns number of failed devices
+static int tcm_establish_flush(void)
 {
-    PY_STRING alua_gp_path;
-
-    alua_gp_path = tcm_full_path(dev_path) + "/alua/" + gp_name;
+    int failed_num = 0;
 
-    tcm_check_dev_exists(dev_path);
+    if (tcm_establish_groups.size() == 0)
+        return 0;
 
-    if ((PY_STRING(gp_name) == "default_tg_pt_gp") && (PY_STRING(gp_id) == "0"))
-    {
-        tcm_alua_process_metadata(dev_path, gp_name, gp_id);
-        return;
-    }
+    TCM_TRACE_SPAN span("establish_flush");
+    TCM_PHASE      phase(tcm_establish_secs, tcm_establish_flushes);
 
-    _py_os_makedirs(alua_gp_path);
+    tcm_pool_run(tcm_jobs, tcm_establish_groups.size(), tcm_establish_group, NULL);
 
-    try
+    for (unsigned int idx = 0; idx < tcm_establish_groups.size(); idx ++)
     {
-        tcm_write(alua_gp_path + "/tg_pt_gp_id", gp_id);
-    }
-    catch (...)
-    {
-        _py_os_rmdir(alua_gp_path);
-        throw;
+        TCM_ESTABLISH_GROUP & group = tcm_establish_groups[idx];
+
+        for (unsigned int job_idx = 0; job_idx < group.size(); job_idx ++)
+        {
+            if (group[job_idx].err == NULL)
+            {
+                printf("ESTABLISH: %s: OK\n", (char *)group[job_idx].dev_path);
+                continue;
+            }
+            printf("ESTABLISH: %s: FAILED (%s)\n", (char *)group[job_idx].dev_path, (char *)group[job_idx].err);
+            failed_num ++;
+        }
     }
 
-    tcm_alua_process_metadata(dev_path, gp_name, gp_id);
+    tcm_establish_groups.clear();
+    tcm_establish_group_idx.clear();
+    tcm_establish_failed += failed_num;
+
+    return failed_num;
 }
 
-static void tcm_delhba(char * hba_name)
+//
+// Callback dispatcher
+//
+
+enum {
+    CID_TCM_ADD_ALUA_TGPTGP_WITH_MD,
+    CID_TCM_BATCH,
+    CID_TCM_DAEMON,
+    CID_TCM_DUMP,
+    CID_TCM_EMULATE,
+    CID_TCM_ESTABLISHVIRTDEV,
+    CID_TCM_JOBS,
+    CID_TCM_LOAD,
+    CID_TCM_MODWAIT,
+    CID_TCM_RECONCILE,
+    CID_TCM_RESTORE,
+    CID_TCM_ROOT,
+    CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD,
+    CID_TCM_SNAPSHOT,
+    CID_TCM_SNAPSHOT_RESTORE,
+    CID_TCM_STATS,
+    CID_TCM_TRACE,
+    CID_TCM_UNLOAD,
+    CID_TCM_VAR_ROOT,
+    CID_TCM_VERSION,
+    CID_TCM_NUM
+};
+
+// Span names by CID
+static const char * tcm_cid_names[] =
 {
-    PY_STRING hba_path;
+    "add_alua_tgptgp_with_md",
+    "batch",
+    "daemon",
+    "dump",
+    "emulate",
+    "establishdev",
+    "jobs",
+    "load",
+    "modwait",
+    "reconcile",
+    "restore",
+    "root",
+    "set_unit_serial_with_md",
+    "snapshot",
+    "snapshot_restore",
+    "stats",
+    "trace",
+    "unload",
+    "var_root",
+    "version"
+};
 
-    hba_path = tcm_full_path(hba_name);
+//
+// Statistics
+//
+// Wall time of commands is summed per command, time of parallel establish
+// separately.  Phases nest, --batch includes time of its commands.
+//
 
-    LIST_PY_STRING      gs;
-    LIST_PY_STRING_IT   gs_it;
+static double   tcm_phase_secs[CID_TCM_NUM];
+static int      tcm_phase_num[CID_TCM_NUM];
 
-    gs = _py_os_listdir(hba_path);
-    for (gs_it = gs.begin();
-         gs_it != gs.end();
-         gs_it ++)
+static void tcm_stats_print(double wall_secs)
+{
+    PY_STATS stats;
+
+    _py_stats(stats);
+
+    fprintf(stderr, "STATS: allocs %llu\n", stats.allocs);
+    fprintf(stderr, "STATS: alloc_bytes %llu\n", stats.alloc_bytes);
+    fprintf(stderr, "STATS: cfs_reads %llu\n", stats.cfs_reads);
+    fprintf(stderr, "STATS: cfs_writes %llu\n", stats.cfs_writes);
+    fprintf(stderr, "STATS: cfs_mkdirs %llu\n", stats.cfs_mkdirs);
+    fprintf(stderr, "STATS: cfs_rmdirs %llu\n", stats.cfs_rmdirs);
+    fprintf(stderr, "STATS: cfs_stats %llu\n", stats.cfs_stats);
+    fprintf(stderr, "STATS: cfs_listdirs %llu\n", stats.cfs_listdirs);
+    fprintf(stderr, "STATS: forks %llu\n", stats.forks);
+    for (int cid = 0; cid < CID_TCM_NUM; cid ++)
     {
-        if ((*gs_it == PY_STRING("hba_info")) ||
-            (*gs_it == PY_STRING("hba_mode")))
-            continue;
-        __tcm_freevirtdev(PY_STRING(hba_name) + "/" + *gs_it);
+        if (tcm_phase_num[cid] > 0)
+            fprintf(stderr, "STATS: phase %s %d %.6f s\n", tcm_cid_names[cid], tcm_phase_num[cid], tcm_phase_secs[cid]);
     }
-
-    _py_os_rmdir(hba_path);
+    if (tcm_establish_flushes > 0)
+        fprintf(stderr, "STATS: phase establish_flush %d %.6f s\n", tcm_establish_flushes, tcm_establish_secs);
+    fprintf(stderr, "STATS: wall %.6f s\n", wall_secs);
 }
 
-static void tcm_del_alua_lugp(char * lu_gp_name)
+static void tcm_version(void)
 {
-    if (!_py_os_path_isdir(tcm_root + "/alua/lu_gps/" + lu_gp_name))
-        tcm_err(PY_STRING("ALUA Logical Unit Group: ") + lu_gp_name + " does not exist!");
+    char version[256];
 
-    _py_os_rmdir(tcm_root + "/alua/lu_gps/" + lu_gp_name);
+    tcm_check(tcmnode_version(version, sizeof(version)));
+    printf("%s\n", version);
 }
 
-static void __tcm_del_alua_tgptgp(char * dev_path, char * gp_name)
+static void tcm_batch(char * filename);
+static void tcm_daemon(char * socket_path);
+
+static void arg_callback(int cid, int argc_req, int * argc, char *** argv)
 {
-    PY_STRING full_path;
+    int     _argc = *argc;
+    char ** _argv = *argv;
 
-    tcm_check_dev_exists(dev_path);
+    if (argc_req > _argc)
+    {
+        printf("ERROR: Not enough parameters\n");
+        _py_sys_exit(1);
+    }
 
-    full_path = tcm_full_path(dev_path);
+    // Queued devices are established before any other command
+    if (cid != CID_TCM_ESTABLISHVIRTDEV)
+        tcm_establish_flush();
 
-    if (!_py_os_path_isdir(full_path + "/alua/" + gp_name))
-        tcm_err(PY_STRING("ALUA Target Port Group: ") + gp_name + " does not exist!");
+    TCM_TRACE_SPAN span(tcm_cid_names[cid], argc_req > 0 ? _argv[0] : NULL);
+    TCM_PHASE      phase(tcm_phase_secs[cid], tcm_phase_num[cid]);
 
-    _py_os_rmdir(full_path + "/alua/" + gp_name);
-}
+    switch (cid)
+    {
+        case CID_TCM_ADD_ALUA_TGPTGP_WITH_MD:
+            tcm_check(tcmnode_add_alua_tgptgp_with_md(_argv[0], _argv[1], _argv[2]));
+            break;
+        case CID_TCM_BATCH:
+            tcm_batch(_argv[0]);
+            break;
+        case CID_TCM_DAEMON:
+            tcm_daemon(_argv[0]);
+            break;
+        case CID_TCM_DUMP:
+            tcm_check(tcmnode_dump(_argv[0], tcm_jobs));
+            break;
+        case CID_TCM_EMULATE:
+            tcm_check(tcmnode_set_emulate(1, atoi(_argv[0])));
+            break;
+        case CID_TCM_ESTABLISHVIRTDEV:
+            if (tcm_jobs > 1)
+                tcm_establish_queue(_argv[0], _argv[1]);
+            else
+                tcm_check(tcmnode_establish_dev(_argv[0], _argv[1]));
+            break;
+        case CID_TCM_JOBS:
+            tcm_jobs = atoi(_argv[0]);
+            if (tcm_jobs < 1)
+                tcm_jobs = 1;
+            break;
+        case CID_TCM_LOAD:
+            tcm_check(tcmnode_load());
+            break;
+        case CID_TCM_MODWAIT:
+            tcm_modwait_secs = atoi(_argv[0]);
+            break;
+        case CID_TCM_RECONCILE:
+            tcm_check(tcmnode_reconcile(_argv[0], tcm_jobs));
+            break;
+        case CID_TCM_RESTORE:
+            tcm_check(tcmnode_restore(_argv[0], tcm_jobs));
+            break;
+        case CID_TCM_ROOT:
+            tcm_check(tcmnode_set_root(_argv[0], NULL));
+            break;
+        case CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD:
+            tcm_check(tcmnode_set_unit_serial_with_md(_argv[0], _argv[1]));
+            break;
+        case CID_TCM_SNAPSHOT:
+            tcm_check(tcmnode_snapshot_save(_argv[0], tcm_jobs));
+            break;
+        case CID_TCM_SNAPSHOT_RESTORE:
+            tcm_check(tcmnode_snapshot_restore(_argv[0], tcm_jobs));
+            break;
+        case CID_TCM_STATS:
+            tcm_stats = true;
+            break;
+        case CID_TCM_TRACE:
+            tcm_trace_file = _argv[0];
+            tcmnode_trace_start();
+            break;
+        case CID_TCM_UNLOAD:
+            tcm_check(tcmnode_unload(tcm_jobs, tcm_modwait_secs));
+            break;
+        case CID_TCM_VAR_ROOT:
+            tcm_check(tcmnode_set_root(NULL, _argv[0]));
+            break;
+        case CID_TCM_VERSION:
+            tcm_version();
+            break;
 
-static void tcm_generate_uuid_for_unit_serial(char * dev_path)
-{
-    tcm_set_wwn_unit_serial(dev_path, _py_uuid_uuid4());
+        default:
+            printf("INFO: Argument callback not implemented\n");
+            break;
+    }
+    *argc -= argc_req;
+    *argv += argc_req;
 }
 
-static void tcm_createvirtdev(char * dev_path, char * plugin_params, bool establishdev = false)
+// Processes command line style arguments, returns number of dispatched commands
+static int tcm_run_args(int argc, char ** argv)
 {
-    VECTOR_PY_STRING    parts;
-    PY_STRING           hba_path;
-    PY_STRING           hba_full_path;
-    PY_STRING           full_path;
-    bool                gen_uuid;
-
-    parts = PY_STRING(dev_path).split('/');
-    if (0 < parts.size())
-        hba_path = parts[0];
-
-    hba_full_path = tcm_full_path(hba_path);
-    if (!_py_os_path_isdir(hba_full_path))
-        _py_os_mkdir(hba_full_path);
-
-    full_path = tcm_full_path(dev_path);
-    if (_py_os_path_isdir(full_path))
-        tcm_err(PY_STRING("TCM/ConfigFS storage object already exists: ") + full_path);
-    else
-        _py_os_mkdir(full_path);
-
-    gen_uuid = !establishdev;
+    int *       pargc = &argc;
+    char ***    pargv = &argv;
+    int         cmds_num = 0;
 
-    for (TCM_MODULE * tcm = tcm_modules;
-         tcm->name != NULL;
-         tcm ++)
+    while (argc > 0)
     {
-        if (!hba_path.starts_with(PY_STRING(tcm->name) + "_"))
+        (*pargc) --;
+        (*pargv) ++;
+
+        if ((0 == strcmp(*(argv - 1), "--addtpgtpgwithmd")) ||
+            (0 == strcmp(*(argv - 1), "--addaluatpgwithmd")))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_ADD_ALUA_TGPTGP_WITH_MD, 3, pargc, pargv);
             continue;
-        try
+        }
+        if (0 == strcmp(*(argv - 1), "--batch"))
         {
-            if (tcm->fnc_createvirtdev != NULL)
-                tcm->fnc_createvirtdev(dev_path, plugin_params);
-            else
-                tcm_err(PY_STRING("no module for ") + tcm->name);
+            cmds_num ++;
+            arg_callback(CID_TCM_BATCH, 1, pargc, pargv);
+            continue;
         }
-        catch (...)
+        if (0 == strcmp(*(argv - 1), "--daemon"))
         {
-            _py_os_rmdir(full_path);
-            printf("%s\n", (char *)(PY_STRING("Unable to register TCM/ConfigFS storage object: ") + full_path));
-            throw;
+            cmds_num ++;
+            arg_callback(CID_TCM_DAEMON, 1, pargc, pargv);
+            continue;
         }
-
-        printf("%s" "\n", (char *)tcm_read(full_path + "/info"));
-
-        if (tcm->gen_uuid && gen_uuid)
+        if (0 == strcmp(*(argv - 1), "--emulate"))
         {
-            tcm_generate_uuid_for_unit_serial(dev_path);
-            tcm_alua_check_metadata_dir(dev_path);
+            cmds_num ++;
+            arg_callback(CID_TCM_EMULATE, 1, pargc, pargv);
+            continue;
         }
-        break;
+        if (0 == strcmp(*(argv - 1), "--establishdev"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_ESTABLISHVIRTDEV, 2, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--jobs"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_JOBS, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--load"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_LOAD, 0, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--modwait"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_MODWAIT, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--dump"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_DUMP, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--reconcile"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_RECONCILE, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--restore"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_RESTORE, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--root"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_ROOT, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--setunitserialwithmd"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD, 2, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--snapshot"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_SNAPSHOT, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--snapshot-restore"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_SNAPSHOT_RESTORE, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--stats"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_STATS, 0, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--trace"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_TRACE, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--unload"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_UNLOAD, 0, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--var-root"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_VAR_ROOT, 1, pargc, pargv);
+            continue;
+        }
+        if (0 == strcmp(*(argv - 1), "--version"))
+        {
+            cmds_num ++;
+            arg_callback(CID_TCM_VERSION, 0, pargc, pargv);
+            continue;
+        }
+        tcm_err(PY_STRING("Unknown option: ") + *(argv - 1));
     }
+    return cmds_num;
 }
 
-static PY_STRING tcm_get_unit_serial(char * dev_path)
+//
+// Batch mode
+//
+
+// Splits line into shell-like words, returns false for unterminated quote
+static bool tcm_batch_split(char * line, VECTOR_PY_STRING & args)
 {
-    PY_STRING string;
+    char *  word;
+    char *  w;
+    char *  str;
+    char    quote;
+    bool    in_word;
+
+    args.clear();
+
+    word = (char *) malloc(strlen(line) + 1);
+    if (word == NULL)
+        throw _py_OSError(strerror(ENOMEM));
+
+    w = word;
+    quote = '\0';
+    in_word = false;
+    for (str = line; *str != '\0'; str ++)
+    {
+        if (quote != '\0')
+        {
+            if (*str == quote)
+                quote = '\0';
+            else
+            if ((quote == '"') && (*str == '\\') && (*(str + 1) != '\0'))
+                *w++ = *(++str);
+            else
+                *w++ = *str;
+            continue;
+        }
+        if ((unsigned char)*str <= ' ')
+        {
+            if (in_word)
+            {
+                *w = '\0';
+                args.push_back(PY_STRING(word));
+                w = word;
+                in_word = false;
+            }
+            continue;
+        }
+        if ((*str == '#') && !in_word)
+            break;
+        in_word = true;
+        if ((*str == '\'') || (*str == '"'))
+            quote = *str;
+        else
+        if ((*str == '\\') && (*(str + 1) != '\0'))
+            *w++ = *(++str);
+        else
+            *w++ = *str;
+    }
+    if (in_word && (quote == '\0'))
+    {
+        *w = '\0';
+        args.push_back(PY_STRING(word));
+    }
+    free(word);
 
-    string = tcm_read(tcm_full_path(dev_path) + "/wwn/vpd_unit_serial");
-    return string.split(':')[1].strip();
+    return (quote == '\0');
 }
 
-static void tcm_process_aptpl_metadata(char * dev_path)
+// Executes one batch line
+static void tcm_batch_line(VECTOR_PY_STRING & args)
 {
-    PY_STRING               full_path;
-    PY_STRING               aptpl_file;
-    VECTOR_PY_STRING        lines;
-    VECTOR_PY_STRING_IT     lines_it;
-    LIST_PY_STRING          res_list;
-    LIST_LIST_PY_STRING     reservations;
-    LIST_LIST_PY_STRING_IT  reservations_it;
+    std::vector<char *> argv;
+    unsigned int        idx = 0;
+    char *              name;
 
-    tcm_check_dev_exists(dev_path);
+    // Drop program name of lines like "tcm_node --establishdev ..."
+    name = strrchr(args[0], '/');
+    name = name == NULL ? (char *)args[0] : name + 1;
+    if ((PY_STRING(name) == "tcm_node") || (PY_STRING(name) == "tcm_node.py"))
+        idx ++;
 
-    full_path = tcm_full_path(dev_path);
+    if (idx == args.size())
+        tcm_err(PY_STRING("No command given"));
 
-    aptpl_file = PY_STRING("/var/target/pr/aptpl_") + tcm_get_unit_serial(dev_path);
-    if (!_py_os_path_isfile(aptpl_file))
-        return;
-
-    lines = tcm_read(aptpl_file).split();
+    // Shell built-ins used by generated restore scripts
+    if ((args[idx] == "echo") && (args.size() >= idx + 4) && (args[args.size() - 2] == ">"))
+    {
+        bool newline = true;
 
-    if (lines[0].starts_with("PR_REG_START:"))
+        idx ++;
+        if (args[idx] == "-n")
+        {
+            newline = false;
+            idx ++;
+        }
+        if (idx + 3 != args.size())
+            tcm_err(PY_STRING("Unsupported echo command"));
+        tcm_check(tcmnode_write(args[idx + 2], newline ? args[idx] + "\n" : args[idx]));
         return;
-
-    for (lines_it = lines.begin();
-         lines_it != lines.end();
-         lines_it ++)
-    {
-        if ((*lines_it).starts_with("PR_REG_START:"))
-            res_list.clear();
-        else
-        if ((*lines_it).starts_with("PR_REG_END:"))
-            reservations.push_back(res_list);
-        else
-            res_list.push_back((*lines_it).strip());
     }
-
-    for (reservations_it = reservations.begin();
-         reservations_it != reservations.end();
-         reservations_it ++)
+    if ((args[idx] == "mkdir") && (args.size() == idx + 3) && (args[idx + 1] == "-p"))
     {
-        tcm_write(full_path + "/pr/res_aptpl_metadata", PY_STRING(",").join(*reservations_it));
+        _py_os_makedirs(args[idx + 2]);
+        return;
     }
-}
 
-static void tcm_establishvirtdev(char * dev_path, char * plugin_params)
-{
-    tcm_createvirtdev(dev_path, plugin_params, true);
+    if (0 != strncmp(args[idx], "--", 2))
+        tcm_err(PY_STRING("Not a tcm_node command: ") + args[idx]);
+
+    for (; idx < args.size(); idx ++)
+        argv.push_back(args[idx]);
+
+    tcm_run_args(argv.size(), &argv[0]);
 }
 
-static void __tcm_freevirtdev(char * dev_path)
+static bool tcm_batch_running = false;
+
+static void tcm_batch(char * filename)
 {
-    PY_STRING           full_path;
-    LIST_PY_STRING      tg_pt_gps;
-    LIST_PY_STRING_IT   tg_pt_gps_it;
+    PY_FILE             f;
+    PY_STRING           line;
+    PY_STRING           rest;
+    int                 line_no = 0;
+    int                 cmds_num = 0;
+    int                 failed_num = 0;
+    int                 queued_num;
+    int                 establish_failed_num = tcm_establish_failed;
+
+    if (tcm_batch_running)
+        tcm_err(PY_STRING("Nested --batch is not supported"));
 
-    tcm_check_dev_exists(dev_path);
+    try
+    {
+        f.open((PY_STRING(filename) == "-") ? "/dev/stdin" : filename);
+    }
+    catch (_py_IOError const & e)
+    {
+        tcm_err(PY_STRING().format("%s %s", filename, e.what()));
+    }
 
-    full_path = tcm_full_path(dev_path);
+    tcm_batch_running = true;
 
-    tg_pt_gps = _py_os_listdir(full_path + "/alua/");
-    for (tg_pt_gps_it = tg_pt_gps.begin();
-         tg_pt_gps_it != tg_pt_gps.end();
-         tg_pt_gps_it ++)
+    while ((line = f.readline()) != NULL)
     {
-        if (*tg_pt_gps_it == "default_tg_pt_gp")
+        PY_ARENA            arena;                  // Per line scratch memory, released in one go
+        VECTOR_PY_STRING    args;
+
+        line_no ++;
+
+        // readline() returns long lines in parts, line without '\n' is complete only at end of file
+        if ((line.strstr("\n") == NULL) && ((rest = f.readline()) != NULL))
+        {
+            for (; (rest != NULL) && (rest.strstr("\n") == NULL); rest = f.readline());
+            printf("BATCH: line %d: FAILED (line too long)\n", line_no);
+            failed_num ++;
             continue;
-        __tcm_del_alua_tgptgp(dev_path, *tg_pt_gps_it);
+        }
+
+        if (!tcm_batch_split(line, args))
+        {
+            printf("BATCH: line %d: FAILED (unterminated quote)\n", line_no);
+            failed_num ++;
+            continue;
+        }
+        if (args.size() == 0)
+            continue;
+
+        try
+        {
+            TCM_TRACE_SPAN span("batch_line", line);
+
+            queued_num = tcm_establish_queued;
+            tcm_batch_line(args);
+            cmds_num ++;
+            printf("BATCH: line %d: %s\n", line_no, queued_num != tcm_establish_queued ? "QUEUED" : "OK");
+        }
+        catch (_py_SystemExit const & e)
+        {
+            failed_num ++;
+            printf("BATCH: line %d: FAILED (exit code %d)\n", line_no, e.code());
+        }
+        catch (std::exception const & e)
+        {
+            failed_num ++;
+            printf("BATCH: line %d: FAILED (%s)\n", line_no, e.what());
+        }
+        fflush(stdout);
     }
+    f.close();
+    tcm_batch_running = false;
+
+    tcm_establish_flush();
+    failed_num += tcm_establish_failed - establish_failed_num;
 
-    _py_os_rmdir(full_path);
+    printf("BATCH: %d commands executed, %d failed\n", cmds_num, failed_num);
+    if (failed_num > 0)
+        _py_sys_exit(1);
 }
 
-static void tcm_set_wwn_unit_serial(char * dev_path, char * unit_serial)
+//
+// Daemon mode
+//
+// Serves requests on unix socket, one client at a time, keeping configfs
+// handles and attribute cache warm between requests.  Request is one line
+// in batch syntax, reply is output of command followed by its status:
+//
+//     OUTPUT <bytes>\n<output>STATUS <exit code> <OK|FAILED message>\n
+//
+
+static volatile sig_atomic_t    tcm_daemon_stop = 0;
+static int                      tcm_daemon_out_fd = -1;        // Captures stdout and stderr of request
+
+static void tcm_daemon_signal(int)
 {
-    tcm_check_dev_exists(dev_path);
-    tcm_write(tcm_full_path(dev_path) + "/wwn/vpd_unit_serial", unit_serial);
+    tcm_daemon_stop = 1;
 }
 
-static void tcm_set_wwn_unit_serial_with_md(char * dev_path, char * unit_serial)
+static bool tcm_daemon_send(int fd, const char * data, int len)
 {
-    tcm_check_dev_exists(dev_path);
-    tcm_set_wwn_unit_serial(dev_path, unit_serial);
-    tcm_process_aptpl_metadata(dev_path);
-    tcm_alua_check_metadata_dir(dev_path);
+    int ret;
+
+    while (len > 0)
+    {
+        ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
 }
 
-static void tcm_unload(void)
+// Runs request line with output redirected to tcm_daemon_out_fd, returns exit code
+static int tcm_daemon_run(char * line, PY_STRING & msg)
 {
-    if (!_py_os_path_isdir(tcm_root))
-        tcm_err(PY_STRING("Unable to access tcm_root: ") + tcm_root);
+    VECTOR_PY_STRING    args;
+    int                 code = 0;
 
-    LIST_PY_STRING      hba_root;
-    LIST_PY_STRING_IT   hba_root_it;
+    if (!tcm_batch_split(line, args))
+    {
+        msg = "unterminated quote";
+        return 1;
+    }
+    if (args.size() == 0)
+        return 0;
 
-    hba_root = _py_os_listdir(tcm_root);
-    for (hba_root_it = hba_root.begin();
-         hba_root_it != hba_root.end();
-         hba_root_it ++)
+    try
     {
-        if (*hba_root_it == "alua")
-            continue;
-        tcm_delhba(*hba_root_it);
+        tcm_batch_line(args);
+        if (tcm_establish_flush() > 0)
+        {
+            msg = "establish failed";
+            code = 1;
+        }
+    }
+    catch (_py_SystemExit const & e)
+    {
+        code = e.code();
+        if (e.what() != NULL)
+            msg = e.what();
+    }
+    catch (std::exception const & e)
+    {
+        code = 1;
+        msg = e.what();
     }
 
-    LIST_PY_STRING      lu_gps;
-    LIST_PY_STRING_IT   lu_gps_it;
+    // Objects can be changed by other tools, failure can come from stale handles or values
+    if (code != 0)
+        tcmnode_flush_cache();
+
+    return code;
+}
 
-    lu_gps = _py_os_listdir(tcm_root + "/alua/lu_gps");
-    for (lu_gps_it = lu_gps.begin();
-         lu_gps_it != lu_gps.end();
-         lu_gps_it ++)
+static bool tcm_daemon_request(int fd, char * line)
+{
+    PY_ARENA        arena;
+    TCM_TRACE_SPAN  span("daemon_request", line);
+    PY_STRING       msg;
+    PY_STRING       output;
+    PY_STRING       status;
+    char            buffer[PY_FILE::PY_FILE_READ_BYTES];
+    int             saved_fds[2];
+    int             code;
+    int             len;
+
+    fflush(stdout);
+    fflush(stderr);
+    saved_fds[0] = dup(1);
+    saved_fds[1] = dup(2);
+    dup2(tcm_daemon_out_fd, 1);
+    dup2(tcm_daemon_out_fd, 2);
+
+    code = tcm_daemon_run(line, msg);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_fds[0], 1);
+    dup2(saved_fds[1], 2);
+    close(saved_fds[0]);
+    close(saved_fds[1]);
+
+    lseek(tcm_daemon_out_fd, 0, SEEK_SET);
+    while ((len = read(tcm_daemon_out_fd, buffer, sizeof(buffer))) > 0)
+        output += PY_STRING(buffer, len);
+    lseek(tcm_daemon_out_fd, 0, SEEK_SET);
+
+    // Request fails, daemon keeps serving
+    if (0 != ftruncate(tcm_daemon_out_fd, 0))
     {
-        if (*lu_gps_it == "default_lu_gp")
-            continue;
-        tcm_del_alua_lugp(*lu_gps_it);
+        msg = PY_STRING("Can not truncate daemon output: ") + strerror(errno);
+        if (code == 0)
+            code = 1;
     }
 
-    _py_os_system("rmmod target_core_iblock");
-    _py_os_system("rmmod target_core_file");
-    _py_os_system("rmmod target_core_pscsi");
-    _py_os_system("rmmod target_core_stgt");
+    if (code == 0)
+        status = "STATUS 0 OK\n";
+    else
+    {
+        PY_STRING_TOKENIZER msg_lines(msg, '\n');
+        PY_STRING_VIEW      msg_line;
 
-    if (0 != _py_os_system("rmmod target_core_mod"))
-        tcm_err("Unable to rmmod target_core_mod");
+        // Status must stay on one line
+        status = PY_STRING().format("STATUS %d FAILED", code);
+        while (msg_lines.next(msg_line))
+        {
+            if (msg_line.strip().len() > 0)
+                status += PY_STRING(" ") + msg_line.strip().str();
+        }
+        status += "\n";
+    }
+    status = PY_STRING().format("OUTPUT %d\n", output.len()) + output + status;
+
+    return tcm_daemon_send(fd, status, status.len());
 }
 
-static void tcm_version(void)
+// Serves requests of one client until it disconnects
+static void tcm_daemon_client(int fd)
 {
-    printf("%s\n", (char *)(tcm_read("/sys/kernel/config/target/version").strip()));
-}
+    char    line[PY_FILE::PY_FILE_LINE_BYTES + 1];
+    char *  eol;
+    int     line_len = 0;
+    int     len;
 
-//
-// Callback dispatcher
-//
+    while (!tcm_daemon_stop)
+    {
+        len = recv(fd, line + line_len, sizeof(line) - 1 - line_len, 0);
+        if ((len < 0) && (errno == EINTR))
+            continue;
+        if (len <= 0)
+            return;
+        line_len += len;
+        line[line_len] = '\0';
 
-enum {
-    CID_TCM_ADD_ALUA_TGPTGP_WITH_MD,
-    CID_TCM_ESTABLISHVIRTDEV,
-    CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD,
-    CID_TCM_UNLOAD,
-    CID_TCM_VERSION
-};
+        while ((eol = strchr(line, '\n')) != NULL)
+        {
+            *eol = '\0';
+            if (!tcm_daemon_request(fd, line))
+                return;
+            line_len -= eol + 1 - line;
+            memmove(line, eol + 1, line_len + 1);
+        }
 
-static void arg_callback(int cid, int argc_req, int * argc, char *** argv)
+        if (line_len == (int)sizeof(line) - 1)
+        {
+            tcm_daemon_send(fd, "OUTPUT 0\nSTATUS 1 FAILED line too long\n", strlen("OUTPUT 0\nSTATUS 1 FAILED line too long\n"));
+            return;
+        }
+    }
+}
+
+static bool tcm_daemon_running = false;
+
+// Runs on every exit of accept loop, also when request throws
+static void tcm_daemon_cleanup(int listen_fd, char * socket_path, FILE * out_file)
 {
-    int     _argc = *argc;
-    char ** _argv = *argv;
+    tcm_daemon_running = false;
 
-    if (argc_req > _argc)
+    close(listen_fd);
+    unlink(socket_path);
+    fclose(out_file);
+    tcm_daemon_out_fd = -1;
+}
+
+static void tcm_daemon(char * socket_path)
+{
+    struct sockaddr_un  addr;
+    struct sigaction    sa;
+    struct stat         st;
+    FILE *              out_file;
+    int                 listen_fd;
+    int                 fd;
+    mode_t              mask;
+
+    if (tcm_daemon_running || tcm_batch_running)
+        tcm_err(PY_STRING("--daemon can not be run from daemon or batch"));
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        tcm_err(PY_STRING("Socket path too long: ") + socket_path);
+
+    out_file = tmpfile();
+    if (out_file == NULL)
+        tcm_err(PY_STRING("Can not create daemon output file: ") + strerror(errno));
+    tcm_daemon_out_fd = fileno(out_file);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        tcm_err(PY_STRING("Can not create socket: ") + strerror(errno));
+
+    // Socket left by previous daemon is replaced
+    if ((0 == lstat(socket_path, &st)) && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    // Only owner can connect
+    mask = umask(077);
+    if (0 != bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)))
     {
-        printf("ERROR: Not enough parameters\n");
-        return;
+        umask(mask);
+        close(listen_fd);
+        tcm_err(PY_STRING().format("Can not bind %s: %s", socket_path, strerror(errno)));
     }
+    umask(mask);
 
-    switch (cid)
+    if (0 != listen(listen_fd, 16))
     {
-        case CID_TCM_ADD_ALUA_TGPTGP_WITH_MD:
-            tcm_add_alua_tgptgp_with_md(_argv[0], _argv[1], _argv[2]);
-            break;
-        case CID_TCM_ESTABLISHVIRTDEV:
-            tcm_establishvirtdev(_argv[0], _argv[1]);
-            break;
-        case CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD:
-            tcm_set_wwn_unit_serial_with_md(_argv[0], _argv[1]);
-            break;
-        case CID_TCM_UNLOAD:
-            tcm_unload();
-            break;
-        case CID_TCM_VERSION:
-            tcm_version();
-            break;
-
-        default:
-            printf("INFO: Argument callback not implemented\n");
-            break;
+        close(listen_fd);
+        unlink(socket_path);
+        tcm_err(PY_STRING("Can not listen: ") + strerror(errno));
     }
-    *argc -= argc_req;
-    *argv += argc_req;
-}
 
-//
-// Main
-//
+    // Without SA_RESTART signals interrupt accept() and recv()
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tcm_daemon_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-int main(int argc, char *argv[])
-{
-    int *       pargc = &argc;
-    char ***    pargv = &argv;
-    int         idx;
-    int         status = 0;
+    printf("DAEMON: listening on %s\n", socket_path);
+    fflush(stdout);
 
+    tcm_daemon_running = true;
+    fd = -1;
     try
     {
-        // Process command line arguments
-        (*pargc) --;
-        (*pargv) ++;
-        for (idx = 0; idx < argc; idx ++)
+        while (!tcm_daemon_stop)
         {
-            (*pargc) --;
-            (*pargv) ++;
-
-            if ((0 == strcmp(*(argv - 1), "--addtpgtpgwithmd")) ||
-                (0 == strcmp(*(argv - 1), "--addaluatpgwithmd")))
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
             {
-                arg_callback(CID_TCM_ADD_ALUA_TGPTGP_WITH_MD, 3, pargc, pargv);
-                continue;
-            }
-            if (0 == strcmp(*(argv - 1), "--establishdev"))
-            {
-                arg_callback(CID_TCM_ESTABLISHVIRTDEV, 2, pargc, pargv);
-                continue;
-            }
-            if (0 == strcmp(*(argv - 1), "--setunitserialwithmd"))
-            {
-                arg_callback(CID_TCM_SET_WWN_UNIT_SERIAL_WITH_MD, 2, pargc, pargv);
-                continue;
-            }
-            if (0 == strcmp(*(argv - 1), "--unload"))
-            {
-                arg_callback(CID_TCM_UNLOAD, 0, pargc, pargv);
-                continue;
-            }
-            if (0 == strcmp(*(argv - 1), "--version"))
-            {
-                arg_callback(CID_TCM_VERSION, 0, pargc, pargv);
-                continue;
+                if ((errno == EINTR) || (errno == ECONNABORTED))
+                    continue;
+                fprintf(stderr, "DAEMON: accept failed: %s\n", strerror(errno));
+                break;
             }
+            tcm_daemon_client(fd);
+            close(fd);
+            fd = -1;
         }
     }
+    catch (...)
+    {
+        if (fd >= 0)
+            close(fd);
+        tcm_daemon_cleanup(listen_fd, socket_path, out_file);
+        throw;
+    }
+    tcm_daemon_cleanup(listen_fd, socket_path, out_file);
+
+    printf("DAEMON: stopped\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double  start = _py_time_monotonic();
+    int     status = 0;
+
+    tcmnode_set_verbose(1);
+
+    try
+    {
+        PY_ARENA arena;
+
+        // Process command line arguments
+        tcm_run_args(argc - 1, argv + 1);
+        tcm_establish_flush();
+    }
     catch (_py_SystemExit const & e)
     {
         status = e.code();
@@ -522,5 +1001,20 @@ int main(int argc, char *argv[])
         status = 1;
     }
 
+    // Devices queued before a failed command are still established
+    tcm_establish_flush();
+    if ((status == 0) && (tcm_establish_failed > 0))
+        status = 1;
+
+    // Trace covers failed runs too, they are what it is needed for
+    if ((tcm_trace_file != NULL) && (TCMNODE_OK != tcmnode_trace_write(tcm_trace_file)))
+    {
+        fprintf(stderr, "Can not write trace %s: %s\n", (char *)tcm_trace_file, tcmnode_last_error());
+        status = 1;
+    }
+
+    if (tcm_stats)
+        tcm_stats_print(_py_time_monotonic() - start);
+
     return status;
 }
@@ -0,0 +1,165 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+// Client of tcm_node --daemon:
+//
+//     tcm_node_client <socket> <tcm_node options>     sends one request
+//     tcm_node_client <socket>                        sends each line of stdin
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "_py.h"
+
+static void client_err(const char * msg)
+{
+    fprintf(stderr, "%s" "\n", msg);
+    _py_sys_exit(1, msg);
+}
+
+static int client_connect(const char * socket_path)
+{
+    struct sockaddr_un  addr;
+    int                 fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        client_err(PY_STRING("Socket path too long: ") + socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        client_err(PY_STRING("Can not create socket: ") + strerror(errno));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+        client_err(PY_STRING().format("Can not connect to %s: %s", socket_path, strerror(errno)));
+
+    return fd;
+}
+
+// Quotes arguments so that daemon splits request line back into them
+static PY_STRING client_line(int argc, char ** argv)
+{
+    PY_STRING   line;
+    char *      str;
+
+    for (int idx = 0; idx < argc; idx ++)
+    {
+        if (::strchr(argv[idx], '\n') != NULL)
+            client_err(PY_STRING("Argument can not contain new line: ") + argv[idx]);
+
+        line += (idx == 0) ? "\"" : " \"";
+        for (str = argv[idx]; *str != '\0'; str ++)
+        {
+            if ((*str == '"') || (*str == '\\'))
+                line += "\\";
+            line += PY_STRING(str, 1);
+        }
+        line += "\"";
+    }
+    return line;
+}
+
+// Sends request and prints its output, returns exit code of request
+static int client_request(FILE * sock_in, FILE * sock_out, const char * line)
+{
+    char    buffer[PY_FILE::PY_FILE_READ_BYTES];
+    char    status[PY_FILE::PY_FILE_LINE_BYTES];
+    int     output_len;
+    int     len;
+    int     code;
+
+    if ((0 > fprintf(sock_out, "%s\n", line)) || (0 != fflush(sock_out)))
+        client_err(PY_STRING("Can not send request: ") + strerror(errno));
+
+    if ((NULL == fgets(status, sizeof(status), sock_in)) ||
+        (1 != sscanf(status, "OUTPUT %d", &output_len)))
+        client_err("Daemon closed connection");
+
+    for (; output_len > 0; output_len -= len)
+    {
+        len = fread(buffer, 1, output_len < (int)sizeof(buffer) ? output_len : sizeof(buffer), sock_in);
+        if (len <= 0)
+            client_err("Daemon closed connection");
+        fwrite(buffer, 1, len, stdout);
+    }
+    fflush(stdout);
+
+    if ((NULL == fgets(status, sizeof(status), sock_in)) ||
+        (1 != sscanf(status, "STATUS %d", &code)))
+        client_err("Daemon closed connection");
+
+    if (code != 0)
+        fprintf(stderr, "%s", status + strlen("STATUS "));
+
+    return code;
+}
+
+int main(int argc, char *argv[])
+{
+    PY_STRING   line;
+    PY_FILE     f;
+    FILE *      sock_in;
+    FILE *      sock_out;
+    int         fd;
+    int         status = 0;
+    int         code;
+
+    try
+    {
+        if (argc < 2)
+            client_err("Usage: tcm_node_client <socket> [tcm_node options]");
+
+        // Separate streams, stdio can not switch a socket stream between reading and writing
+        fd = client_connect(argv[1]);
+        sock_in = fdopen(fd, "r");
+        sock_out = fdopen(dup(fd), "w");
+        if ((sock_in == NULL) || (sock_out == NULL))
+            client_err(PY_STRING("Can not open socket stream: ") + strerror(errno));
+
+        if (argc > 2)
+            status = client_request(sock_in, sock_out, client_line(argc - 2, argv + 2));
+        else
+        {
+            f.open("/dev/stdin");
+            while ((line = f.readline()) != NULL)
+            {
+                // readline() returns long lines in parts, daemon would take them as separate requests
+                if ((line.strstr("\n") == NULL) && (f.readline() != NULL))
+                    client_err("Request line too long");
+
+                line = line.rstrip();
+                if (line.len() == 0)
+                    continue;
+
+                code = client_request(sock_in, sock_out, line);
+                if (code != 0)
+                    status = code;
+            }
+            f.close();
+        }
+        fclose(sock_out);
+        fclose(sock_in);
+    }
+    catch (_py_SystemExit const & e)
+    {
+        status = e.code();
+    }
+    catch (std::exception const & e)
+    {
+        printf("Exception: %s\n", e.what());
+        status = 1;
+    }
+
+    return status;
+}
@@ -0,0 +1,674 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_kmod.h"
+#include "tcm_modules.h"
+#include "tcm_ops.h"
+#include "tcm_pool.h"
+#include "tcm_trace.h"
+
+static PY_STRING tcm_var_root = "/var/target";
+static bool      tcm_verbose = false;           // Print messages and errors like tcm_node.py
+
+//
+// Forward declarations
+//
+
+static PY_STRING    tcm_get_unit_serial     (char * dev_path);
+static void         tcm_set_wwn_unit_serial (char * dev_path, char * unit_serial);
+
+//
+// Functions
+//
+
+void tcm_set_verbose(bool verbose)
+{
+    tcm_verbose = verbose;
+}
+
+int tcm_printf(const char * format, ...)
+{
+    va_list args;
+    int     ret;
+
+    if (!tcm_verbose)
+        return 0;
+
+    va_start(args, format);
+    ret = vprintf(format, args);
+    va_end(args);
+
+    return ret;
+}
+
+void tcm_err(char * msg)
+{
+    if (tcm_verbose)
+        fprintf(stderr, "%s" "\n", msg);
+    _py_sys_exit(1, msg);
+}
+
+static PY_STRING tcm_read(char * filename)
+{
+    TCM_TRACE_SPAN  span("cfs_read", filename);
+    PY_STRING       s;
+    PY_FILE         f;
+
+    try
+    {
+        tcm_cfs_open(f, filename, "r");
+        s = f.read();
+        f.close();
+    }
+    catch (_py_IOError const & e)
+    {
+        tcm_err(PY_STRING().format("%s %s\n%s", filename, e.what(), "Is kernel module loaded?"));
+    }
+    return s;
+}
+
+// Reads read-mostly attribute, value is cached until attribute of same device is written
+static PY_STRING tcm_read_cached(char * filename)
+{
+    PY_STRING s;
+
+    if (!tcm_cfs_attr_get(filename, s))
+    {
+        s = tcm_read(filename);
+        tcm_cfs_attr_put(filename, s);
+    }
+    return s;
+}
+
+void tcm_write(char * filename, char * value, bool newline)
+{
+    PY_STRING   s = newline ? PY_STRING(value) + "\n" : PY_STRING(value);
+    int         err;
+
+    err = tcm_cfs_write(filename, s, s.len());
+    if (err != 0)
+        tcm_err(PY_STRING().format("%s %s\n%s", filename, strerror(err), "Is kernel module loaded?"));
+}
+
+PY_STRING tcm_full_path(char * arg)
+{
+    return tcm_cfs_root() + "/" + arg;
+}
+
+void tcm_set_var_root(char * var_root)
+{
+    tcm_var_root = var_root;
+}
+
+PY_STRING tcm_var_path(char * arg)
+{
+    return tcm_var_root + "/" + arg;
+}
+
+static void tcm_check_dev_exists(char * dev_path)
+{
+    PY_STRING full_path;
+
+    full_path = tcm_full_path(dev_path);
+    if (!tcm_cfs_isdir(full_path))
+        tcm_err(PY_STRING("TCM/ConfigFS storage object does not exist: ") + full_path);
+}
+
+static void tcm_alua_check_metadata_dir(char * dev_path)
+{
+    PY_STRING alua_path;
+
+    alua_path = tcm_var_path("alua/tpgs_") + tcm_get_unit_serial(dev_path) + "/";
+    if (_py_os_path_isdir(alua_path))
+        return;
+
+    _py_os_makedirs(alua_path);
+}
+
+bool tcm_alua_read_metadata(char * unit_serial, char * gp_name, MAP_PY_STRING & md)
+{
+    PY_STRING alua_md_path;
+
+    alua_md_path = tcm_var_path("alua/tpgs_") + unit_serial + "/" + gp_name;
+
+    md.clear();
+    if (!_py_os_path_isfile(alua_md_path))
+        return false;
+
+    LIST_PY_STRING      lines;
+    LIST_PY_STRING_IT   it;
+    PY_STRING_VIEW      key;
+    PY_STRING_VIEW      value;
+    PY_FILE             p;
+
+    p.open(alua_md_path);
+    lines = p.readlines();
+    p.close();
+    for (it = lines.begin();
+         it != lines.end();
+         it ++)
+    {
+        PY_STRING_TOKENIZER items(*it, '=');
+
+        if (!items.next(key) || !items.next(value))
+            continue;
+        md[key.strip().str()] = value.strip().str();
+    }
+    return true;
+}
+
+// Writes ALUA state taken from metadata, NULL values are not written
+static void tcm_alua_write_metadata(char * dev_path, char * gp_name, char * access_state, char * access_status)
+{
+    PY_STRING alua_gp_path;
+
+    alua_gp_path = tcm_full_path(dev_path) + "/alua/" + gp_name;
+
+    if (access_state != NULL)
+        tcm_write(alua_gp_path + "/alua_access_state", access_state);
+
+    if (access_status != NULL)
+        tcm_write(alua_gp_path + "/alua_access_status", access_status);
+
+    tcm_write(alua_gp_path + "/alua_write_metadata", "1");
+}
+
+static void tcm_alua_process_metadata(char * dev_path, char * gp_name, char * gp_id)
+{
+    TCM_TRACE_SPAN      span("alua_metadata", dev_path);
+    MAP_PY_STRING       d;
+    MAP_PY_STRING_IT    d_it;
+    PY_STRING           access_state;
+    PY_STRING           access_status;
+
+    if (!tcm_alua_read_metadata(tcm_get_unit_serial(dev_path), gp_name, d))
+    {
+        tcm_alua_write_metadata(dev_path, gp_name, NULL, NULL);
+        return;
+    }
+
+    d_it = d.find(PY_STRING("tg_pt_gp_id"));
+    if ((d_it != d.end()) && (d_it->second != PY_STRING(gp_id)))
+        throw _py_IOError(PY_STRING("").format("Passed tg_pt_gp_id: %s does not match extracted: %s", gp_id, (char *)d_it->second));
+
+    d_it = d.find(PY_STRING("alua_access_state"));
+    if (d_it != d.end())
+        access_state = d_it->second;
+
+    d_it = d.find(PY_STRING("alua_access_status"));
+    if (d_it != d.end())
+        access_status = d_it->second;
+
+    tcm_alua_write_metadata(dev_path, gp_name, access_state, access_status);
+}
+
+// Creates ALUA group, metadata is processed by caller
+static void tcm_add_alua_tgptgp(char * dev_path, char * gp_name, char * gp_id)
+{
+    PY_STRING alua_gp_path;
+
+    alua_gp_path = tcm_full_path(dev_path) + "/alua/" + gp_name;
+
+    tcm_check_dev_exists(dev_path);
+
+    if ((PY_STRING(gp_name) == "default_tg_pt_gp") && (PY_STRING(gp_id) == "0"))
+        return;
+
+    tcm_cfs_mkdir(alua_gp_path);
+
+    try
+    {
+        tcm_write(alua_gp_path + "/tg_pt_gp_id", gp_id);
+    }
+    catch (...)
+    {
+        tcm_cfs_rmdir(alua_gp_path);
+        throw;
+    }
+}
+
+void tcm_add_alua_tgptgp_with_md(char * dev_path, char * gp_name, char * gp_id)
+{
+    tcm_add_alua_tgptgp(dev_path, gp_name, gp_id);
+    tcm_alua_process_metadata(dev_path, gp_name, gp_id);
+}
+
+void tcm_add_alua_tgptgp_with_md(char * dev_path, char * gp_name, char * gp_id, char * access_state, char * access_status)
+{
+    tcm_add_alua_tgptgp(dev_path, gp_name, gp_id);
+    tcm_alua_write_metadata(dev_path, gp_name, access_state, access_status);
+}
+
+static void tcm_del_alua_lugp(char * lu_gp_name)
+{
+    if (!tcm_cfs_isdir(tcm_cfs_root() + "/alua/lu_gps/" + lu_gp_name))
+        tcm_err(PY_STRING("ALUA Logical Unit Group: ") + lu_gp_name + " does not exist!");
+
+    tcm_cfs_rmdir(tcm_cfs_root() + "/alua/lu_gps/" + lu_gp_name);
+}
+
+void tcm_del_alua_tgptgp(char * dev_path, char * gp_name)
+{
+    PY_STRING full_path;
+
+    tcm_check_dev_exists(dev_path);
+
+    full_path = tcm_full_path(dev_path);
+
+    if (!tcm_cfs_isdir(full_path + "/alua/" + gp_name))
+        tcm_err(PY_STRING("ALUA Target Port Group: ") + gp_name + " does not exist!");
+
+    tcm_cfs_rmdir(full_path + "/alua/" + gp_name);
+}
+
+static void tcm_generate_uuid_for_unit_serial(char * dev_path)
+{
+    PY_STRING unit_serial;
+
+    {
+        TCM_TRACE_SPAN span("uuid_generate", dev_path);
+
+        unit_serial = _py_uuid_uuid4();
+    }
+    tcm_set_wwn_unit_serial(dev_path, unit_serial);
+}
+
+void tcm_createvirtdev(char * dev_path, char * plugin_params, bool establishdev)
+{
+    TCM_TRACE_SPAN      span("createvirtdev", dev_path);
+    PY_STRING_VIEW      part;
+    PY_STRING           hba_path;
+    PY_STRING           hba_full_path;
+    PY_STRING           full_path;
+    bool                gen_uuid;
+
+    if (PY_STRING_TOKENIZER(dev_path, '/').next(part))
+        hba_path = part.str();
+
+    hba_full_path = tcm_full_path(hba_path);
+    if (!tcm_cfs_isdir(hba_full_path))
+        tcm_cfs_mkdir(hba_full_path);
+
+    full_path = tcm_full_path(dev_path);
+    if (tcm_cfs_isdir(full_path))
+        tcm_err(PY_STRING("TCM/ConfigFS storage object already exists: ") + full_path);
+    else
+        tcm_cfs_mkdir(full_path);
+
+    gen_uuid = !establishdev;
+
+    for (TCM_MODULE * tcm = tcm_modules;
+         tcm->name != NULL;
+         tcm ++)
+    {
+        if (!hba_path.starts_with(PY_STRING(tcm->name) + "_"))
+            continue;
+        try
+        {
+            if (tcm->fnc_createvirtdev != NULL)
+            {
+                if (0 != tcm->fnc_createvirtdev(dev_path, plugin_params))
+                    tcm_err(PY_STRING(tcm->name) + " createvirtdev failed for " + dev_path);
+            }
+            else
+                tcm_err(PY_STRING("no module for ") + tcm->name);
+        }
+        catch (...)
+        {
+            tcm_cfs_rmdir(full_path);
+            if (tcm_verbose)
+                printf("%s\n", (char *)(PY_STRING("Unable to register TCM/ConfigFS storage object: ") + full_path));
+            throw;
+        }
+
+        if (tcm_verbose)
+            printf("%s" "\n", (char *)tcm_read_cached(full_path + "/info"));
+
+        if (tcm->gen_uuid && gen_uuid)
+        {
+            tcm_generate_uuid_for_unit_serial(dev_path);
+            tcm_alua_check_metadata_dir(dev_path);
+        }
+        break;
+    }
+}
+
+static PY_STRING tcm_get_unit_serial(char * dev_path)
+{
+    PY_STRING           string;
+    PY_STRING_VIEW      item;
+
+    // Format is "T10 VPD Unit Serial Number: <serial>"
+    string = tcm_read_cached(tcm_full_path(dev_path) + "/wwn/vpd_unit_serial");
+    PY_STRING_TOKENIZER items(string, ':');
+    if (!items.next(item) || !items.next(item))
+        return PY_STRING();
+    return item.strip().str();
+}
+
+// Parses APTPL metadata registration by registration, memory use does not depend on size of metadata
+void tcm_aptpl_parse(const PY_STRING_VIEW & aptpl, TCM_APTPL_FNC fnc, void * ctx)
+{
+    PY_STRING_TOKENIZER lines(aptpl);
+    PY_STRING_VIEW      line;
+    PY_STRING           reg;
+
+    // File must start with registration, as in tcm_node.py
+    if (!lines.next(line) || !line.starts_with("PR_REG_START:"))
+        return;
+
+    do
+    {
+        if (line.starts_with("PR_REG_START:"))
+            reg = PY_STRING();
+        else
+        if (line.starts_with("PR_REG_END:"))
+            fnc(ctx, reg);
+        else
+        {
+            if (reg.len() > 0)
+                reg += ",";
+            reg += line.strip().str();
+        }
+    }
+    while (lines.next(line));
+}
+
+static void tcm_aptpl_write(void * ctx, const PY_STRING & reg)
+{
+    tcm_write(*(PY_STRING *) ctx, reg);
+}
+
+static void tcm_process_aptpl_metadata(char * dev_path)
+{
+    TCM_TRACE_SPAN  span("aptpl_metadata", dev_path);
+    PY_STRING       aptpl_file;
+    PY_STRING       res_path;
+    PY_MMAP         aptpl;
+
+    tcm_check_dev_exists(dev_path);
+
+    aptpl_file = tcm_var_path("pr/aptpl_") + tcm_get_unit_serial(dev_path);
+    if (!_py_os_path_isfile(aptpl_file))
+        return;
+
+    try
+    {
+        aptpl.open(aptpl_file);
+    }
+    catch (_py_IOError const & e)
+    {
+        tcm_err(PY_STRING().format("%s %s", (char *)aptpl_file, e.what()));
+    }
+
+    // Each registration is written as soon as it is parsed
+    res_path = tcm_full_path(dev_path) + "/pr/res_aptpl_metadata";
+    tcm_aptpl_parse(aptpl.view(), tcm_aptpl_write, &res_path);
+}
+
+void tcm_establishvirtdev(char * dev_path, char * plugin_params)
+{
+    tcm_createvirtdev(dev_path, plugin_params, true);
+}
+
+void tcm_freevirtdev(char * dev_path)
+{
+    TCM_TRACE_SPAN      span("freevirtdev", dev_path);
+    PY_STRING           full_path;
+    LIST_PY_STRING      tg_pt_gps;
+    LIST_PY_STRING_IT   tg_pt_gps_it;
+
+    tcm_check_dev_exists(dev_path);
+
+    full_path = tcm_full_path(dev_path);
+
+    tg_pt_gps = tcm_cfs_listdir(full_path + "/alua/");
+    for (tg_pt_gps_it = tg_pt_gps.begin();
+         tg_pt_gps_it != tg_pt_gps.end();
+         tg_pt_gps_it ++)
+    {
+        if (*tg_pt_gps_it == "default_tg_pt_gp")
+            continue;
+        tcm_del_alua_tgptgp(dev_path, *tg_pt_gps_it);
+    }
+
+    tcm_cfs_rmdir(full_path);
+}
+
+static void tcm_set_wwn_unit_serial(char * dev_path, char * unit_serial)
+{
+    tcm_check_dev_exists(dev_path);
+    tcm_write(tcm_full_path(dev_path) + "/wwn/vpd_unit_serial", unit_serial);
+}
+
+void tcm_set_wwn_unit_serial_with_md(char * dev_path, char * unit_serial)
+{
+    tcm_check_dev_exists(dev_path);
+    tcm_set_wwn_unit_serial(dev_path, unit_serial);
+    tcm_process_aptpl_metadata(dev_path);
+    tcm_alua_check_metadata_dir(dev_path);
+}
+
+void tcm_set_wwn_unit_serial_with_md(char * dev_path, char * unit_serial, const char * aptpl_regs, int aptpl_regs_num)
+{
+    PY_STRING res_path;
+
+    tcm_check_dev_exists(dev_path);
+    tcm_set_wwn_unit_serial(dev_path, unit_serial);
+
+    res_path = tcm_full_path(dev_path) + "/pr/res_aptpl_metadata";
+    for (; aptpl_regs_num > 0; aptpl_regs_num --)
+    {
+        tcm_write(res_path, (char *)aptpl_regs);
+        aptpl_regs += strlen(aptpl_regs) + 1;
+    }
+
+    tcm_alua_check_metadata_dir(dev_path);
+}
+
+//
+// Parallel teardown
+//
+// Devices of all HBAs are freed on the worker pool (tg_pt_gps before the
+// device), then HBAs whose devices were all freed are removed.  lu_gps and
+// modules are removed only when the whole tree is gone.
+//
+
+typedef struct
+{
+    PY_STRING   path;                           // HBA or device path relative to tcm_root
+    int         hba_idx;                        // Index of HBA for devices, -1 for HBAs
+    PY_STRING   err;
+    double      secs;
+} TCM_UNLOAD_OBJ;
+
+typedef struct
+{
+    std::vector<TCM_UNLOAD_OBJ> *   objs;
+    int                             done;       // Updated atomically
+    bool                            hbas;
+} TCM_UNLOAD_CTX;
+
+static void tcm_unload_obj(void * ctx, int idx)
+{
+    TCM_UNLOAD_CTX *    unload = (TCM_UNLOAD_CTX *) ctx;
+    TCM_UNLOAD_OBJ &    obj = (*unload->objs)[idx];
+    double              start = _py_time_monotonic();
+    int                 done;
+
+    try
+    {
+        if (unload->hbas)
+            tcm_cfs_rmdir(tcm_full_path(obj.path));
+        else
+            tcm_freevirtdev(obj.path);
+    }
+    catch (std::exception const & e)
+    {
+        obj.err = e.what();
+        if (obj.err == NULL)
+            obj.err = "failed";
+    }
+    obj.secs = _py_time_monotonic() - start;
+
+    done = __sync_add_and_fetch(&unload->done, 1);
+    if (!tcm_verbose)
+        return;
+    if (obj.err == NULL)
+        printf("UNLOAD: [%d/%d] %s %s freed in %.3f ms\n", done, (int)unload->objs->size(),
+               unload->hbas ? "HBA" : "device", (char *)obj.path, obj.secs * 1000);
+    else
+        printf("UNLOAD: [%d/%d] %s %s FAILED (%s)\n", done, (int)unload->objs->size(),
+               unload->hbas ? "HBA" : "device", (char *)obj.path, (char *)obj.err);
+}
+
+// Runs tcm_unload_obj() over objs, returns number of failed objects
+static int tcm_unload_objs(std::vector<TCM_UNLOAD_OBJ> & objs, bool hbas, int jobs)
+{
+    TCM_UNLOAD_CTX  ctx;
+    int             failed_num = 0;
+
+    ctx.objs = &objs;
+    ctx.done = 0;
+    ctx.hbas = hbas;
+    tcm_pool_run(jobs, objs.size(), tcm_unload_obj, &ctx);
+
+    for (unsigned int idx = 0; idx < objs.size(); idx ++)
+        if (objs[idx].err != NULL)
+            failed_num ++;
+    return failed_num;
+}
+
+void tcm_unload(int jobs, int modwait_secs)
+{
+    if (!tcm_cfs_isdir(tcm_cfs_root()))
+        tcm_err(PY_STRING("Unable to access tcm_root: ") + tcm_cfs_root());
+
+    LIST_PY_STRING              hba_root;
+    LIST_PY_STRING_IT           hba_root_it;
+    LIST_PY_STRING              gs;
+    LIST_PY_STRING_IT           gs_it;
+    std::vector<TCM_UNLOAD_OBJ> hbas;
+    std::vector<TCM_UNLOAD_OBJ> devs;
+    std::vector<TCM_UNLOAD_OBJ> empty_hbas;
+    std::vector<bool>           hbas_busy;
+    TCM_UNLOAD_OBJ              obj;
+    int                         failed_num;
+    double                      start = _py_time_monotonic();
+
+    obj.secs = 0;
+    hba_root = tcm_cfs_listdir(tcm_cfs_root());
+    for (hba_root_it = hba_root.begin();
+         hba_root_it != hba_root.end();
+         hba_root_it ++)
+    {
+        if (*hba_root_it == "alua")
+            continue;
+
+        obj.path = *hba_root_it;
+        obj.hba_idx = -1;
+        hbas.push_back(obj);
+
+        gs = tcm_cfs_listdir(tcm_full_path(*hba_root_it));
+        for (gs_it = gs.begin();
+             gs_it != gs.end();
+             gs_it ++)
+        {
+            if ((*gs_it == PY_STRING("hba_info")) ||
+                (*gs_it == PY_STRING("hba_mode")))
+                continue;
+            obj.path = *hba_root_it + "/" + *gs_it;
+            obj.hba_idx = hbas.size() - 1;
+            devs.push_back(obj);
+        }
+    }
+
+    failed_num = tcm_unload_objs(devs, false, jobs);
+
+    // HBA can be removed only without devices
+    hbas_busy.resize(hbas.size());
+    for (unsigned int idx = 0; idx < devs.size(); idx ++)
+        if (devs[idx].err != NULL)
+            hbas_busy[devs[idx].hba_idx] = true;
+    for (unsigned int idx = 0; idx < hbas.size(); idx ++)
+        if (!hbas_busy[idx])
+            empty_hbas.push_back(hbas[idx]);
+
+    failed_num += tcm_unload_objs(empty_hbas, true, jobs);
+
+    if (tcm_verbose)
+        printf("UNLOAD: %d devices, %d HBAs in %.3f ms, %d failed\n",
+               (int)devs.size(), (int)hbas.size(), (_py_time_monotonic() - start) * 1000, failed_num);
+    if (failed_num > 0)
+        tcm_err(PY_STRING().format("Unable to free %d TCM/ConfigFS objects", failed_num));
+
+    LIST_PY_STRING      lu_gps;
+    LIST_PY_STRING_IT   lu_gps_it;
+
+    lu_gps = tcm_cfs_listdir(tcm_cfs_root() + "/alua/lu_gps");
+    for (lu_gps_it = lu_gps.begin();
+         lu_gps_it != lu_gps.end();
+         lu_gps_it ++)
+    {
+        if (*lu_gps_it == "default_lu_gp")
+            continue;
+        tcm_del_alua_lugp(*lu_gps_it);
+    }
+
+    // Emulated configfs has no modules behind it
+    if (tcm_cfs_emulated())
+        return;
+
+    // Backend modules are independent of each other
+    const char *    backends[] = {"target_core_iblock", "target_core_file", "target_core_pscsi", "target_core_stgt", NULL};
+    int             errs[4];
+    int             err;
+
+    tcm_kmod_unload_parallel(backends, errs, modwait_secs);
+    for (int idx = 0; backends[idx] != NULL; idx ++)
+        if (tcm_verbose && (errs[idx] != 0) && (errs[idx] != ENOENT))
+            fprintf(stderr, "Unable to unload %s: %s\n", backends[idx], strerror(errs[idx]));
+
+    err = tcm_kmod_unload("target_core_mod", modwait_secs);
+    if (err != 0)
+        tcm_err(PY_STRING("Unable to rmmod target_core_mod: ") + strerror(err));
+}
+
+void tcm_load(void)
+{
+    if (tcm_cfs_emulated())
+    {
+        tcm_printf("LOAD: configfs is emulated, modules are not loaded\n");
+        return;
+    }
+
+    try
+    {
+        tcm_kmod_load("target_core_mod");
+        for (TCM_MODULE * tcm = tcm_modules;
+             tcm->name != NULL;
+             tcm ++)
+            tcm_kmod_load(PY_STRING("target_core_") + tcm->name);
+    }
+    catch (_py_OSError const & e)
+    {
+        tcm_err(PY_STRING("Unable to load target modules: ") + e.what());
+    }
+}
+
+PY_STRING tcm_version(void)
+{
+    return tcm_read(tcm_cfs_target_path("version")).strip();
+}
@@ -0,0 +1,49 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_OPS_H_
+#define _TCM_OPS_H_ 1
+
+#include "_py.h"
+
+//
+// tcm_node operations
+//
+// Errors are raised by _py_SystemExit with message like tcm_node.py exits,
+// or by _py_OSError / _py_IOError of failed system calls.
+//
+
+void        tcm_set_verbose                 (bool verbose);                 // Prints messages and errors to stdout / stderr, off by default
+int         tcm_printf                      (const char * format, ...);     // printf() in verbose mode only
+void        tcm_err                         (char * msg);                   // throws _py_SystemExit, prints msg in verbose mode
+
+// Called for each registration of APTPL metadata, reg is comma separated list of its lines
+typedef void (*TCM_APTPL_FNC)(void * ctx, const PY_STRING & reg);
+
+void        tcm_add_alua_tgptgp_with_md     (char * dev_path, char * gp_name, char * gp_id);
+void        tcm_add_alua_tgptgp_with_md     (char * dev_path, char * gp_name, char * gp_id,
+                                             char * access_state, char * access_status);    // Metadata given by caller, NULL values are not set
+bool        tcm_alua_read_metadata          (char * unit_serial, char * gp_name, MAP_PY_STRING & md);   // Reads ALUA metadata of var root, false if there is none
+void        tcm_aptpl_parse                 (const PY_STRING_VIEW & aptpl, TCM_APTPL_FNC fnc, void * ctx);
+void        tcm_createvirtdev               (char * dev_path, char * plugin_params, bool establishdev = false);
+void        tcm_del_alua_tgptgp             (char * dev_path, char * gp_name);
+void        tcm_establishvirtdev            (char * dev_path, char * plugin_params);
+void        tcm_freevirtdev                 (char * dev_path);
+PY_STRING   tcm_full_path                   (char * arg);                   // Path under tcm_cfs_root()
+void        tcm_load                        (void);
+void        tcm_reconcile                   (char * filename, int jobs);    // Applies only differences of saveconfig.json to live configuration
+void        tcm_restore                     (char * filename, int jobs);    // Restores storage objects of targetcli saveconfig.json
+void        tcm_set_var_root                (char * var_root);              // Root of ALUA and APTPL metadata, default /var/target
+void        tcm_set_wwn_unit_serial_with_md (char * dev_path, char * unit_serial);
+void        tcm_set_wwn_unit_serial_with_md (char * dev_path, char * unit_serial,
+                                             const char * aptpl_regs, int aptpl_regs_num);  // APTPL registrations given by caller, NUL separated
+void        tcm_unload                      (int jobs, int modwait_secs);
+PY_STRING   tcm_var_path                    (char * arg);                   // Path under var root
+PY_STRING   tcm_version                     (void);
+void        tcm_write                       (char * filename, char * value, bool newline = true);
+
+#endif /* _TCM_OPS_H_ */
@@ -0,0 +1,102 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <pthread.h>
+#include <vector>
+
+#include "_py.h"
+#include "tcm_pool.h"
+
+typedef struct
+{
+    TCM_POOL_FNC    fnc;
+    void *          ctx;
+    int             count;
+    int             next;               // Next work item, taken atomically
+    int             failed;             // Set when callback of worker thread threw
+} TCM_POOL;
+
+// Runs work items until there are none left
+static void tcm_pool_work(TCM_POOL * pool)
+{
+    int idx;
+
+    while ((idx = __sync_fetch_and_add(&pool->next, 1)) < pool->count)
+        pool->fnc(pool->ctx, idx);
+}
+
+// No more items are handed out after a failure
+static void tcm_pool_stop(TCM_POOL * pool)
+{
+    __sync_lock_test_and_set(&pool->next, pool->count);
+}
+
+static void * tcm_pool_thread(void * arg)
+{
+    TCM_POOL * pool = (TCM_POOL *) arg;
+
+    // Exception must not leave thread function
+    try
+    {
+        tcm_pool_work(pool);
+    }
+    catch (...)
+    {
+        pool->failed = 1;
+        tcm_pool_stop(pool);
+    }
+    return NULL;
+}
+
+static void tcm_pool_join(std::vector<pthread_t> & threads)
+{
+    for (unsigned int idx = 0; idx < threads.size(); idx ++)
+        pthread_join(threads[idx], NULL);
+}
+
+void tcm_pool_run(int jobs, int count, TCM_POOL_FNC fnc, void * ctx)
+{
+    TCM_POOL                pool;
+    std::vector<pthread_t>  threads;
+    pthread_t               thread;
+    int                     idx;
+
+    pool.fnc = fnc;
+    pool.ctx = ctx;
+    pool.count = count;
+    pool.next = 0;
+    pool.failed = 0;
+
+    if (jobs > count)
+        jobs = count;
+    if (jobs > 1)
+        threads.reserve(jobs - 1);
+
+    // Calling thread is one of workers
+    for (idx = 1; idx < jobs; idx ++)
+    {
+        if (0 != pthread_create(&thread, NULL, tcm_pool_thread, &pool))
+            break;
+        threads.push_back(thread);
+    }
+
+    // Workers use pool and ctx until they are joined, also when calling thread fails
+    try
+    {
+        tcm_pool_work(&pool);
+    }
+    catch (...)
+    {
+        tcm_pool_stop(&pool);
+        tcm_pool_join(threads);
+        throw;
+    }
+    tcm_pool_join(threads);
+
+    if (pool.failed)
+        throw _py_OSError("Work item failed in worker thread");
+}
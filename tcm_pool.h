@@ -0,0 +1,19 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_POOL_H_
+#define _TCM_POOL_H_ 1
+
+// Work item callback, is expected to catch its own errors
+typedef void (* TCM_POOL_FNC)(void * ctx, int idx);
+
+// Runs fnc(ctx, 0 .. count - 1) on at most jobs threads and waits for all items.
+// After exception of a callback no more items are started, all threads are
+// joined and the exception is rethrown, that of worker thread as _py_OSError.
+void tcm_pool_run(int jobs, int count, TCM_POOL_FNC fnc, void * ctx);
+
+#endif /* _TCM_POOL_H_ */
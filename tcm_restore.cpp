@@ -0,0 +1,519 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+// Restore of storage objects from targetcli saveconfig.json
+//
+// Whole file is parsed into a plan first, so bad configuration is found
+// before anything is created.  Each block storage object gets its own
+// iblock_N HBA as with rtslib, so objects are restored in parallel on the
+// worker pool.  Other plugins and fabric targets are skipped.
+//
+// Reconcile matches live iblock storage objects to the plan by name and
+// changes only what differs: objects are created, deleted, recreated for
+// other udev_path, or get their serial, ALUA groups and attributes set.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_ops.h"
+#include "tcm_pool.h"
+#include "tcm_state.h"
+
+typedef struct
+{
+    PY_STRING   name;
+    PY_STRING   value;
+} TCM_RESTORE_ATTR;
+
+typedef std::vector<TCM_RESTORE_ATTR>   TCM_RESTORE_ATTRS;
+
+typedef struct
+{
+    PY_STRING           name;
+    PY_STRING           id;
+    TCM_RESTORE_ATTRS   attrs;
+} TCM_RESTORE_TPG;
+
+typedef struct
+{
+    PY_STRING                       name;       // Name of storage object in saveconfig.json
+    PY_STRING                       dev_path;   // iblock_N/name
+    PY_STRING                       udev_path;
+    PY_STRING                       wwn;        // Empty to generate unit serial
+    TCM_RESTORE_ATTRS               attrs;
+    std::vector<TCM_RESTORE_TPG>    tpgs;
+    PY_STRING                       err;        // First error, empty if restored
+    LIST_PY_STRING                  warnings;   // Attributes that could not be set
+    const TCM_STATE_DEV *           live;       // Matching live object for reconcile, NULL to create
+    PY_STRING                       changes;    // What reconcile did
+} TCM_RESTORE_DEV;
+
+typedef std::vector<TCM_RESTORE_DEV>    TCM_RESTORE_PLAN;
+
+// Gets value of attribute as written to configfs
+static PY_STRING tcm_restore_value(const PY_JSON & json, int node)
+{
+    if (json.type(node) == PY_JSON::PY_JSON_BOOL)
+        return json.value(node) == "true" ? "1" : "0";
+    return json.value(node);
+}
+
+static PY_STRING tcm_restore_string(const PY_JSON & json, int node, const char * key, const PY_STRING & so_name)
+{
+    int item = json.get(node, key);
+
+    if ((item < 0) || (json.type(item) != PY_JSON::PY_JSON_STRING) || (json.value(item).len() == 0))
+        tcm_err(PY_STRING().format("Storage object %s: missing \"%s\"", (char *)so_name, key));
+    return json.value(item);
+}
+
+// Collects scalar members of object except skipped names
+static void tcm_restore_attrs(const PY_JSON & json, int node, const char ** skip, TCM_RESTORE_ATTRS & attrs)
+{
+    TCM_RESTORE_ATTR    attr;
+    int                 idx;
+
+    for (node = json.child(node); node >= 0; node = json.next(node))
+    {
+        if ((json.type(node) == PY_JSON::PY_JSON_ARRAY) ||
+            (json.type(node) == PY_JSON::PY_JSON_OBJECT) ||
+            (json.type(node) == PY_JSON::PY_JSON_NULL))
+            continue;
+
+        for (idx = 0; (skip[idx] != NULL) && (json.key(node) != skip[idx]); idx ++);
+        if (skip[idx] != NULL)
+            continue;
+
+        // hw_ attributes describe backing device and are read only
+        if (PY_STRING_VIEW(json.key(node)).starts_with("hw_"))
+            continue;
+
+        attr.name = json.key(node);
+        attr.value = tcm_restore_value(json, node);
+
+        // Access state can be changed only when access type allows it
+        if (attr.name == "alua_access_type")
+            attrs.insert(attrs.begin(), attr);
+        else
+            attrs.push_back(attr);
+    }
+}
+
+static void tcm_restore_plan(const char * prefix, const PY_JSON & json, TCM_RESTORE_PLAN & plan)
+{
+    const char *    so_skip[] = {NULL};
+    const char *    tpg_skip[] = {"name", "tg_pt_gp_id", NULL};
+    TCM_RESTORE_DEV dev;
+    TCM_RESTORE_TPG tpg;
+    int             sos;
+    int             so;
+    int             item;
+    int             hba_idx = 0;
+
+    sos = json.get(0, "storage_objects");
+    if (sos < 0)
+        return;
+    if (json.type(sos) != PY_JSON::PY_JSON_ARRAY)
+        tcm_err("\"storage_objects\" is not a list");
+
+    for (so = json.child(sos); so >= 0; so = json.next(so))
+    {
+        if (json.type(so) != PY_JSON::PY_JSON_OBJECT)
+            tcm_err("Storage object is not an object");
+
+        dev = TCM_RESTORE_DEV();
+        dev.name = tcm_restore_string(json, so, "name", "?");
+
+        item = json.get(so, "plugin");
+        if ((item < 0) || (json.value(item) != "block"))
+        {
+            tcm_printf("%s: %s: plugin %s is not supported, skipped\n", prefix, (char *)dev.name,
+                       item < 0 ? "?" : (char *)json.value(item));
+            continue;
+        }
+
+        dev.dev_path = PY_STRING().format("iblock_%d/%s", hba_idx ++, (char *)dev.name);
+        dev.udev_path = tcm_restore_string(json, so, "dev", dev.name);
+
+        item = json.get(so, "wwn");
+        if ((item >= 0) && (json.type(item) == PY_JSON::PY_JSON_STRING))
+            dev.wwn = json.value(item);
+
+        item = json.get(so, "attributes");
+        if ((item >= 0) && (json.type(item) == PY_JSON::PY_JSON_OBJECT))
+            tcm_restore_attrs(json, item, so_skip, dev.attrs);
+
+        item = json.get(so, "alua_tpgs");
+        if ((item >= 0) && (json.type(item) == PY_JSON::PY_JSON_ARRAY))
+        {
+            for (item = json.child(item); item >= 0; item = json.next(item))
+            {
+                tpg = TCM_RESTORE_TPG();
+                tpg.name = tcm_restore_string(json, item, "name", dev.name);
+                if (json.get(item, "tg_pt_gp_id") < 0)
+                    tcm_err(PY_STRING().format("Storage object %s: ALUA group %s has no tg_pt_gp_id", (char *)dev.name, (char *)tpg.name));
+                tpg.id = tcm_restore_value(json, json.get(item, "tg_pt_gp_id"));
+                tcm_restore_attrs(json, item, tpg_skip, tpg.attrs);
+                dev.tpgs.push_back(tpg);
+            }
+        }
+
+        plan.push_back(dev);
+    }
+}
+
+// Writes attributes, only those with other value if changed_only, failures are collected as warnings, returns number of written attributes
+static int tcm_restore_write_attrs(TCM_RESTORE_DEV & dev, const PY_STRING & dir_path, const TCM_RESTORE_ATTRS & attrs, bool changed_only = false)
+{
+    PY_STRING   path;
+    PY_STRING   value;
+    int         written_num = 0;
+    int         err;
+
+    for (unsigned int idx = 0; idx < attrs.size(); idx ++)
+    {
+        path = dir_path + attrs[idx].name;
+        if (changed_only)
+        {
+            try
+            {
+                if (tcm_state_attr(path) == attrs[idx].value)
+                    continue;
+            }
+            catch (_py_IOError const & e)
+            {
+            }
+        }
+
+        written_num ++;
+        value = attrs[idx].value + "\n";
+        err = tcm_cfs_write(path, value, value.len());
+        if (err != 0)
+            dev.warnings.push_back(PY_STRING().format("%s%s (%s)", (char *)dir_path, (char *)attrs[idx].name, strerror(err)));
+    }
+    return written_num;
+}
+
+// Creates storage object of plan, throws on error
+static void tcm_restore_create(TCM_RESTORE_DEV & dev)
+{
+    // Unit serial is generated only without wwn
+    tcm_createvirtdev(dev.dev_path, dev.udev_path, dev.wwn.len() > 0);
+
+    tcm_restore_write_attrs(dev, tcm_full_path(dev.dev_path) + "/attrib/", dev.attrs);
+
+    if (dev.wwn.len() > 0)
+        tcm_set_wwn_unit_serial_with_md(dev.dev_path, dev.wwn);
+
+    for (unsigned int tpg_idx = 0; tpg_idx < dev.tpgs.size(); tpg_idx ++)
+    {
+        TCM_RESTORE_TPG & tpg = dev.tpgs[tpg_idx];
+
+        tcm_add_alua_tgptgp_with_md(dev.dev_path, tpg.name, tpg.id);
+        tcm_restore_write_attrs(dev, tcm_full_path(dev.dev_path) + "/alua/" + tpg.name + "/", tpg.attrs);
+    }
+}
+
+static void tcm_restore_dev(void * ctx, int idx)
+{
+    TCM_RESTORE_DEV & dev = (*(TCM_RESTORE_PLAN *) ctx)[idx];
+
+    try
+    {
+        tcm_restore_create(dev);
+    }
+    catch (std::exception const & e)
+    {
+        dev.err = e.what();
+        if (dev.err == NULL)
+            dev.err = "failed";
+    }
+}
+
+// Loads plan of configuration file
+static void tcm_restore_load(const char * prefix, char * filename, TCM_RESTORE_PLAN & plan)
+{
+    PY_MMAP file;
+    PY_JSON json;
+
+    try
+    {
+        file.open(filename);
+        json.loads(file.view());
+    }
+    catch (std::exception const & e)
+    {
+        tcm_err(PY_STRING().format("%s: %s", filename, e.what()));
+    }
+    if (json.type(0) != PY_JSON::PY_JSON_OBJECT)
+        tcm_err(PY_STRING().format("%s: configuration is not an object", filename));
+
+    tcm_restore_plan(prefix, json, plan);
+}
+
+// Prints results of plan, returns number of failed objects
+static int tcm_restore_report(const char * prefix, TCM_RESTORE_PLAN & plan)
+{
+    LIST_PY_STRING_IT   it;
+    int                 failed_num = 0;
+
+    for (unsigned int idx = 0; idx < plan.size(); idx ++)
+    {
+        TCM_RESTORE_DEV & dev = plan[idx];
+
+        for (it = dev.warnings.begin(); it != dev.warnings.end(); it ++)
+            tcm_printf("%s: %s: unable to set %s\n", prefix, (char *)dev.dev_path, (char *)*it);
+
+        if (dev.err != NULL)
+        {
+            tcm_printf("%s: %s: FAILED (%s)\n", prefix, (char *)dev.dev_path, (char *)dev.err);
+            failed_num ++;
+        }
+        else
+            tcm_printf("%s: %s: %s\n", prefix, (char *)dev.dev_path, dev.changes == NULL ? "OK" : (char *)dev.changes);
+    }
+    return failed_num;
+}
+
+void tcm_restore(char * filename, int jobs)
+{
+    TCM_RESTORE_PLAN    plan;
+    int                 failed_num;
+    double              start = _py_time_monotonic();
+
+    tcm_restore_load("RESTORE", filename, plan);
+
+    tcm_pool_run(jobs, plan.size(), tcm_restore_dev, &plan);
+
+    failed_num = tcm_restore_report("RESTORE", plan);
+    tcm_printf("RESTORE: %d storage objects in %.3f ms, %d failed\n",
+               (int)plan.size(), (_py_time_monotonic() - start) * 1000, failed_num);
+    if (failed_num > 0)
+        tcm_err(PY_STRING().format("Unable to restore %d storage objects", failed_num));
+}
+
+//
+// Reconcile
+//
+
+// Brings matched live object to plan, returns description of changes
+static PY_STRING tcm_reconcile_update(TCM_RESTORE_DEV & dev)
+{
+    const TCM_STATE_DEV &   live = *dev.live;
+    LIST_PY_STRING          changes;
+    PY_STRING               full_path = tcm_full_path(dev.dev_path);
+    unsigned int            live_idx;
+    int                     written_num;
+
+    if (live.err != NULL)
+        tcm_err(PY_STRING("Unable to read live object: ") + live.err);
+
+    // Backing device can not be changed in place
+    if (live.udev_path != dev.udev_path)
+    {
+        tcm_freevirtdev(dev.dev_path);
+        tcm_restore_create(dev);
+        return "recreated";
+    }
+
+    written_num = tcm_restore_write_attrs(dev, full_path + "/attrib/", dev.attrs, true);
+    if (written_num > 0)
+        changes.push_back(PY_STRING().format("%d attributes", written_num));
+
+    if ((dev.wwn.len() > 0) && (live.serial != dev.wwn))
+    {
+        tcm_set_wwn_unit_serial_with_md(dev.dev_path, dev.wwn);
+        changes.push_back("serial");
+    }
+
+    // ALUA groups not in plan are removed, default group can not be
+    for (live_idx = 0; live_idx < live.tpgs.size(); live_idx ++)
+    {
+        unsigned int tpg_idx;
+
+        if (live.tpgs[live_idx].name == "default_tg_pt_gp")
+            continue;
+        for (tpg_idx = 0; (tpg_idx < dev.tpgs.size()) && (dev.tpgs[tpg_idx].name != live.tpgs[live_idx].name); tpg_idx ++);
+        if (tpg_idx == dev.tpgs.size())
+        {
+            tcm_del_alua_tgptgp(dev.dev_path, live.tpgs[live_idx].name);
+            changes.push_back(PY_STRING("-") + live.tpgs[live_idx].name);
+        }
+    }
+
+    for (unsigned int tpg_idx = 0; tpg_idx < dev.tpgs.size(); tpg_idx ++)
+    {
+        TCM_RESTORE_TPG & tpg = dev.tpgs[tpg_idx];
+
+        for (live_idx = 0; (live_idx < live.tpgs.size()) && (live.tpgs[live_idx].name != tpg.name); live_idx ++);
+        if ((live_idx == live.tpgs.size()) || (live.tpgs[live_idx].id != tpg.id))
+        {
+            if ((live_idx < live.tpgs.size()) && (tpg.name != "default_tg_pt_gp"))
+                tcm_del_alua_tgptgp(dev.dev_path, tpg.name);
+            tcm_add_alua_tgptgp_with_md(dev.dev_path, tpg.name, tpg.id);
+            changes.push_back(PY_STRING("+") + tpg.name);
+        }
+
+        written_num = tcm_restore_write_attrs(dev, full_path + "/alua/" + tpg.name + "/", tpg.attrs, true);
+        if (written_num > 0)
+            changes.push_back(PY_STRING().format("%d %s attributes", written_num, (char *)tpg.name));
+    }
+
+    if (changes.size() == 0)
+        return "unchanged";
+    return PY_STRING("updated (") + PY_STRING(", ").join(changes) + ")";
+}
+
+static void tcm_reconcile_dev(void * ctx, int idx)
+{
+    TCM_RESTORE_DEV & dev = (*(TCM_RESTORE_PLAN *) ctx)[idx];
+
+    try
+    {
+        if (dev.live == NULL)
+        {
+            tcm_restore_create(dev);
+            dev.changes = "created";
+        }
+        else
+            dev.changes = tcm_reconcile_update(dev);
+    }
+    catch (std::exception const & e)
+    {
+        dev.err = e.what();
+        if (dev.err == NULL)
+            dev.err = "failed";
+    }
+}
+
+static void tcm_reconcile_free(void * ctx, int idx)
+{
+    TCM_RESTORE_DEV & dev = (*(TCM_RESTORE_PLAN *) ctx)[idx];
+
+    try
+    {
+        tcm_freevirtdev(dev.dev_path);
+        dev.changes = "deleted";
+    }
+    catch (std::exception const & e)
+    {
+        dev.err = e.what();
+        if (dev.err == NULL)
+            dev.err = "failed";
+    }
+}
+
+void tcm_reconcile(char * filename, int jobs)
+{
+    TCM_RESTORE_PLAN    plan;
+    TCM_RESTORE_PLAN    dels;
+    TCM_RESTORE_DEV     del;
+    TCM_STATE           state;
+    MAP_PY_STRING       live_idx;                   // Name of live object -> index in state.devs
+    MAP_PY_STRING_IT    it;
+    LIST_PY_STRING      gs;
+    LIST_PY_STRING_IT   gs_it;
+    int                 hba_idx = 0;
+    int                 failed_num;
+    int                 unchanged_num = 0;
+    double              start = _py_time_monotonic();
+
+    tcm_restore_load("RECONCILE", filename, plan);
+
+    try
+    {
+        tcm_state_read(state, jobs);
+    }
+    catch (std::exception const & e)
+    {
+        tcm_err(PY_STRING("Unable to read live configuration: ") + e.what());
+    }
+
+    // Only iblock objects are managed, first object of a name is matched and others are deleted
+    for (unsigned int idx = 0; idx < state.devs.size(); idx ++)
+    {
+        if (!PY_STRING_VIEW(state.devs[idx].hba).starts_with("iblock_"))
+            continue;
+        if (live_idx.find(state.devs[idx].name) == live_idx.end())
+            live_idx[state.devs[idx].name] = PY_STRING().format("%u", idx);
+        else
+        {
+            del = TCM_RESTORE_DEV();
+            del.dev_path = state.devs[idx].dev_path;
+            dels.push_back(del);
+        }
+    }
+
+    for (unsigned int idx = 0; idx < plan.size(); idx ++)
+    {
+        TCM_RESTORE_DEV & dev = plan[idx];
+
+        it = live_idx.find(dev.name);
+        if (it != live_idx.end())
+        {
+            dev.live = &state.devs[atoi(it->second)];
+            dev.dev_path = dev.live->dev_path;
+            live_idx.erase(it);
+            continue;
+        }
+
+        // New object gets unused HBA
+        dev.live = NULL;
+        for (;; hba_idx ++)
+        {
+            gs_it = state.hbas.begin();
+            for (; (gs_it != state.hbas.end()) && (*gs_it != PY_STRING().format("iblock_%d", hba_idx)); gs_it ++);
+            if (gs_it == state.hbas.end())
+                break;
+        }
+        dev.dev_path = PY_STRING().format("iblock_%d/%s", hba_idx ++, (char *)dev.name);
+    }
+
+    for (it = live_idx.begin(); it != live_idx.end(); it ++)
+    {
+        del = TCM_RESTORE_DEV();
+        del.dev_path = state.devs[atoi(it->second)].dev_path;
+        dels.push_back(del);
+    }
+
+    // Deleted objects free their names before objects are created
+    tcm_pool_run(jobs, dels.size(), tcm_reconcile_free, &dels);
+    tcm_pool_run(jobs, plan.size(), tcm_reconcile_dev, &plan);
+
+    // HBAs left without objects are removed
+    for (unsigned int idx = 0; idx < dels.size(); idx ++)
+    {
+        PY_STRING_VIEW  hba;
+        PY_STRING       hba_path;
+
+        PY_STRING_TOKENIZER(dels[idx].dev_path, '/').next(hba);
+        hba_path = tcm_full_path(hba.str());
+        try
+        {
+            gs = tcm_cfs_listdir(hba_path);
+            for (gs_it = gs.begin(); (gs_it != gs.end()) && ((*gs_it == "hba_info") || (*gs_it == "hba_mode")); gs_it ++);
+            if (gs_it == gs.end())
+                tcm_cfs_rmdir(hba_path);
+        }
+        catch (std::exception const & e)
+        {
+        }
+    }
+
+    failed_num = tcm_restore_report("RECONCILE", dels) + tcm_restore_report("RECONCILE", plan);
+    for (unsigned int idx = 0; idx < plan.size(); idx ++)
+        if (plan[idx].changes == "unchanged")
+            unchanged_num ++;
+
+    tcm_printf("RECONCILE: %d storage objects, %d unchanged, %d deleted in %.3f ms, %d failed\n",
+               (int)plan.size(), unchanged_num, (int)dels.size(), (_py_time_monotonic() - start) * 1000, failed_num);
+    if (failed_num > 0)
+        tcm_err(PY_STRING().format("Unable to reconcile %d storage objects", failed_num));
+}
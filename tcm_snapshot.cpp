@@ -0,0 +1,450 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+// Binary boot snapshot of iblock storage objects
+//
+// Save reads live configuration, ALUA metadata and APTPL metadata once and
+// writes them as offset indexed records.  Restore maps the file, checks it
+// and passes strings of the mapping straight to createvirtdev, serial and
+// ALUA operations, so nothing is parsed or copied at boot.  HBAs are
+// restored in parallel on the worker pool, devices of a HBA in order.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "_py.h"
+#include "tcm_ops.h"
+#include "tcm_pool.h"
+#include "tcm_snapshot.h"
+#include "tcm_state.h"
+
+#define TCM_SNAPSHOT_FNV_BASIS  2166136261u
+#define TCM_SNAPSHOT_FNV_PRIME  16777619u
+
+static uint32_t tcm_snapshot_fnv(uint32_t hash, const char * data, size_t len)
+{
+    for (size_t idx = 0; idx < len; idx ++)
+    {
+        hash ^= (unsigned char)data[idx];
+        hash *= TCM_SNAPSHOT_FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t tcm_snapshot_checksum(const char * data, size_t len)
+{
+    uint32_t hash;
+
+    hash = tcm_snapshot_fnv(TCM_SNAPSHOT_FNV_BASIS, data, offsetof(TCM_SNAPSHOT_HEADER, checksum));
+    return tcm_snapshot_fnv(hash, data + sizeof(TCM_SNAPSHOT_HEADER), len - sizeof(TCM_SNAPSHOT_HEADER));
+}
+
+//
+// Save
+//
+
+typedef struct
+{
+    std::vector<char>   strs;                   // String area
+    uint32_t            base;                   // Offset of string area in file
+    uint32_t            aptpl_num;
+} TCM_SNAPSHOT_BUILD;
+
+// Appends string, returns its offset in file, 0 for empty string
+static uint32_t tcm_snapshot_string(TCM_SNAPSHOT_BUILD & build, const char * str)
+{
+    uint32_t offset;
+
+    if ((str == NULL) || (*str == '\0'))
+        return 0;
+
+    offset = build.base + build.strs.size();
+    build.strs.insert(build.strs.end(), str, str + strlen(str) + 1);
+    return offset;
+}
+
+static void tcm_snapshot_aptpl(void * ctx, const PY_STRING & reg)
+{
+    TCM_SNAPSHOT_BUILD & build = *(TCM_SNAPSHOT_BUILD *) ctx;
+
+    // Empty registration would end the list early, it is not written at restore either way
+    if (reg.len() == 0)
+        return;
+    tcm_snapshot_string(build, reg);
+    build.aptpl_num ++;
+}
+
+// Adds APTPL registrations of device as consecutive strings
+static void tcm_snapshot_save_aptpl(TCM_SNAPSHOT_BUILD & build, const TCM_STATE_DEV & dev, TCM_SNAPSHOT_DEV & rec)
+{
+    PY_STRING   aptpl_file;
+    PY_MMAP     aptpl;
+
+    if (dev.serial.len() == 0)
+        return;
+
+    aptpl_file = tcm_var_path("pr/aptpl_") + dev.serial;
+    if (!_py_os_path_isfile(aptpl_file))
+        return;
+
+    try
+    {
+        aptpl.open(aptpl_file);
+    }
+    catch (_py_IOError const & e)
+    {
+        tcm_err(PY_STRING().format("%s %s", (char *)aptpl_file, e.what()));
+    }
+
+    build.aptpl_num = 0;
+    rec.aptpl = build.base + build.strs.size();
+    tcm_aptpl_parse(aptpl.view(), tcm_snapshot_aptpl, &build);
+    rec.aptpl_num = build.aptpl_num;
+    if (rec.aptpl_num == 0)
+        rec.aptpl = 0;
+}
+
+static void tcm_snapshot_save_tpg(TCM_SNAPSHOT_BUILD & build, const TCM_STATE_DEV & dev, const TCM_STATE_TPG & tpg, TCM_SNAPSHOT_TPG & rec)
+{
+    MAP_PY_STRING       md;
+    MAP_PY_STRING_IT    md_it;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.name = tcm_snapshot_string(build, tpg.name);
+    rec.id = tcm_snapshot_string(build, tpg.id);
+    if ((rec.name == 0) || (rec.id == 0))
+        tcm_err(PY_STRING().format("ALUA group %s of %s has no tg_pt_gp_id", (char *)tpg.name, (char *)dev.dev_path));
+
+    if ((dev.serial.len() == 0) || !tcm_alua_read_metadata(dev.serial, tpg.name, md))
+        return;
+
+    md_it = md.find(PY_STRING("alua_access_state"));
+    if (md_it != md.end())
+        rec.access_state = tcm_snapshot_string(build, md_it->second);
+
+    md_it = md.find(PY_STRING("alua_access_status"));
+    if (md_it != md.end())
+        rec.access_status = tcm_snapshot_string(build, md_it->second);
+}
+
+void tcm_snapshot_save(char * filename, int jobs)
+{
+    TCM_STATE                       state;
+    std::vector<TCM_STATE_DEV *>    devs;
+    std::vector<TCM_SNAPSHOT_HBA>   hba_recs;
+    std::vector<TCM_SNAPSHOT_DEV>   dev_recs;
+    std::vector<TCM_SNAPSHOT_TPG>   tpg_recs;
+    TCM_SNAPSHOT_HEADER             header;
+    TCM_SNAPSHOT_BUILD              build;
+    TCM_SNAPSHOT_HBA                hba_rec;
+    TCM_SNAPSHOT_DEV                dev_rec;
+    TCM_SNAPSHOT_TPG                tpg_rec;
+    std::vector<char>               data;
+    PY_STRING                       tmp_filename;
+    PY_STRING                       dir_name;
+    PY_FILE                         f;
+    const char *                    slash;
+    unsigned int                    tpgs_num = 0;
+    double                          start = _py_time_monotonic();
+
+    tcm_state_read(state, jobs);
+
+    // Only iblock devices are restored by udev_path
+    for (unsigned int idx = 0; idx < state.devs.size(); idx ++)
+    {
+        TCM_STATE_DEV & dev = state.devs[idx];
+
+        if (dev.err != NULL)
+            tcm_err(PY_STRING().format("Unable to read %s: %s", (char *)dev.dev_path, (char *)dev.err));
+        if (!PY_STRING_VIEW(dev.hba).starts_with("iblock_") || (dev.udev_path.len() == 0))
+        {
+            tcm_printf("SNAPSHOT: %s: not an established iblock device, skipped\n", (char *)dev.dev_path);
+            continue;
+        }
+        devs.push_back(&dev);
+        tpgs_num += dev.tpgs.size();
+        if ((hba_recs.size() == 0) || (state.devs[idx].hba != (*devs[hba_recs.back().devs_first]).hba))
+        {
+            memset(&hba_rec, 0, sizeof(hba_rec));
+            hba_rec.devs_first = devs.size() - 1;
+            hba_recs.push_back(hba_rec);
+        }
+        hba_recs.back().devs_num ++;
+    }
+
+    // Tables first, strings after them
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TCM_SNAPSHOT_MAGIC, sizeof(TCM_SNAPSHOT_MAGIC));
+    header.version = TCM_SNAPSHOT_VERSION;
+    header.hbas = sizeof(TCM_SNAPSHOT_HEADER);
+    header.hbas_num = hba_recs.size();
+    header.devs = header.hbas + header.hbas_num * sizeof(TCM_SNAPSHOT_HBA);
+    header.devs_num = devs.size();
+    header.tpgs = header.devs + header.devs_num * sizeof(TCM_SNAPSHOT_DEV);
+    header.tpgs_num = tpgs_num;
+    build.base = header.tpgs + header.tpgs_num * sizeof(TCM_SNAPSHOT_TPG);
+
+    for (unsigned int idx = 0; idx < hba_recs.size(); idx ++)
+        hba_recs[idx].name = tcm_snapshot_string(build, devs[hba_recs[idx].devs_first]->hba);
+
+    for (unsigned int idx = 0; idx < devs.size(); idx ++)
+    {
+        TCM_STATE_DEV & dev = *devs[idx];
+
+        memset(&dev_rec, 0, sizeof(dev_rec));
+        dev_rec.dev_path = tcm_snapshot_string(build, dev.dev_path);
+        dev_rec.udev_path = tcm_snapshot_string(build, dev.udev_path);
+        dev_rec.serial = tcm_snapshot_string(build, dev.serial);
+        dev_rec.tpgs_first = tpg_recs.size();
+        dev_rec.tpgs_num = dev.tpgs.size();
+        tcm_snapshot_save_aptpl(build, dev, dev_rec);
+        dev_recs.push_back(dev_rec);
+
+        for (unsigned int tpg_idx = 0; tpg_idx < dev.tpgs.size(); tpg_idx ++)
+        {
+            tcm_snapshot_save_tpg(build, dev, dev.tpgs[tpg_idx], tpg_rec);
+            tpg_recs.push_back(tpg_rec);
+        }
+    }
+
+    // File ends with NUL, so every string of a checked file is terminated
+    if (build.strs.size() == 0)
+        build.strs.push_back('\0');
+
+    header.size = build.base + build.strs.size();
+    data.resize(header.size);
+    memcpy(&data[0], &header, sizeof(header));
+    if (hba_recs.size() > 0)
+        memcpy(&data[header.hbas], &hba_recs[0], hba_recs.size() * sizeof(TCM_SNAPSHOT_HBA));
+    if (dev_recs.size() > 0)
+        memcpy(&data[header.devs], &dev_recs[0], dev_recs.size() * sizeof(TCM_SNAPSHOT_DEV));
+    if (tpg_recs.size() > 0)
+        memcpy(&data[header.tpgs], &tpg_recs[0], tpg_recs.size() * sizeof(TCM_SNAPSHOT_TPG));
+    memcpy(&data[build.base], &build.strs[0], build.strs.size());
+
+    header.checksum = tcm_snapshot_checksum(&data[0], data.size());
+    memcpy(&data[offsetof(TCM_SNAPSHOT_HEADER, checksum)], &header.checksum, sizeof(header.checksum));
+
+    // Replaced at once, boot never sees partly written snapshot.  Data is on
+    // storage before rename and rename before return, also across power loss.
+    tmp_filename = PY_STRING(filename) + ".tmp";
+    slash = strrchr(filename, '/');
+    if (slash == NULL)
+        dir_name = ".";
+    else if (slash == filename)
+        dir_name = "/";
+    else
+        dir_name = PY_STRING(filename, slash - filename);
+    try
+    {
+        f.open(tmp_filename, "w");
+        f.write(&data[0], data.size());
+        f.fsync();
+        f.close();
+        _py_os_rename(tmp_filename, filename);
+        f.open(dir_name, "r");
+        f.fsync();
+        f.close();
+    }
+    catch (std::exception const & e)
+    {
+        tcm_err(PY_STRING().format("%s: %s", filename, e.what()));
+    }
+
+    tcm_printf("SNAPSHOT: saved %d storage objects to %s (%d bytes) in %.3f ms\n",
+               (int)devs.size(), filename, (int)data.size(), (_py_time_monotonic() - start) * 1000);
+}
+
+//
+// Restore
+//
+
+typedef struct
+{
+    const char *                    data;
+    uint32_t                        len;
+    const TCM_SNAPSHOT_HEADER *     header;
+    const TCM_SNAPSHOT_HBA *        hbas;
+    const TCM_SNAPSHOT_DEV *        devs;
+    const TCM_SNAPSHOT_TPG *        tpgs;
+    std::vector<PY_STRING>          errs;       // Error of each device, empty if restored
+} TCM_SNAPSHOT;
+
+// String of mapped file, NULL for offset 0
+static char * tcm_snapshot_str(const TCM_SNAPSHOT & snap, uint32_t offset)
+{
+    if (offset == 0)
+        return NULL;
+    return (char *)snap.data + offset;
+}
+
+static bool tcm_snapshot_check_table(const TCM_SNAPSHOT & snap, uint32_t offset, uint32_t num, size_t rec_size)
+{
+    return (offset >= sizeof(TCM_SNAPSHOT_HEADER)) && (offset % sizeof(uint32_t) == 0) &&
+           (offset <= snap.len) && (num <= (snap.len - offset) / rec_size);
+}
+
+static bool tcm_snapshot_check_str(const TCM_SNAPSHOT & snap, uint32_t offset, bool required)
+{
+    if (offset == 0)
+        return !required;
+    return (offset >= snap.header->tpgs + snap.header->tpgs_num * sizeof(TCM_SNAPSHOT_TPG)) && (offset < snap.len);
+}
+
+// Returns NULL if snapshot can be restored, otherwise reason
+static const char * tcm_snapshot_check(TCM_SNAPSHOT & snap)
+{
+    const TCM_SNAPSHOT_HEADER & header = *snap.header;
+    uint32_t                    offset;
+
+    if ((snap.len < sizeof(TCM_SNAPSHOT_HEADER)) || (0 != memcmp(header.magic, TCM_SNAPSHOT_MAGIC, sizeof(TCM_SNAPSHOT_MAGIC))))
+        return "not a snapshot";
+    if (header.version != TCM_SNAPSHOT_VERSION)
+        return "other version";
+    if ((header.size != snap.len) || (snap.data[snap.len - 1] != '\0'))
+        return "truncated";
+    if (header.checksum != tcm_snapshot_checksum(snap.data, snap.len))
+        return "checksum mismatch";
+
+    if (!tcm_snapshot_check_table(snap, header.hbas, header.hbas_num, sizeof(TCM_SNAPSHOT_HBA)) ||
+        !tcm_snapshot_check_table(snap, header.devs, header.devs_num, sizeof(TCM_SNAPSHOT_DEV)) ||
+        !tcm_snapshot_check_table(snap, header.tpgs, header.tpgs_num, sizeof(TCM_SNAPSHOT_TPG)))
+        return "bad table";
+
+    snap.hbas = (const TCM_SNAPSHOT_HBA *)(snap.data + header.hbas);
+    snap.devs = (const TCM_SNAPSHOT_DEV *)(snap.data + header.devs);
+    snap.tpgs = (const TCM_SNAPSHOT_TPG *)(snap.data + header.tpgs);
+
+    for (uint32_t idx = 0; idx < header.hbas_num; idx ++)
+    {
+        const TCM_SNAPSHOT_HBA & hba = snap.hbas[idx];
+
+        if (!tcm_snapshot_check_str(snap, hba.name, true) ||
+            (hba.devs_first > header.devs_num) || (hba.devs_num > header.devs_num - hba.devs_first))
+            return "bad HBA record";
+    }
+
+    for (uint32_t idx = 0; idx < header.devs_num; idx ++)
+    {
+        const TCM_SNAPSHOT_DEV & dev = snap.devs[idx];
+
+        if (!tcm_snapshot_check_str(snap, dev.dev_path, true) ||
+            !tcm_snapshot_check_str(snap, dev.udev_path, true) ||
+            !tcm_snapshot_check_str(snap, dev.serial, false) ||
+            (dev.tpgs_first > header.tpgs_num) || (dev.tpgs_num > header.tpgs_num - dev.tpgs_first))
+            return "bad device record";
+
+        // Registrations must all start inside of file
+        offset = dev.aptpl;
+        for (uint32_t reg_idx = 0; reg_idx < dev.aptpl_num; reg_idx ++)
+        {
+            if (!tcm_snapshot_check_str(snap, offset, true))
+                return "bad APTPL record";
+            offset += strlen(snap.data + offset) + 1;
+        }
+    }
+
+    for (uint32_t idx = 0; idx < header.tpgs_num; idx ++)
+    {
+        const TCM_SNAPSHOT_TPG & tpg = snap.tpgs[idx];
+
+        if (!tcm_snapshot_check_str(snap, tpg.name, true) ||
+            !tcm_snapshot_check_str(snap, tpg.id, true) ||
+            !tcm_snapshot_check_str(snap, tpg.access_state, false) ||
+            !tcm_snapshot_check_str(snap, tpg.access_status, false))
+            return "bad ALUA group record";
+    }
+
+    return NULL;
+}
+
+static void tcm_snapshot_restore_dev(TCM_SNAPSHOT & snap, const TCM_SNAPSHOT_DEV & dev)
+{
+    char * dev_path = tcm_snapshot_str(snap, dev.dev_path);
+    char * serial = tcm_snapshot_str(snap, dev.serial);
+
+    // Unit serial is generated only if snapshot has none
+    tcm_createvirtdev(dev_path, tcm_snapshot_str(snap, dev.udev_path), serial != NULL);
+
+    if (serial != NULL)
+        tcm_set_wwn_unit_serial_with_md(dev_path, serial, tcm_snapshot_str(snap, dev.aptpl), dev.aptpl_num);
+
+    for (uint32_t idx = dev.tpgs_first; idx < dev.tpgs_first + dev.tpgs_num; idx ++)
+    {
+        const TCM_SNAPSHOT_TPG & tpg = snap.tpgs[idx];
+
+        tcm_add_alua_tgptgp_with_md(dev_path, tcm_snapshot_str(snap, tpg.name), tcm_snapshot_str(snap, tpg.id),
+                                    tcm_snapshot_str(snap, tpg.access_state), tcm_snapshot_str(snap, tpg.access_status));
+    }
+}
+
+static void tcm_snapshot_restore_hba(void * ctx, int idx)
+{
+    TCM_SNAPSHOT &              snap = *(TCM_SNAPSHOT *) ctx;
+    const TCM_SNAPSHOT_HBA &    hba = snap.hbas[idx];
+
+    for (uint32_t dev_idx = hba.devs_first; dev_idx < hba.devs_first + hba.devs_num; dev_idx ++)
+    {
+        try
+        {
+            tcm_snapshot_restore_dev(snap, snap.devs[dev_idx]);
+        }
+        catch (std::exception const & e)
+        {
+            snap.errs[dev_idx] = e.what();
+            if (snap.errs[dev_idx] == NULL)
+                snap.errs[dev_idx] = "failed";
+        }
+    }
+}
+
+void tcm_snapshot_restore(char * filename, int jobs)
+{
+    TCM_SNAPSHOT    snap;
+    PY_MMAP         file;
+    const char *    reason;
+    int             failed_num = 0;
+    double          start = _py_time_monotonic();
+
+    try
+    {
+        file.open(filename);
+    }
+    catch (std::exception const & e)
+    {
+        tcm_err(PY_STRING().format("%s: %s", filename, e.what()));
+    }
+
+    snap.data = file.data();
+    snap.len = file.len();
+    snap.header = (const TCM_SNAPSHOT_HEADER *) snap.data;
+    reason = (snap.data == NULL) ? "empty" : tcm_snapshot_check(snap);
+    if (reason != NULL)
+        tcm_err(PY_STRING().format("%s: snapshot rejected, %s", filename, reason));
+
+    snap.errs.resize(snap.header->devs_num);
+    tcm_pool_run(jobs, snap.header->hbas_num, tcm_snapshot_restore_hba, &snap);
+
+    for (uint32_t idx = 0; idx < snap.header->devs_num; idx ++)
+    {
+        char * dev_path = tcm_snapshot_str(snap, snap.devs[idx].dev_path);
+
+        if (snap.errs[idx] != NULL)
+        {
+            tcm_printf("SNAPSHOT: %s: FAILED (%s)\n", dev_path, (char *)snap.errs[idx]);
+            failed_num ++;
+        }
+        else
+            tcm_printf("SNAPSHOT: %s: OK\n", dev_path);
+    }
+
+    tcm_printf("SNAPSHOT: %d storage objects in %.3f ms, %d failed\n",
+               (int)snap.header->devs_num, (_py_time_monotonic() - start) * 1000, failed_num);
+    if (failed_num > 0)
+        tcm_err(PY_STRING().format("Unable to restore %d storage objects", failed_num));
+}
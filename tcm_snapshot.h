@@ -0,0 +1,73 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_SNAPSHOT_H_
+#define _TCM_SNAPSHOT_H_ 1
+
+#include <stdint.h>
+
+//
+// Binary boot snapshot
+//
+// File is TCM_SNAPSHOT_HEADER followed by tables of TCM_SNAPSHOT_HBA,
+// TCM_SNAPSHOT_DEV and TCM_SNAPSHOT_TPG records and by NUL terminated
+// strings.  Strings are referenced by offset from start of file, 0 is no
+// string.  Devices of a HBA and groups of a device are consecutive records
+// of their tables.  APTPL registrations of a device are consecutive strings,
+// already joined as written to res_aptpl_metadata.
+//
+// Numbers are in byte order of the node that wrote the file.  Files of other
+// version, byte order, size or checksum are rejected.
+//
+
+#define TCM_SNAPSHOT_MAGIC      "TCMSNAP"
+#define TCM_SNAPSHOT_VERSION    1
+
+typedef struct
+{
+    char        magic[8];               // TCM_SNAPSHOT_MAGIC
+    uint32_t    version;                // TCM_SNAPSHOT_VERSION
+    uint32_t    size;                   // Bytes of whole file
+    uint32_t    hbas;                   // Offset of TCM_SNAPSHOT_HBA table
+    uint32_t    hbas_num;
+    uint32_t    devs;                   // Offset of TCM_SNAPSHOT_DEV table
+    uint32_t    devs_num;
+    uint32_t    tpgs;                   // Offset of TCM_SNAPSHOT_TPG table
+    uint32_t    tpgs_num;
+    uint32_t    checksum;               // FNV-1a of whole file without this field
+} TCM_SNAPSHOT_HEADER;
+
+typedef struct
+{
+    uint32_t    name;                   // e.g. iblock_0
+    uint32_t    devs_first;             // Index into TCM_SNAPSHOT_DEV table
+    uint32_t    devs_num;
+} TCM_SNAPSHOT_HBA;
+
+typedef struct
+{
+    uint32_t    dev_path;               // hba/name
+    uint32_t    udev_path;
+    uint32_t    serial;
+    uint32_t    tpgs_first;             // Index into TCM_SNAPSHOT_TPG table
+    uint32_t    tpgs_num;
+    uint32_t    aptpl;                  // First APTPL registration
+    uint32_t    aptpl_num;
+} TCM_SNAPSHOT_DEV;
+
+typedef struct
+{
+    uint32_t    name;
+    uint32_t    id;                     // tg_pt_gp_id
+    uint32_t    access_state;           // From ALUA metadata, 0 if not set
+    uint32_t    access_status;          // From ALUA metadata, 0 if not set
+} TCM_SNAPSHOT_TPG;
+
+void tcm_snapshot_save      (char * filename, int jobs);    // Writes snapshot of live iblock devices and their metadata
+void tcm_snapshot_restore   (char * filename, int jobs);    // Creates devices of snapshot, HBAs in parallel on jobs threads
+
+#endif /* _TCM_SNAPSHOT_H_ */
@@ -0,0 +1,339 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_ops.h"
+#include "tcm_pool.h"
+#include "tcm_state.h"
+
+// Context of tcm_state_read_dev()
+typedef struct
+{
+    std::vector<TCM_STATE_DEV> *    devs;
+    bool                            attrs;
+} TCM_STATE_READ;
+
+PY_STRING tcm_state_attr(const char * path)
+{
+    PY_FILE     f;
+    PY_STRING   value;
+
+    tcm_cfs_open(f, path, "r");
+    value = f.read();
+    f.close();
+
+    return value.strip();
+}
+
+// Reads all readable files of directory sorted by name, write-only ones are skipped
+static void tcm_state_read_attrs(const PY_STRING & dir_path, TCM_STATE_ATTRS & attrs)
+{
+    LIST_PY_STRING      names;
+    LIST_PY_STRING_IT   names_it;
+    TCM_STATE_ATTR      attr;
+
+    names = tcm_cfs_listdir(dir_path);
+    names.sort();
+    for (names_it = names.begin(); names_it != names.end(); names_it ++)
+    {
+        if (!tcm_cfs_isfile(dir_path + *names_it))
+            continue;
+        try
+        {
+            attr.name = *names_it;
+            attr.value = tcm_state_attr(dir_path + *names_it);
+            attrs.push_back(attr);
+        }
+        catch (_py_IOError const & e)
+        {
+        }
+    }
+}
+
+// Returns value of read attribute, NULL if missing
+static PY_STRING tcm_state_find(const TCM_STATE_ATTRS & attrs, const char * name)
+{
+    for (unsigned int idx = 0; idx < attrs.size(); idx ++)
+        if (attrs[idx].name == name)
+            return attrs[idx].value;
+    return PY_STRING();
+}
+
+static void tcm_state_read_dev(void * ctx, int idx)
+{
+    TCM_STATE_READ &    read = *(TCM_STATE_READ *) ctx;
+    TCM_STATE_DEV &     dev = (*read.devs)[idx];
+    PY_STRING           full_path = tcm_full_path(dev.dev_path);
+    PY_STRING           serial;
+    PY_STRING_VIEW      item;
+    LIST_PY_STRING      gps;
+    LIST_PY_STRING_IT   gps_it;
+    TCM_STATE_TPG       tpg;
+
+    try
+    {
+        // With attributes each file is read once and known values are taken from them
+        if (read.attrs)
+        {
+            tcm_state_read_attrs(full_path + "/", dev.attrs);
+            tcm_state_read_attrs(full_path + "/attrib/", dev.attrib);
+            tcm_state_read_attrs(full_path + "/wwn/", dev.wwn);
+            dev.udev_path = tcm_state_find(dev.attrs, "udev_path");
+            serial = tcm_state_find(dev.wwn, "vpd_unit_serial");
+        }
+        else
+        {
+            if (tcm_cfs_isfile(full_path + "/udev_path"))
+                dev.udev_path = tcm_state_attr(full_path + "/udev_path");
+            serial = tcm_state_attr(full_path + "/wwn/vpd_unit_serial");
+        }
+
+        // Format is "T10 VPD Unit Serial Number: <serial>"
+        PY_STRING_TOKENIZER items(serial, ':');
+        if (items.next(item) && items.next(item))
+            dev.serial = item.strip().str();
+
+        gps = tcm_cfs_listdir(full_path + "/alua/");
+        gps.sort();
+        for (gps_it = gps.begin(); gps_it != gps.end(); gps_it ++)
+        {
+            tpg = TCM_STATE_TPG();
+            tpg.name = *gps_it;
+            if (read.attrs)
+            {
+                tcm_state_read_attrs(full_path + "/alua/" + *gps_it + "/", tpg.attrs);
+                tpg.id = tcm_state_find(tpg.attrs, "tg_pt_gp_id");
+            }
+            else
+                tpg.id = tcm_state_attr(full_path + "/alua/" + *gps_it + "/tg_pt_gp_id");
+            dev.tpgs.push_back(tpg);
+        }
+    }
+    catch (std::exception const & e)
+    {
+        dev.err = e.what();
+        if (dev.err == NULL)
+            dev.err = "failed";
+    }
+}
+
+static bool tcm_state_dev_less(const TCM_STATE_DEV & a, const TCM_STATE_DEV & b)
+{
+    if (a.hba != b.hba)
+        return a.hba < b.hba;
+    return a.name < b.name;
+}
+
+void tcm_state_read(TCM_STATE & state, int jobs, bool attrs)
+{
+    PY_STRING           root = tcm_full_path("");
+    LIST_PY_STRING      hbas;
+    LIST_PY_STRING_IT   hbas_it;
+    LIST_PY_STRING      devs;
+    LIST_PY_STRING_IT   devs_it;
+    TCM_STATE_DEV       dev;
+    TCM_STATE_READ      read;
+
+    state.hbas.clear();
+    state.devs.clear();
+
+    hbas = tcm_cfs_listdir(root);
+    hbas.sort();
+    for (hbas_it = hbas.begin(); hbas_it != hbas.end(); hbas_it ++)
+    {
+        if (*hbas_it == "alua")
+            continue;
+        state.hbas.push_back(*hbas_it);
+
+        devs = tcm_cfs_listdir(root + *hbas_it);
+        for (devs_it = devs.begin(); devs_it != devs.end(); devs_it ++)
+        {
+            if ((*devs_it == "hba_info") || (*devs_it == "hba_mode"))
+                continue;
+            dev = TCM_STATE_DEV();
+            dev.hba = *hbas_it;
+            dev.name = *devs_it;
+            dev.dev_path = *hbas_it + "/" + *devs_it;
+            state.devs.push_back(dev);
+        }
+    }
+
+    // Devices of a HBA stay together in order of state.hbas for dump
+    std::sort(state.devs.begin(), state.devs.end(), tcm_state_dev_less);
+
+    read.devs = &state.devs;
+    read.attrs = attrs;
+    tcm_pool_run(jobs, state.devs.size(), tcm_state_read_dev, &read);
+}
+
+//
+// Dump
+//
+
+// Appends value escaped for text dump, one attribute per line
+static void tcm_state_text(PY_STRING & out, const PY_STRING & path, const PY_STRING & value)
+{
+    const char *    begin = value.len() > 0 ? (char *)value : "";
+    const char *    str;
+
+    out += path;
+    out += " ";
+    for (str = begin; *str != '\0'; str ++)
+    {
+        if ((*str != '\n') && (*str != '\\'))
+            continue;
+        out += PY_STRING(begin, str - begin);
+        out += (*str == '\n') ? "\\n" : "\\\\";
+        begin = str + 1;
+    }
+    out += begin;
+    out += "\n";
+}
+
+static void tcm_state_text_attrs(PY_STRING & out, const PY_STRING & dir_path, const TCM_STATE_ATTRS & attrs)
+{
+    for (unsigned int idx = 0; idx < attrs.size(); idx ++)
+        tcm_state_text(out, dir_path + attrs[idx].name, attrs[idx].value);
+}
+
+// Appends JSON string
+static void tcm_state_json(PY_STRING & out, const PY_STRING & value)
+{
+    const char *    begin = value.len() > 0 ? (char *)value : "";
+    const char *    str;
+
+    out += "\"";
+    for (str = begin; *str != '\0'; str ++)
+    {
+        if ((*str != '"') && (*str != '\\') && ((unsigned char)*str >= 0x20))
+            continue;
+        out += PY_STRING(begin, str - begin);
+        if (*str == '\n')
+            out += "\\n";
+        else if (*str == '\t')
+            out += "\\t";
+        else if ((unsigned char)*str < 0x20)
+            out += PY_STRING().format("\\u%04x", (unsigned char)*str);
+        else
+            out += (*str == '"') ? "\\\"" : "\\\\";
+        begin = str + 1;
+    }
+    out += begin;
+    out += "\"";
+}
+
+static void tcm_state_json_attrs(PY_STRING & out, const TCM_STATE_ATTRS & attrs)
+{
+    out += "{";
+    for (unsigned int idx = 0; idx < attrs.size(); idx ++)
+    {
+        if (idx > 0)
+            out += ", ";
+        tcm_state_json(out, attrs[idx].name);
+        out += ": ";
+        tcm_state_json(out, attrs[idx].value);
+    }
+    out += "}";
+}
+
+static void tcm_state_dump_text(PY_STRING & out, TCM_STATE & state)
+{
+    LIST_PY_STRING_IT   hbas_it;
+    unsigned int        dev_idx = 0;
+
+    for (hbas_it = state.hbas.begin(); hbas_it != state.hbas.end(); hbas_it ++)
+    {
+        out += *hbas_it + "/\n";
+        for (; (dev_idx < state.devs.size()) && (state.devs[dev_idx].hba == *hbas_it); dev_idx ++)
+        {
+            TCM_STATE_DEV & dev = state.devs[dev_idx];
+
+            out += dev.dev_path + "/\n";
+            if (dev.err != NULL)
+            {
+                tcm_state_text(out, dev.dev_path + "/ ERROR", dev.err);
+                continue;
+            }
+            tcm_state_text_attrs(out, dev.dev_path + "/", dev.attrs);
+            tcm_state_text_attrs(out, dev.dev_path + "/attrib/", dev.attrib);
+            tcm_state_text_attrs(out, dev.dev_path + "/wwn/", dev.wwn);
+            for (unsigned int tpg_idx = 0; tpg_idx < dev.tpgs.size(); tpg_idx ++)
+                tcm_state_text_attrs(out, dev.dev_path + "/alua/" + dev.tpgs[tpg_idx].name + "/", dev.tpgs[tpg_idx].attrs);
+        }
+    }
+}
+
+static void tcm_state_dump_json(PY_STRING & out, TCM_STATE & state)
+{
+    LIST_PY_STRING_IT   hbas_it;
+    unsigned int        dev_idx = 0;
+    unsigned int        first_idx;
+
+    out += "{\"hbas\": [";
+    for (hbas_it = state.hbas.begin(); hbas_it != state.hbas.end(); hbas_it ++)
+    {
+        out += (hbas_it == state.hbas.begin()) ? "\n  {\"name\": " : ",\n  {\"name\": ";
+        tcm_state_json(out, *hbas_it);
+        out += ", \"devices\": [";
+        for (first_idx = dev_idx; (dev_idx < state.devs.size()) && (state.devs[dev_idx].hba == *hbas_it); dev_idx ++)
+        {
+            TCM_STATE_DEV & dev = state.devs[dev_idx];
+
+            out += (dev_idx == first_idx) ? "\n    {\"name\": " : ",\n    {\"name\": ";
+            tcm_state_json(out, dev.name);
+            if (dev.err != NULL)
+            {
+                out += ", \"error\": ";
+                tcm_state_json(out, dev.err);
+                out += "}";
+                continue;
+            }
+            out += ",\n     \"files\": ";
+            tcm_state_json_attrs(out, dev.attrs);
+            out += ",\n     \"attrib\": ";
+            tcm_state_json_attrs(out, dev.attrib);
+            out += ",\n     \"wwn\": ";
+            tcm_state_json_attrs(out, dev.wwn);
+            out += ",\n     \"alua\": {";
+            for (unsigned int tpg_idx = 0; tpg_idx < dev.tpgs.size(); tpg_idx ++)
+            {
+                out += (tpg_idx == 0) ? "\n      " : ",\n      ";
+                tcm_state_json(out, dev.tpgs[tpg_idx].name);
+                out += ": ";
+                tcm_state_json_attrs(out, dev.tpgs[tpg_idx].attrs);
+            }
+            out += "}}";
+        }
+        out += "]}";
+    }
+    out += "]}\n";
+}
+
+void tcm_state_dump(char * format, int jobs)
+{
+    TCM_STATE   state;
+    PY_STRING   out;
+
+    if ((0 != strcmp(format, "text")) && (0 != strcmp(format, "json")))
+        tcm_err(PY_STRING("Unknown dump format: ") + format);
+
+    tcm_state_read(state, jobs, true);
+
+    if (0 == strcmp(format, "json"))
+        tcm_state_dump_json(out, state);
+    else
+        tcm_state_dump_text(out, state);
+
+    fwrite((char *)out, 1, out.len(), stdout);
+    fflush(stdout);
+}
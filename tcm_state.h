@@ -0,0 +1,56 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_STATE_H_
+#define _TCM_STATE_H_ 1
+
+#include "_py.h"
+
+//
+// Live configuration read from configfs
+//
+
+typedef struct
+{
+    PY_STRING   name;
+    PY_STRING   value;                          // Stripped
+} TCM_STATE_ATTR;
+
+typedef std::vector<TCM_STATE_ATTR> TCM_STATE_ATTRS;
+
+typedef struct
+{
+    PY_STRING           name;
+    PY_STRING           id;                     // tg_pt_gp_id
+    TCM_STATE_ATTRS     attrs;                  // Read only with attributes
+} TCM_STATE_TPG;
+
+typedef struct
+{
+    PY_STRING                   hba;            // e.g. iblock_0
+    PY_STRING                   name;
+    PY_STRING                   dev_path;       // hba/name
+    PY_STRING                   udev_path;
+    PY_STRING                   serial;         // Unit serial without "T10 VPD Unit Serial Number:"
+    std::vector<TCM_STATE_TPG>  tpgs;
+    TCM_STATE_ATTRS             attrs;          // Files of device directory, read only with attributes
+    TCM_STATE_ATTRS             attrib;         // Read only with attributes
+    TCM_STATE_ATTRS             wwn;            // Read only with attributes
+    PY_STRING                   err;            // Error of reading device, empty if read
+} TCM_STATE_DEV;
+
+typedef struct
+{
+    LIST_PY_STRING              hbas;
+    std::vector<TCM_STATE_DEV>  devs;
+} TCM_STATE;
+
+void        tcm_state_read      (TCM_STATE & state, int jobs, bool attrs = false);  // throws _py_OSError, devices are read on jobs threads, sorted by name
+PY_STRING   tcm_state_attr      (const char * path);                        // Stripped attribute value, throws _py_IOError
+void        tcm_state_dump      (char * format, int jobs);                  // Prints live configuration with attributes as "text" or "json"
+
+#endif /* _TCM_STATE_H_ */
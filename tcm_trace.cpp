@@ -0,0 +1,191 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "_py.h"
+#include "tcm_trace.h"
+
+typedef struct
+{
+    const char *    name;
+    uint64_t        start_ns;
+    uint64_t        dur_ns;
+    char            arg[TCM_TRACE_ARG_BYTES];
+} TCM_TRACE_EVENT;
+
+typedef struct tcm_trace_ring
+{
+    struct tcm_trace_ring * next;
+    int                     tid;
+    uint64_t                events_num;             // Recorded since start, ring keeps last TCM_TRACE_RING_EVENTS
+    TCM_TRACE_EVENT         events[TCM_TRACE_RING_EVENTS];
+} TCM_TRACE_RING;
+
+bool                            tcm_trace_on = false;
+
+static uint64_t                 tcm_trace_start_ns = 0;
+static TCM_TRACE_RING *         tcm_trace_rings = NULL;             // Rings of all threads, kept after thread exit
+static pthread_mutex_t          tcm_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread TCM_TRACE_RING * tcm_trace_ring = NULL;
+
+#define TCM_TRACE_FLUSH_BYTES   (64 * 1024)
+
+void tcm_trace_start(void)
+{
+    if (tcm_trace_on)
+        return;
+    tcm_trace_start_ns = tcm_trace_now();
+    tcm_trace_on = true;
+}
+
+uint64_t tcm_trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns ring of calling thread, NULL if it can not be allocated
+static TCM_TRACE_RING * tcm_trace_ring_get(void)
+{
+    TCM_TRACE_RING * ring = tcm_trace_ring;
+
+    if (ring != NULL)
+        return ring;
+
+    ring = (TCM_TRACE_RING *) malloc(sizeof(TCM_TRACE_RING));
+    if (ring == NULL)
+        return NULL;
+    ring->tid = syscall(SYS_gettid);
+    ring->events_num = 0;
+
+    pthread_mutex_lock(&tcm_trace_mutex);
+    ring->next = tcm_trace_rings;
+    tcm_trace_rings = ring;
+    pthread_mutex_unlock(&tcm_trace_mutex);
+
+    tcm_trace_ring = ring;
+    return ring;
+}
+
+void tcm_trace_record(const char * name, const char * arg, uint64_t start_ns)
+{
+    TCM_TRACE_RING *    ring = tcm_trace_ring_get();
+    TCM_TRACE_EVENT *   event;
+    uint64_t            now = tcm_trace_now();
+
+    if (ring == NULL)
+        return;
+
+    event = &ring->events[ring->events_num % TCM_TRACE_RING_EVENTS];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->dur_ns = now - start_ns;
+    event->arg[0] = '\0';
+    if (arg != NULL)
+    {
+        strncpy(event->arg, arg, sizeof(event->arg) - 1);
+        event->arg[sizeof(event->arg) - 1] = '\0';
+    }
+    ring->events_num ++;
+}
+
+// Appends JSON string
+static void tcm_trace_json(PY_STRING & out, const char * begin)
+{
+    const char * str;
+
+    out += "\"";
+    for (str = begin; *str != '\0'; str ++)
+    {
+        if ((*str != '"') && (*str != '\\') && ((unsigned char)*str >= 0x20))
+            continue;
+        out += PY_STRING(begin, str - begin);
+        if ((unsigned char)*str < 0x20)
+            out += PY_STRING().format("\\u%04x", (unsigned char)*str);
+        else
+            out += (*str == '"') ? "\\\"" : "\\\\";
+        begin = str + 1;
+    }
+    out += begin;
+    out += "\"";
+}
+
+void tcm_trace_write(const char * filename)
+{
+    PY_FILE             f;
+    PY_STRING           out;
+    TCM_TRACE_RING *    ring;
+    TCM_TRACE_EVENT *   event;
+    uint64_t            first;
+    bool                comma = false;
+    int                 pid = getpid();
+
+    f.open(filename, "w");
+
+    // Timestamps are microseconds since tcm_trace_start()
+    out = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    pthread_mutex_lock(&tcm_trace_mutex);
+    try
+    {
+        for (ring = tcm_trace_rings; ring != NULL; ring = ring->next)
+        {
+            first = ring->events_num > TCM_TRACE_RING_EVENTS ? ring->events_num - TCM_TRACE_RING_EVENTS : 0;
+            for (; first < ring->events_num; first ++)
+            {
+                event = &ring->events[first % TCM_TRACE_RING_EVENTS];
+
+                out += comma ? ",\n" : "\n";
+                comma = true;
+                out += "{\"name\": ";
+                tcm_trace_json(out, event->name);
+                out += PY_STRING().format(", \"cat\": \"tcm\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                                          (event->start_ns - tcm_trace_start_ns) / 1e3, event->dur_ns / 1e3, pid, ring->tid);
+                if (event->arg[0] != '\0')
+                {
+                    out += ", \"args\": {\"arg\": ";
+                    tcm_trace_json(out, event->arg);
+                    out += "}";
+                }
+                out += "}";
+
+                if (out.len() >= TCM_TRACE_FLUSH_BYTES)
+                {
+                    f.write(out, out.len());
+                    out = PY_STRING();
+                }
+            }
+
+            // Events overwritten in ring are reported, so gaps in trace are not taken for idle time
+            if (ring->events_num > TCM_TRACE_RING_EVENTS)
+            {
+                out += comma ? ",\n" : "\n";
+                comma = true;
+                out += PY_STRING().format("{\"name\": \"dropped_events\", \"cat\": \"tcm\", \"ph\": \"i\", \"s\": \"t\", \"ts\": 0, "
+                                          "\"pid\": %d, \"tid\": %d, \"args\": {\"count\": %llu}}",
+                                          pid, ring->tid, (unsigned long long)(ring->events_num - TCM_TRACE_RING_EVENTS));
+            }
+        }
+    }
+    catch (...)
+    {
+        pthread_mutex_unlock(&tcm_trace_mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&tcm_trace_mutex);
+    out += "\n]}\n";
+
+    f.write(out, out.len());
+    f.close();
+}
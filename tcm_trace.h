@@ -0,0 +1,62 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#ifndef _TCM_TRACE_H_
+#define _TCM_TRACE_H_ 1
+
+#include <stdint.h>
+
+//
+// Tracing
+//
+// While tracing is on, TCM_TRACE_SPAN records its scope with monotonic
+// timestamps into a ring buffer of the calling thread, so threads never
+// contend.  Each ring keeps the last TCM_TRACE_RING_EVENTS spans.
+// tcm_trace_write() exports all rings in Chrome trace-event format
+// (chrome://tracing, Perfetto), it must not run concurrently with spans.
+//
+// Names must be string literals, args (e.g. configfs path) are copied and
+// truncated to TCM_TRACE_ARG_BYTES - 1 characters.  When tracing is off a
+// span costs a test of tcm_trace_on.
+//
+
+#define TCM_TRACE_RING_EVENTS   16384
+#define TCM_TRACE_ARG_BYTES     96
+
+extern bool tcm_trace_on;
+
+void        tcm_trace_start     (void);
+void        tcm_trace_write     (const char * filename);                    // throws _py_IOError
+uint64_t    tcm_trace_now       (void);                                     // Monotonic nanoseconds
+void        tcm_trace_record    (const char * name, const char * arg, uint64_t start_ns);  // Span from start_ns until now
+
+class TCM_TRACE_SPAN
+{
+public:
+    TCM_TRACE_SPAN(const char * name, const char * arg = 0)
+        : m_Name(name)
+        , m_Arg(arg)
+        , m_Start(tcm_trace_on ? tcm_trace_now() : 0)
+    {
+    }
+
+    ~TCM_TRACE_SPAN(void)
+    {
+        if (m_Start != 0)
+            tcm_trace_record(m_Name, m_Arg, m_Start);
+    }
+
+protected:
+    TCM_TRACE_SPAN(const TCM_TRACE_SPAN & other);
+    TCM_TRACE_SPAN & operator=(const TCM_TRACE_SPAN & rs);
+
+    const char *    m_Name;
+    const char *    m_Arg;
+    uint64_t        m_Start;
+};
+
+#endif /* _TCM_TRACE_H_ */
@@ -0,0 +1,389 @@
+//
+// Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+// All rights reserved.
+//
+// This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+//
+
+#include <new>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "_py.h"
+#include "tcm_cfs.h"
+#include "tcm_ops.h"
+#include "tcm_snapshot.h"
+#include "tcm_state.h"
+#include "tcm_trace.h"
+#include "tcmnode.h"
+
+static __thread char tcmnode_error[512];
+
+static int tcmnode_ok(void)
+{
+    tcmnode_error[0] = '\0';
+    return TCMNODE_OK;
+}
+
+static int tcmnode_fail(int code, const char * msg)
+{
+    snprintf(tcmnode_error, sizeof(tcmnode_error), "%s", msg == NULL ? "failed" : msg);
+    return code;
+}
+
+// Converts exception being handled to error code, must be called from catch block
+static int tcmnode_catch(void)
+{
+    try
+    {
+        throw;
+    }
+    catch (_py_SystemExit const & e)
+    {
+        return tcmnode_fail(e.code() != 0 ? e.code() : TCMNODE_ERR, e.what());
+    }
+    catch (_py_OSError const & e)
+    {
+        return tcmnode_fail(TCMNODE_ERR_SYS, e.what());
+    }
+    catch (_py_IOError const & e)
+    {
+        return tcmnode_fail(TCMNODE_ERR_SYS, e.what());
+    }
+    catch (std::bad_alloc const & e)
+    {
+        return tcmnode_fail(TCMNODE_ERR_NOMEM, strerror(ENOMEM));
+    }
+    catch (std::exception const & e)
+    {
+        return tcmnode_fail(TCMNODE_ERR, e.what());
+    }
+    catch (...)
+    {
+        return tcmnode_fail(TCMNODE_ERR, NULL);
+    }
+}
+
+const char * tcmnode_last_error(void)
+{
+    return tcmnode_error;
+}
+
+void tcmnode_set_verbose(int verbose)
+{
+    tcm_set_verbose(verbose != 0);
+}
+
+void tcmnode_flush_cache(void)
+{
+    tcm_cfs_flush();
+}
+
+int tcmnode_set_root(const char * target_root, const char * var_root)
+{
+    try
+    {
+        PY_ARENA arena;
+
+        if (var_root != NULL)
+            tcm_set_var_root((char *)var_root);
+        if (target_root != NULL)
+            tcm_cfs_set_root(target_root);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_set_emulate(int emulate, int latency_usecs)
+{
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_cfs_set_emulate(emulate != 0, latency_usecs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+void tcmnode_trace_start(void)
+{
+    tcm_trace_start();
+}
+
+int tcmnode_trace_write(const char * filename)
+{
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_trace_write(filename);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_create_dev(const char * dev_path, const char * plugin_params)
+{
+    if ((dev_path == NULL) || (plugin_params == NULL))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_createvirtdev((char *)dev_path, (char *)plugin_params);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_establish_dev(const char * dev_path, const char * plugin_params)
+{
+    if ((dev_path == NULL) || (plugin_params == NULL))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_establishvirtdev((char *)dev_path, (char *)plugin_params);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_free_dev(const char * dev_path)
+{
+    if (dev_path == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_freevirtdev((char *)dev_path);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_set_unit_serial_with_md(const char * dev_path, const char * unit_serial)
+{
+    if ((dev_path == NULL) || (unit_serial == NULL))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_set_wwn_unit_serial_with_md((char *)dev_path, (char *)unit_serial);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_add_alua_tgptgp_with_md(const char * dev_path, const char * gp_name, const char * gp_id)
+{
+    if ((dev_path == NULL) || (gp_name == NULL) || (gp_id == NULL))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_add_alua_tgptgp_with_md((char *)dev_path, (char *)gp_name, (char *)gp_id);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_write(const char * path, const char * value)
+{
+    if ((path == NULL) || (value == NULL))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_write((char *)path, (char *)value, false);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_dump(const char * format, int jobs)
+{
+    if (format == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_state_dump((char *)format, jobs < 1 ? 1 : jobs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_load(void)
+{
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_load();
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_restore(const char * filename, int jobs)
+{
+    if (filename == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_restore((char *)filename, jobs < 1 ? 1 : jobs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_reconcile(const char * filename, int jobs)
+{
+    if (filename == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_reconcile((char *)filename, jobs < 1 ? 1 : jobs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_snapshot_save(const char * filename, int jobs)
+{
+    if (filename == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_snapshot_save((char *)filename, jobs < 1 ? 1 : jobs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_snapshot_restore(const char * filename, int jobs)
+{
+    if (filename == NULL)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_snapshot_restore((char *)filename, jobs < 1 ? 1 : jobs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_unload(int jobs, int modwait_secs)
+{
+    try
+    {
+        PY_ARENA arena;
+
+        tcm_unload(jobs < 1 ? 1 : jobs, modwait_secs);
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+    return tcmnode_ok();
+}
+
+int tcmnode_version(char * buffer, int size)
+{
+    PY_STRING version;
+
+    if ((buffer == NULL) || (size < 1))
+        return tcmnode_fail(TCMNODE_ERR_INVAL, strerror(EINVAL));
+
+    try
+    {
+        PY_ARENA arena;
+
+        version = tcm_version();
+    }
+    catch (...)
+    {
+        return tcmnode_catch();
+    }
+
+    if (version.len() >= size)
+        return tcmnode_fail(TCMNODE_ERR_INVAL, "Buffer too small for version");
+    // Empty PY_STRING converts to NULL
+    if (version.len() > 0)
+        memcpy(buffer, (const char *)version, version.len());
+    buffer[version.len()] = '\0';
+    return tcmnode_ok();
+}
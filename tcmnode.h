@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015 Radovan Augustin, rado_augustin@yahoo.com
+ * All rights reserved.
+ *
+ * This file is part of tcm_node-cpp, licensed under BSD 3-Clause License.
+ */
+
+#ifndef _TCMNODE_H_
+#define _TCMNODE_H_ 1
+
+/*
+ * libtcmnode - C API of tcm_node operations
+ *
+ * Functions return TCMNODE_OK or error code, message of last error of the
+ * calling thread is returned by tcmnode_last_error().  Paths of devices
+ * are relative to <target root>/core, e.g. "iblock_0/disk", target root
+ * is /sys/kernel/config/target unless set by tcmnode_set_root().
+ * Operations on different HBAs can run in parallel threads.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define TCMNODE_API __attribute__((visibility("default")))
+#else
+#define TCMNODE_API
+#endif
+
+#define TCMNODE_OK          0
+#define TCMNODE_ERR         1       /* Operation failed, same as exit code of tcm_node */
+#define TCMNODE_ERR_NOMEM   2
+#define TCMNODE_ERR_INVAL   3       /* Invalid argument */
+#define TCMNODE_ERR_SYS     4       /* System call failed, e.g. configfs object does not exist */
+
+TCMNODE_API const char *    tcmnode_last_error              (void);
+TCMNODE_API void            tcmnode_set_verbose             (int verbose);  /* Print messages like tcm_node, off by default */
+TCMNODE_API void            tcmnode_flush_cache             (void);         /* Drops cached configfs handles and attributes */
+TCMNODE_API int             tcmnode_set_root                (const char * target_root, const char * var_root);  /* NULL keeps current root */
+TCMNODE_API int             tcmnode_set_emulate             (int emulate, int latency_usecs);   /* Target root is plain directory tree, see tcm_emu.h */
+TCMNODE_API void            tcmnode_trace_start             (void);         /* Records spans of configfs calls and operations */
+TCMNODE_API int             tcmnode_trace_write             (const char * filename);    /* Chrome trace-event JSON, see tcm_trace.h */
+
+TCMNODE_API int             tcmnode_create_dev              (const char * dev_path, const char * plugin_params);
+TCMNODE_API int             tcmnode_establish_dev           (const char * dev_path, const char * plugin_params);
+TCMNODE_API int             tcmnode_free_dev                (const char * dev_path);
+TCMNODE_API int             tcmnode_set_unit_serial_with_md (const char * dev_path, const char * unit_serial);
+TCMNODE_API int             tcmnode_add_alua_tgptgp_with_md (const char * dev_path, const char * gp_name, const char * gp_id);
+TCMNODE_API int             tcmnode_write                   (const char * path, const char * value);   /* Writes value as is */
+TCMNODE_API int             tcmnode_dump                    (const char * format, int jobs);         /* Prints live configuration as "text" or "json" */
+TCMNODE_API int             tcmnode_load                    (void);
+TCMNODE_API int             tcmnode_restore                 (const char * filename, int jobs);       /* targetcli saveconfig.json */
+TCMNODE_API int             tcmnode_reconcile               (const char * filename, int jobs);       /* Changes only what differs */
+TCMNODE_API int             tcmnode_snapshot_save           (const char * filename, int jobs);       /* Binary boot snapshot of iblock devices */
+TCMNODE_API int             tcmnode_snapshot_restore        (const char * filename, int jobs);
+TCMNODE_API int             tcmnode_unload                  (int jobs, int modwait_secs);
+TCMNODE_API int             tcmnode_version                 (char * buffer, int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TCMNODE_H_ */